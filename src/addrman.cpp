@@ -9,6 +9,18 @@
 #include "serialize.h"
 #include "streams.h"
 
+CAddrManAddrHasher::CAddrManAddrHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+size_t CAddrManAddrHasher::operator()(const CNetAddr& addr) const
+{
+    uint64_t nHigh = 0, nLow = 0;
+    for (int i = 0; i < 8; i++) {
+        nHigh = (nHigh << 8) | addr.GetByte(15 - i);
+        nLow = (nLow << 8) | addr.GetByte(7 - i);
+    }
+    return CSipHasher(k0, k1).Write(nHigh).Write(nLow).Finalize();
+}
+
 int CAddrInfo::GetTriedBucket(const uint256& nKey) const
 {
     uint64_t hash1 = (CHashWriter(SER_GETHASH, 0) << nKey << GetKey()).GetHash().GetCheapHash();
@@ -67,12 +79,12 @@ double CAddrInfo::GetChance(int64_t nNow) const
 
 CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int* pnId)
 {
-    std::map<CNetAddr, int>::iterator it = mapAddr.find(addr);
+    std::unordered_map<CNetAddr, int, CAddrManAddrHasher>::iterator it = mapAddr.find(addr);
     if (it == mapAddr.end())
         return NULL;
     if (pnId)
         *pnId = (*it).second;
-    std::map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
+    std::unordered_map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
     if (it2 != mapInfo.end())
         return &(*it2).second;
     return NULL;
@@ -110,6 +122,42 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
     vRandom[nRndPos2] = nId1;
 }
 
+void CAddrMan::SetTriedSlot(int nKBucket, int nKBucketPos, int nId)
+{
+    int nSlot = nKBucket * ADDRMAN_BUCKET_SIZE + nKBucketPos;
+    int& nSlotPos = vvTriedSlotPos[nKBucket][nKBucketPos];
+    if (nId != -1 && nSlotPos == -1) {
+        nSlotPos = vTriedSlots.size();
+        vTriedSlots.push_back(nSlot);
+    } else if (nId == -1 && nSlotPos != -1) {
+        // move the last occupied slot into the hole
+        int nSlotLast = vTriedSlots.back();
+        vTriedSlots[nSlotPos] = nSlotLast;
+        vvTriedSlotPos[nSlotLast / ADDRMAN_BUCKET_SIZE][nSlotLast % ADDRMAN_BUCKET_SIZE] = nSlotPos;
+        vTriedSlots.pop_back();
+        nSlotPos = -1;
+    }
+    vvTried[nKBucket][nKBucketPos] = nId;
+}
+
+void CAddrMan::SetNewSlot(int nUBucket, int nUBucketPos, int nId)
+{
+    int nSlot = nUBucket * ADDRMAN_BUCKET_SIZE + nUBucketPos;
+    int& nSlotPos = vvNewSlotPos[nUBucket][nUBucketPos];
+    if (nId != -1 && nSlotPos == -1) {
+        nSlotPos = vNewSlots.size();
+        vNewSlots.push_back(nSlot);
+    } else if (nId == -1 && nSlotPos != -1) {
+        // move the last occupied slot into the hole
+        int nSlotLast = vNewSlots.back();
+        vNewSlots[nSlotPos] = nSlotLast;
+        vvNewSlotPos[nSlotLast / ADDRMAN_BUCKET_SIZE][nSlotLast % ADDRMAN_BUCKET_SIZE] = nSlotPos;
+        vNewSlots.pop_back();
+        nSlotPos = -1;
+    }
+    vvNew[nUBucket][nUBucketPos] = nId;
+}
+
 void CAddrMan::Delete(int nId)
 {
     assert(mapInfo.count(nId) != 0);
@@ -132,7 +180,7 @@ void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
         CAddrInfo& infoDelete = mapInfo[nIdDelete];
         assert(infoDelete.nRefCount > 0);
         infoDelete.nRefCount--;
-        vvNew[nUBucket][nUBucketPos] = -1;
+        SetNewSlot(nUBucket, nUBucketPos, -1);
         if (infoDelete.nRefCount == 0) {
             Delete(nIdDelete);
         }
@@ -145,7 +193,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
     for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
         int pos = info.GetBucketPosition(nKey, true, bucket);
         if (vvNew[bucket][pos] == nId) {
-            vvNew[bucket][pos] = -1;
+            SetNewSlot(bucket, pos, -1);
             info.nRefCount--;
         }
     }
@@ -166,7 +214,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
 
         // Remove the to-be-evicted item from the tried set.
         infoOld.fInTried = false;
-        vvTried[nKBucket][nKBucketPos] = -1;
+        SetTriedSlot(nKBucket, nKBucketPos, -1);
         nTried--;
 
         // find which new bucket it belongs to
@@ -177,12 +225,12 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
 
         // Enter it into the new set again.
         infoOld.nRefCount = 1;
-        vvNew[nUBucket][nUBucketPos] = nIdEvict;
+        SetNewSlot(nUBucket, nUBucketPos, nIdEvict);
         nNew++;
     }
     assert(vvTried[nKBucket][nKBucketPos] == -1);
 
-    vvTried[nKBucket][nKBucketPos] = nId;
+    SetTriedSlot(nKBucket, nKBucketPos, nId);
     nTried++;
     info.fInTried = true;
 }
@@ -302,7 +350,7 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         if (fInsert) {
             ClearNew(nUBucket, nUBucketPos);
             pinfo->nRefCount++;
-            vvNew[nUBucket][nUBucketPos] = nId;
+            SetNewSlot(nUBucket, nUBucketPos, nId);
         } else {
             if (pinfo->nRefCount == 0) {
                 Delete(nId);
@@ -345,16 +393,11 @@ CAddrInfo CAddrMan::Select_(bool newOnly)
     // Use a 50% chance for choosing between tried and new table entries.
     if (!newOnly &&
        (nTried > 0 && (nNew == 0 || RandomInt(2) == 0))) { 
-        // use a tried node
+        // use a tried node, picking directly among the occupied slots
         double fChanceFactor = 1.0;
         while (1) {
-            int nKBucket = RandomInt(ADDRMAN_TRIED_BUCKET_COUNT);
-            int nKBucketPos = RandomInt(ADDRMAN_BUCKET_SIZE);
-            while (vvTried[nKBucket][nKBucketPos] == -1) {
-                nKBucket = (nKBucket + insecure_rand.rand32()) % ADDRMAN_TRIED_BUCKET_COUNT;
-                nKBucketPos = (nKBucketPos + insecure_rand.rand32()) % ADDRMAN_BUCKET_SIZE;
-            }
-            int nId = vvTried[nKBucket][nKBucketPos];
+            int nSlot = vTriedSlots[RandomInt(vTriedSlots.size())];
+            int nId = vvTried[nSlot / ADDRMAN_BUCKET_SIZE][nSlot % ADDRMAN_BUCKET_SIZE];
             assert(mapInfo.count(nId) == 1);
             CAddrInfo& info = mapInfo[nId];
             if (RandomInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
@@ -362,16 +405,11 @@ CAddrInfo CAddrMan::Select_(bool newOnly)
             fChanceFactor *= 1.2;
         }
     } else {
-        // use a new node
+        // use a new node, picking directly among the occupied slots
         double fChanceFactor = 1.0;
         while (1) {
-            int nUBucket = RandomInt(ADDRMAN_NEW_BUCKET_COUNT);
-            int nUBucketPos = RandomInt(ADDRMAN_BUCKET_SIZE);
-            while (vvNew[nUBucket][nUBucketPos] == -1) {
-                nUBucket = (nUBucket + insecure_rand.rand32()) % ADDRMAN_NEW_BUCKET_COUNT;
-                nUBucketPos = (nUBucketPos + insecure_rand.rand32()) % ADDRMAN_BUCKET_SIZE;
-            }
-            int nId = vvNew[nUBucket][nUBucketPos];
+            int nSlot = vNewSlots[RandomInt(vNewSlots.size())];
+            int nId = vvNew[nSlot / ADDRMAN_BUCKET_SIZE][nSlot % ADDRMAN_BUCKET_SIZE];
             assert(mapInfo.count(nId) == 1);
             CAddrInfo& info = mapInfo[nId];
             if (RandomInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
@@ -390,7 +428,7 @@ int CAddrMan::Check_()
     if (vRandom.size() != nTried + nNew)
         return -7;
 
-    for (std::map<int, CAddrInfo>::iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
+    for (std::unordered_map<int, CAddrInfo>::iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
         int n = (*it).first;
         CAddrInfo& info = (*it).second;
         if (info.fInTried) {
@@ -418,12 +456,18 @@ int CAddrMan::Check_()
 
     if (setTried.size() != nTried)
         return -9;
+    if (vTriedSlots.size() != nTried)
+        return -24;
     if (mapNew.size() != nNew)
         return -10;
 
     for (int n = 0; n < ADDRMAN_TRIED_BUCKET_COUNT; n++) {
         for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
+             if ((vvTried[n][i] != -1) != (vvTriedSlotPos[n][i] != -1))
+                 return -20;
              if (vvTried[n][i] != -1) {
+                 if (vTriedSlots[vvTriedSlotPos[n][i]] != n * ADDRMAN_BUCKET_SIZE + i)
+                     return -21;
                  if (!setTried.count(vvTried[n][i]))
                      return -11;
                  if (mapInfo[vvTried[n][i]].GetTriedBucket(nKey) != n)
@@ -437,7 +481,11 @@ int CAddrMan::Check_()
 
     for (int n = 0; n < ADDRMAN_NEW_BUCKET_COUNT; n++) {
         for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
+            if ((vvNew[n][i] != -1) != (vvNewSlotPos[n][i] != -1))
+                return -22;
             if (vvNew[n][i] != -1) {
+                if (vNewSlots[vvNewSlotPos[n][i]] != n * ADDRMAN_BUCKET_SIZE + i)
+                    return -23;
                 if (!mapNew.count(vvNew[n][i]))
                     return -12;
                 if (mapInfo[vvNew[n][i]].GetBucketPosition(nKey, true, n) != i)
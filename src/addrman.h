@@ -16,6 +16,7 @@
 #include <map>
 #include <set>
 #include <stdint.h>
+#include <unordered_map>
 #include <vector>
 
 /**
@@ -171,6 +172,19 @@ public:
 //! the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+/** Salted hasher for the address lookup index of CAddrMan. Only the IP is hashed, matching CNetAddr::operator==. */
+class CAddrManAddrHasher
+{
+private:
+    /** Salt */
+    const uint64_t k0, k1;
+
+public:
+    CAddrManAddrHasher();
+
+    size_t operator()(const CNetAddr& addr) const;
+};
+
 /** 
  * Stochastical (IP) address manager 
  */
@@ -184,10 +198,10 @@ private:
     int nIdCount;
 
     //! table with information about all nIds
-    std::map<int, CAddrInfo> mapInfo;
+    std::unordered_map<int, CAddrInfo> mapInfo;
 
     //! find an nId based on its network address
-    std::map<CNetAddr, int> mapAddr;
+    std::unordered_map<CNetAddr, int, CAddrManAddrHasher> mapAddr;
 
     //! randomly-ordered vector of all nIds
     std::vector<int> vRandom;
@@ -204,9 +218,24 @@ private:
     //! list of "new" buckets
     int vvNew[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
 
+    //! dense list of occupied "tried" slots (bucket * ADDRMAN_BUCKET_SIZE + position), in no particular order
+    std::vector<int> vTriedSlots;
+
+    //! index of each "tried" slot in vTriedSlots, or -1 if the slot is empty
+    int vvTriedSlotPos[ADDRMAN_TRIED_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
+
+    //! dense list of occupied "new" slots (bucket * ADDRMAN_BUCKET_SIZE + position), in no particular order
+    std::vector<int> vNewSlots;
+
+    //! index of each "new" slot in vNewSlots, or -1 if the slot is empty
+    int vvNewSlotPos[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
+
     //! last time Good was called (memory only)
     int64_t nLastGood;
 
+    //! number of modifications since construction, used to skip redundant peers.dat writes (memory only)
+    uint64_t nChangeCount;
+
 protected:
     //! secret key to randomize bucket select with
     uint256 nKey;
@@ -224,6 +253,12 @@ protected:
     //! Swap two elements in vRandom.
     void SwapRandom(unsigned int nRandomPos1, unsigned int nRandomPos2);
 
+    //! Store nId (or -1 to clear) in a "tried" slot, keeping the dense slot list in sync.
+    void SetTriedSlot(int nKBucket, int nKBucketPos, int nId);
+
+    //! Store nId (or -1 to clear) in a "new" slot, keeping the dense slot list in sync.
+    void SetNewSlot(int nUBucket, int nUBucketPos, int nId);
+
     //! Move an entry from the "new" table(s) to the "tried" table
     void MakeTried(CAddrInfo& info, int nId);
 
@@ -306,9 +341,10 @@ public:
 
         int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT ^ (1 << 30);
         s << nUBuckets;
-        std::map<int, int> mapUnkIds;
+        std::unordered_map<int, int> mapUnkIds;
+        mapUnkIds.reserve(mapInfo.size());
         int nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
+        for (std::unordered_map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
             mapUnkIds[(*it).first] = nIds;
             const CAddrInfo &info = (*it).second;
             if (info.nRefCount) {
@@ -318,7 +354,7 @@ public:
             }
         }
         nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
+        for (std::unordered_map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
             const CAddrInfo &info = (*it).second;
             if (info.fInTried) {
                 assert(nIds != nTried); // this means nTried was wrong, oh ow
@@ -335,7 +371,7 @@ public:
             s << nSize;
             for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
                 if (vvNew[bucket][i] != -1) {
-                    int nIndex = mapUnkIds[vvNew[bucket][i]];
+                    int nIndex = mapUnkIds.at(vvNew[bucket][i]);
                     s << nIndex;
                 }
             }
@@ -371,6 +407,9 @@ public:
             throw std::ios_base::failure("Corrupt CAddrMan serialization, nTried exceeds limit.");
         }
 
+        mapInfo.reserve(nNew + nTried);
+        mapAddr.reserve(nNew + nTried);
+
         // Deserialize entries from the new table.
         for (int n = 0; n < nNew; n++) {
             CAddrInfo &info = mapInfo[n];
@@ -384,7 +423,7 @@ public:
                 int nUBucket = info.GetNewBucket(nKey);
                 int nUBucketPos = info.GetBucketPosition(nKey, true, nUBucket);
                 if (vvNew[nUBucket][nUBucketPos] == -1) {
-                    vvNew[nUBucket][nUBucketPos] = n;
+                    SetNewSlot(nUBucket, nUBucketPos, n);
                     info.nRefCount++;
                 }
             }
@@ -404,7 +443,7 @@ public:
                 vRandom.push_back(nIdCount);
                 mapInfo[nIdCount] = info;
                 mapAddr[info] = nIdCount;
-                vvTried[nKBucket][nKBucketPos] = nIdCount;
+                SetTriedSlot(nKBucket, nKBucketPos, nIdCount);
                 nIdCount++;
             } else {
                 nLost++;
@@ -424,7 +463,7 @@ public:
                     int nUBucketPos = info.GetBucketPosition(nKey, true, bucket);
                     if (nVersion == 1 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew[bucket][nUBucketPos] == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) {
                         info.nRefCount++;
-                        vvNew[bucket][nUBucketPos] = nIndex;
+                        SetNewSlot(bucket, nUBucketPos, nIndex);
                     }
                 }
             }
@@ -432,9 +471,9 @@ public:
 
         // Prune new entries with refcount 0 (as a result of collisions).
         int nLostUnk = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); ) {
+        for (std::unordered_map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); ) {
             if (it->second.fInTried == false && it->second.nRefCount == 0) {
-                std::map<int, CAddrInfo>::const_iterator itCopy = it++;
+                std::unordered_map<int, CAddrInfo>::const_iterator itCopy = it++;
                 Delete(itCopy->first);
                 nLostUnk++;
             } else {
@@ -451,15 +490,21 @@ public:
     void Clear()
     {
         std::vector<int>().swap(vRandom);
+        std::vector<int>().swap(vNewSlots);
+        std::vector<int>().swap(vTriedSlots);
+        mapInfo.clear();
+        mapAddr.clear();
         nKey = GetRandHash();
         for (size_t bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
             for (size_t entry = 0; entry < ADDRMAN_BUCKET_SIZE; entry++) {
                 vvNew[bucket][entry] = -1;
+                vvNewSlotPos[bucket][entry] = -1;
             }
         }
         for (size_t bucket = 0; bucket < ADDRMAN_TRIED_BUCKET_COUNT; bucket++) {
             for (size_t entry = 0; entry < ADDRMAN_BUCKET_SIZE; entry++) {
                 vvTried[bucket][entry] = -1;
+                vvTriedSlotPos[bucket][entry] = -1;
             }
         }
 
@@ -467,9 +512,10 @@ public:
         nTried = 0;
         nNew = 0;
         nLastGood = 1; //Initially at 1 so that "never" is strictly worse.
+        nChangeCount++;
     }
 
-    CAddrMan()
+    CAddrMan() : nChangeCount(0)
     {
         Clear();
     }
@@ -486,6 +532,13 @@ public:
         return vRandom.size();
     }
 
+    //! Return a counter that changes whenever the tables may have been modified.
+    uint64_t GetChangeCount() const
+    {
+        LOCK(cs);
+        return nChangeCount;
+    }
+
     //! Consistency check
     void Check()
     {
@@ -506,6 +559,7 @@ public:
         bool fRet = false;
         Check();
         fRet |= Add_(addr, source, nTimePenalty);
+        nChangeCount++;
         Check();
         if (fRet)
             LogPrint("addrman", "Added %s from %s: %i tried, %i new\n", addr.ToStringIPPort(), source.ToString(), nTried, nNew);
@@ -520,6 +574,7 @@ public:
         Check();
         for (std::vector<CAddress>::const_iterator it = vAddr.begin(); it != vAddr.end(); it++)
             nAdd += Add_(*it, source, nTimePenalty) ? 1 : 0;
+        nChangeCount++;
         Check();
         if (nAdd)
             LogPrint("addrman", "Added %i addresses from %s: %i tried, %i new\n", nAdd, source.ToString(), nTried, nNew);
@@ -532,6 +587,7 @@ public:
         LOCK(cs);
         Check();
         Good_(addr, nTime);
+        nChangeCount++;
         Check();
     }
 
@@ -541,6 +597,7 @@ public:
         LOCK(cs);
         Check();
         Attempt_(addr, fCountFailure, nTime);
+        nChangeCount++;
         Check();
     }
 
@@ -578,6 +635,7 @@ public:
         LOCK(cs);
         Check();
         Connected_(addr, nTime);
+        nChangeCount++;
         Check();
     }
 
@@ -586,6 +644,7 @@ public:
         LOCK(cs);
         Check();
         SetServices_(addr, nServices);
+        nChangeCount++;
         Check();
     }
 
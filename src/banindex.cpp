@@ -0,0 +1,168 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "banindex.h"
+
+#include <algorithm>
+
+static inline void GetAddrKey(const CNetAddr& addr, uint64_t nKey[2])
+{
+    nKey[0] = nKey[1] = 0;
+    // GetByte counts from the end of the address
+    for (int i = 0; i < 16; i++)
+        nKey[i >> 3] = (nKey[i >> 3] << 8) | addr.GetByte(15 - i);
+}
+
+static inline bool GetKeyBit(const uint64_t nKey[2], int nBit)
+{
+    return (nKey[nBit >> 6] >> (63 - (nBit & 63))) & 1;
+}
+
+static inline int CountLeadingZeros(uint64_t n)
+{
+    int nZeros = 0;
+    for (int nShift = 32; nShift > 0; nShift >>= 1) {
+        if ((n >> (64 - nShift)) == 0) {
+            nZeros += nShift;
+            n <<= nShift;
+        }
+    }
+    return nZeros + (n == 0);
+}
+
+/** Number of leading bits a and b have in common, at most nMax */
+static inline int CommonPrefixLength(const uint64_t a[2], const uint64_t b[2], int nMax)
+{
+    int nCommon = (a[0] != b[0]) ? CountLeadingZeros(a[0] ^ b[0]) : 64 + CountLeadingZeros(a[1] ^ b[1]);
+    return std::min(nCommon, nMax);
+}
+
+static inline void MaskKey(uint64_t nKey[2], int nBits)
+{
+    for (int i = 0; i < 2; i++) {
+        int nKeep = std::max(0, std::min(64, nBits - 64 * i));
+        nKey[i] = (nKeep == 0) ? 0 : (nKey[i] & (~(uint64_t)0 << (64 - nKeep)));
+    }
+}
+
+CBanIndex::CBanIndex()
+{
+    Clear();
+}
+
+void CBanIndex::Clear()
+{
+    vNodes.clear();
+    vNodes.push_back(Node());
+    mapNonPrefix.clear();
+}
+
+void CBanIndex::Rebuild(const banmap_t& banmap)
+{
+    Clear();
+    for (banmap_t::const_iterator it = banmap.begin(); it != banmap.end(); it++)
+        Insert(it->first, it->second.nBanUntil);
+}
+
+uint32_t CBanIndex::AddNode(const uint64_t nKey[2], int nBits)
+{
+    Node node;
+    node.nKey[0] = nKey[0];
+    node.nKey[1] = nKey[1];
+    MaskKey(node.nKey, nBits);
+    node.nBits = nBits;
+    vNodes.push_back(node);
+    return vNodes.size() - 1;
+}
+
+void CBanIndex::Insert(const CSubNet& subnet, int64_t nBanUntil)
+{
+    if (!subnet.IsValid())
+        return;
+    int nPrefixLength = subnet.GetPrefixLength();
+    if (nPrefixLength < 0) {
+        mapNonPrefix[subnet] = nBanUntil;
+        return;
+    }
+
+    uint64_t nKey[2];
+    GetAddrKey(subnet.GetNetwork(), nKey);
+    uint32_t nNode = 0;
+    while (vNodes[nNode].nBits < nPrefixLength) {
+        bool fBit = GetKeyBit(nKey, vNodes[nNode].nBits);
+        uint32_t nChild = vNodes[nNode].vChild[fBit];
+        if (nChild == 0) {
+            uint32_t nLeaf = AddNode(nKey, nPrefixLength);
+            vNodes[nNode].vChild[fBit] = nLeaf;
+            nNode = nLeaf;
+            break;
+        }
+        int nCommon = CommonPrefixLength(nKey, vNodes[nChild].nKey, std::min(nPrefixLength, vNodes[nChild].nBits));
+        if (nCommon < vNodes[nChild].nBits) {
+            // The child's prefix runs past where the subnet ends or branches
+            // off; put a node for the common part in between.
+            uint32_t nSplit = AddNode(nKey, nCommon);
+            vNodes[nSplit].vChild[GetKeyBit(vNodes[nChild].nKey, nCommon)] = nChild;
+            vNodes[nNode].vChild[fBit] = nSplit;
+            nChild = nSplit;
+        }
+        nNode = nChild;
+    }
+    vNodes[nNode].nBanUntil = nBanUntil;
+}
+
+uint32_t CBanIndex::Find(const uint64_t nKey[2], int nBits) const
+{
+    uint32_t nNode = 0;
+    while (vNodes[nNode].nBits < nBits) {
+        nNode = vNodes[nNode].vChild[GetKeyBit(nKey, vNodes[nNode].nBits)];
+        if (nNode == 0 || vNodes[nNode].nBits > nBits || CommonPrefixLength(nKey, vNodes[nNode].nKey, nBits) < vNodes[nNode].nBits)
+            return 0;
+    }
+    return nNode;
+}
+
+void CBanIndex::Erase(const CSubNet& subnet)
+{
+    if (!subnet.IsValid())
+        return;
+    int nPrefixLength = subnet.GetPrefixLength();
+    if (nPrefixLength < 0) {
+        mapNonPrefix.erase(subnet);
+        return;
+    }
+
+    // The node stays behind; Rebuild drops it.
+    uint64_t nKey[2];
+    GetAddrKey(subnet.GetNetwork(), nKey);
+    uint32_t nNode = Find(nKey, nPrefixLength);
+    if (nNode != 0 || nPrefixLength == 0)
+        vNodes[nNode].nBanUntil = 0;
+}
+
+bool CBanIndex::IsBanned(const CNetAddr& addr, int64_t nNow) const
+{
+    if (!addr.IsValid())
+        return false;
+
+    // Every node on the way down is a subnet containing addr
+    uint64_t nKey[2];
+    GetAddrKey(addr, nKey);
+    uint32_t nNode = 0;
+    while (true) {
+        if (nNow < vNodes[nNode].nBanUntil)
+            return true;
+        if (vNodes[nNode].nBits == 128)
+            break;
+        nNode = vNodes[nNode].vChild[GetKeyBit(nKey, vNodes[nNode].nBits)];
+        if (nNode == 0 || CommonPrefixLength(nKey, vNodes[nNode].nKey, vNodes[nNode].nBits) < vNodes[nNode].nBits)
+            break;
+    }
+
+    for (std::map<CSubNet, int64_t>::const_iterator it = mapNonPrefix.begin(); it != mapNonPrefix.end(); it++) {
+        if (nNow < it->second && it->first.Match(addr))
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,70 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BANINDEX_H
+#define BITCOIN_BANINDEX_H
+
+#include "addrdb.h"
+#include "netaddress.h"
+
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Index of the ban list for address lookups.
+ *
+ * Banned subnets are kept in a path compressed binary trie over the 128 bit
+ * address space, in which IPv4 and onion addresses live the same way CNetAddr
+ * stores them. Every node holds its whole prefix, so nodes only exist where a
+ * banned subnet ends or two of them branch: there are at most two per banned
+ * subnet, and checking an address only visits the banned subnets containing
+ * it plus the branch points above them. Subnets with a netmask that isn't a
+ * prefix (a.b.c.d/255.0.255.0) can't be put in the trie and are matched one
+ * by one.
+ *
+ * The index does not own the ban list: banmap_t stays the authoritative copy
+ * (which is what gets written to banlist.dat), and the index is kept in sync
+ * with it by the caller.
+ */
+class CBanIndex
+{
+public:
+    CBanIndex();
+
+    void Clear();
+    /** Replace the contents of the index with the given ban list */
+    void Rebuild(const banmap_t& banmap);
+    /** Add a subnet, or change the time it's banned until */
+    void Insert(const CSubNet& subnet, int64_t nBanUntil);
+    void Erase(const CSubNet& subnet);
+
+    /** Whether addr is in any subnet that is banned until after nNow */
+    bool IsBanned(const CNetAddr& addr, int64_t nNow) const;
+
+    size_t GetNodeCount() const { return vNodes.size(); }
+
+private:
+    struct Node {
+        //! The node's prefix, most significant bits first, with the bits past nBits cleared
+        uint64_t nKey[2];
+        //! Length of the prefix in bits; longer than the parent's
+        int nBits;
+        //! Indexes of the children in vNodes by the bit after the prefix, 0 for none (the root is never a child)
+        uint32_t vChild[2];
+        //! Until when the subnet ending at this node is banned, 0 if none ends here
+        int64_t nBanUntil;
+
+        Node() : nBits(0), nBanUntil(0) { nKey[0] = nKey[1] = 0; vChild[0] = vChild[1] = 0; }
+    };
+
+    /** Index of the node for exactly this prefix, or 0 if there is none */
+    uint32_t Find(const uint64_t nKey[2], int nBits) const;
+    uint32_t AddNode(const uint64_t nKey[2], int nBits);
+
+    std::vector<Node> vNodes;
+    std::map<CSubNet, int64_t> mapNonPrefix;
+};
+
+#endif // BITCOIN_BANINDEX_H
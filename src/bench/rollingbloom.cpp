@@ -8,9 +8,10 @@
 #include "bloom.h"
 #include "utiltime.h"
 
-static void RollingBloom(benchmark::State& state)
+template <typename Filter>
+static void RollingBloomBench(benchmark::State& state, const char* name)
 {
-    CRollingBloomFilter filter(120000, 0.000001);
+    Filter filter(120000, 0.000001);
     std::vector<unsigned char> data(32);
     uint32_t count = 0;
     uint32_t nEntriesPerGeneration = (120000 + 1) / 2;
@@ -26,7 +27,7 @@ static void RollingBloom(benchmark::State& state)
             int64_t b = GetTimeMicros();
             filter.insert(data);
             int64_t e = GetTimeMicros();
-            std::cout << "RollingBloom-refresh,1," << (e-b)*0.000001 << "," << (e-b)*0.000001 << "," << (e-b)*0.000001 << "\n";
+            std::cout << name << "-refresh,1," << (e-b)*0.000001 << "," << (e-b)*0.000001 << "," << (e-b)*0.000001 << "\n";
             countnow = 0;
         } else {
             filter.insert(data);
@@ -40,4 +41,15 @@ static void RollingBloom(benchmark::State& state)
     }
 }
 
+static void RollingBloom(benchmark::State& state)
+{
+    RollingBloomBench<CRollingBloomFilter>(state, "RollingBloom");
+}
+
+static void BlockedRollingBloom(benchmark::State& state)
+{
+    RollingBloomBench<CBlockedRollingBloomFilter>(state, "BlockedRollingBloom");
+}
+
 BENCHMARK(RollingBloom);
+BENCHMARK(BlockedRollingBloom);
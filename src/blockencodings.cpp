@@ -13,8 +13,6 @@
 #include "validation.h"
 #include "util.h"
 
-#include <unordered_map>
-
 #define MIN_TRANSACTION_BASE_SIZE (::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS))
 
 CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block, bool fUseWTXID) :
@@ -45,6 +43,63 @@ uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const {
     return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffL;
 }
 
+void CBlockHeaderAndShortTxIDs::GetShortIDs(const uint256* const txhashes[4], uint64_t shortids[4]) const {
+    SipHashUint256x4(shorttxidk0, shorttxidk1, txhashes, shortids);
+    for (int i = 0; i < 4; i++)
+        shortids[i] &= 0xffffffffffffL;
+}
+
+namespace {
+/**
+ * Open-addressing map from short IDs to block positions, probed linearly.
+ * Each slot packs the 48-bit short ID above the position plus one, so a
+ * zero slot is empty and checking a candidate touches a single word. The
+ * table is kept at most a quarter full, so a mempool transaction that is
+ * not in the block usually misses on its first slot.
+ */
+class ShortTxIDIndex {
+    std::vector<uint64_t> slots;
+    uint64_t mask;
+
+public:
+    /** Longest probe sequence accepted before treating the short IDs as maliciously clustered. */
+    static const unsigned int MAX_PROBE_LENGTH = 64;
+
+    explicit ShortTxIDIndex(size_t count) {
+        size_t size = 16;
+        while (size < count * 4)
+            size <<= 1;
+        slots.assign(size, 0);
+        mask = size - 1;
+    }
+
+    /** Returns false if shortid is already present or lands too far from its home slot. */
+    bool Insert(uint64_t shortid, uint16_t index) {
+        for (unsigned int probe = 0; probe < MAX_PROBE_LENGTH; probe++) {
+            uint64_t& slot = slots[(shortid + probe) & mask];
+            if (slot == 0) {
+                slot = (shortid << 16) | ((uint64_t)index + 1);
+                return true;
+            }
+            if ((slot >> 16) == shortid)
+                return false;
+        }
+        return false;
+    }
+
+    /** Returns the block position stored for shortid, or -1. */
+    int Find(uint64_t shortid) const {
+        for (uint64_t pos = shortid & mask; ; pos = (pos + 1) & mask) {
+            const uint64_t slot = slots[pos];
+            if (slot == 0)
+                return -1;
+            if ((slot >> 16) == shortid)
+                return (int)(slot & 0xffff) - 1;
+        }
+    }
+};
+} // anon namespace
+
 
 
 ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<std::pair<uint256, CTransactionRef>>& extra_txn) {
@@ -78,68 +133,67 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
     // Calculate map of txids -> positions and check mempool to see what we have (or don't)
     // Because well-formed cmpctblock messages will have a (relatively) uniform distribution
     // of short IDs, any highly-uneven distribution of elements can be safely treated as a
-    // READ_STATUS_FAILED.
-    std::unordered_map<uint64_t, uint16_t> shorttxids(cmpctblock.shorttxids.size());
+    // READ_STATUS_FAILED. With the index at most a quarter full, a probe sequence longer
+    // than ShortTxIDIndex::MAX_PROBE_LENGTH is vanishingly unlikely for honest short IDs.
+    // TODO: in the shortid-collision case, we should instead request both transactions
+    // which collided. Falling back to full-block-request here is overkill.
+    const size_t shorttxids_count = cmpctblock.shorttxids.size();
+    ShortTxIDIndex shorttxids(shorttxids_count);
     uint16_t index_offset = 0;
-    for (size_t i = 0; i < cmpctblock.shorttxids.size(); i++) {
+    for (size_t i = 0; i < shorttxids_count; i++) {
         while (txn_available[i + index_offset])
             index_offset++;
-        shorttxids[cmpctblock.shorttxids[i]] = i + index_offset;
-        // To determine the chance that the number of entries in a bucket exceeds N,
-        // we use the fact that the number of elements in a single bucket is
-        // binomially distributed (with n = the number of shorttxids S, and p =
-        // 1 / the number of buckets), that in the worst case the number of buckets is
-        // equal to S (due to std::unordered_map having a default load factor of 1.0),
-        // and that the chance for any bucket to exceed N elements is at most
-        // buckets * (the chance that any given bucket is above N elements).
-        // Thus: P(max_elements_per_bucket > N) <= S * (1 - cdf(binomial(n=S,p=1/S), N)).
-        // If we assume blocks of up to 16000, allowing 12 elements per bucket should
-        // only fail once per ~1 million block transfers (per peer and connection).
-        if (shorttxids.bucket_size(shorttxids.bucket(cmpctblock.shorttxids[i])) > 12)
-            return READ_STATUS_FAILED;
+        if (!shorttxids.Insert(cmpctblock.shorttxids[i], i + index_offset))
+            return READ_STATUS_FAILED; // Short ID collision or uneven distribution
     }
-    // TODO: in the shortid-collision case, we should instead request both transactions
-    // which collided. Falling back to full-block-request here is overkill.
-    if (shorttxids.size() != cmpctblock.shorttxids.size())
-        return READ_STATUS_FAILED; // Short ID collision
 
     std::vector<bool> have_txn(txn_available.size());
     {
     LOCK(pool->cs);
     const std::vector<std::pair<uint256, CTxMemPool::txiter> >& vTxHashes = pool->vTxHashes;
-    for (size_t i = 0; i < vTxHashes.size(); i++) {
-        uint64_t shortid = cmpctblock.GetShortID(vTxHashes[i].first);
-        std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
-        if (idit != shorttxids.end()) {
-            if (!have_txn[idit->second]) {
-                txn_available[idit->second] = vTxHashes[i].second->GetSharedTx();
-                have_txn[idit->second]  = true;
-                mempool_count++;
-            } else {
-                // If we find two mempool txn that match the short id, just request it.
-                // This should be rare enough that the extra bandwidth doesn't matter,
-                // but eating a round-trip due to FillBlock failure would be annoying
-                if (txn_available[idit->second]) {
-                    txn_available[idit->second].reset();
-                    mempool_count--;
+    uint64_t batch_shortids[4];
+    for (size_t i = 0; i < vTxHashes.size() && mempool_count != shorttxids_count; i += 4) {
+        // Short IDs are computed four at a time; only the tail of the mempool goes one by one
+        const size_t batch_size = std::min<size_t>(4, vTxHashes.size() - i);
+        if (batch_size == 4) {
+            const uint256* const batch_hashes[4] = {&vTxHashes[i].first, &vTxHashes[i + 1].first, &vTxHashes[i + 2].first, &vTxHashes[i + 3].first};
+            cmpctblock.GetShortIDs(batch_hashes, batch_shortids);
+        } else {
+            for (size_t j = 0; j < batch_size; j++)
+                batch_shortids[j] = cmpctblock.GetShortID(vTxHashes[i + j].first);
+        }
+        for (size_t j = 0; j < batch_size; j++) {
+            int idx = shorttxids.Find(batch_shortids[j]);
+            if (idx >= 0) {
+                if (!have_txn[idx]) {
+                    txn_available[idx] = vTxHashes[i + j].second->GetSharedTx();
+                    have_txn[idx]  = true;
+                    mempool_count++;
+                } else {
+                    // If we find two mempool txn that match the short id, just request it.
+                    // This should be rare enough that the extra bandwidth doesn't matter,
+                    // but eating a round-trip due to FillBlock failure would be annoying
+                    if (txn_available[idx]) {
+                        txn_available[idx].reset();
+                        mempool_count--;
+                    }
                 }
             }
+            // Though ideally we'd continue scanning for the two-txn-match-shortid case,
+            // the performance win of an early exit here is too good to pass up and worth
+            // the extra risk.
+            if (mempool_count == shorttxids_count)
+                break;
         }
-        // Though ideally we'd continue scanning for the two-txn-match-shortid case,
-        // the performance win of an early exit here is too good to pass up and worth
-        // the extra risk.
-        if (mempool_count == shorttxids.size())
-            break;
     }
     }
 
     for (size_t i = 0; i < extra_txn.size(); i++) {
-        uint64_t shortid = cmpctblock.GetShortID(extra_txn[i].first);
-        std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
-        if (idit != shorttxids.end()) {
-            if (!have_txn[idit->second]) {
-                txn_available[idit->second] = extra_txn[i].second;
-                have_txn[idit->second]  = true;
+        int idx = shorttxids.Find(cmpctblock.GetShortID(extra_txn[i].first));
+        if (idx >= 0) {
+            if (!have_txn[idx]) {
+                txn_available[idx] = extra_txn[i].second;
+                have_txn[idx]  = true;
                 mempool_count++;
                 extra_count++;
             } else {
@@ -149,9 +203,9 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
                 // but eating a round-trip due to FillBlock failure would be annoying
                 // Note that we dont want duplication between extra_txn and mempool to
                 // trigger this case, so we compare witness hashes first
-                if (txn_available[idit->second] &&
-                        txn_available[idit->second]->GetWitnessHash() != extra_txn[i].second->GetWitnessHash()) {
-                    txn_available[idit->second].reset();
+                if (txn_available[idx] &&
+                        txn_available[idx]->GetWitnessHash() != extra_txn[i].second->GetWitnessHash()) {
+                    txn_available[idx].reset();
                     mempool_count--;
                     extra_count--;
                 }
@@ -160,7 +214,7 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
         // Though ideally we'd continue scanning for the two-txn-match-shortid case,
         // the performance win of an early exit here is too good to pass up and worth
         // the extra risk.
-        if (mempool_count == shorttxids.size())
+        if (mempool_count == shorttxids_count)
             break;
     }
 
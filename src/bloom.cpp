@@ -5,7 +5,9 @@
 #include "bloom.h"
 
 #include "primitives/transaction.h"
+#include "crypto/common.h"
 #include "hash.h"
+#include "memusage.h"
 #include "script/script.h"
 #include "script/standard.h"
 #include "random.h"
@@ -50,40 +52,95 @@ CBloomFilter::CBloomFilter(unsigned int nElements, double nFPRate, unsigned int
 {
 }
 
-inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const
+/** Size of a COutPoint in its network serialization: the txid followed by a little-endian output index. */
+static const size_t SERIALIZED_OUTPOINT_SIZE = 36;
+
+static void SerializeOutPoint(const COutPoint& outpoint, unsigned char out[SERIALIZED_OUTPOINT_SIZE])
+{
+    memcpy(out, outpoint.hash.begin(), 32);
+    WriteLE32(out + 32, outpoint.n);
+}
+
+CBloomFilterElements::CBloomFilterElements(const CTransaction& tx)
+{
+    vOutputEnd.reserve(tx.vout.size());
+    for (const CTxOut& txout : tx.vout) {
+        AddPushes(txout.scriptPubKey);
+        vOutputEnd.push_back(vElementEnd.size());
+    }
+    vInputEnd.reserve(tx.vin.size());
+    for (const CTxIn& txin : tx.vin) {
+        unsigned char prevout[SERIALIZED_OUTPOINT_SIZE];
+        SerializeOutPoint(txin.prevout, prevout);
+        AddElement(prevout, prevout + SERIALIZED_OUTPOINT_SIZE);
+        AddPushes(txin.scriptSig);
+        vInputEnd.push_back(vElementEnd.size());
+    }
+}
+
+void CBloomFilterElements::AddElement(const unsigned char* pbegin, const unsigned char* pend)
+{
+    vData.insert(vData.end(), pbegin, pend);
+    vElementEnd.push_back(vData.size());
+}
+
+void CBloomFilterElements::AddPushes(const CScript& script)
+{
+    // Empty pushes never match, and a script is only used up to its first invalid opcode
+    CScript::const_iterator pc = script.begin();
+    std::vector<unsigned char> data;
+    while (pc < script.end())
+    {
+        opcodetype opcode;
+        if (!script.GetOp(pc, opcode, data))
+            break;
+        if (data.size() != 0)
+            AddElement(data.data(), data.data() + data.size());
+    }
+}
+
+size_t CBloomFilterElements::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(vData) + memusage::DynamicUsage(vElementEnd) + memusage::DynamicUsage(vOutputEnd) + memusage::DynamicUsage(vInputEnd);
+}
+
+inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const unsigned char* pDataToHash, size_t nSize) const
 {
     // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
-    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, vDataToHash) % (vData.size() * 8);
+    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, pDataToHash, nSize) % (vData.size() * 8);
 }
 
-void CBloomFilter::insert(const std::vector<unsigned char>& vKey)
+void CBloomFilter::insert(const unsigned char* pKey, size_t nSize)
 {
     if (isFull)
         return;
     for (unsigned int i = 0; i < nHashFuncs; i++)
     {
-        unsigned int nIndex = Hash(i, vKey);
+        unsigned int nIndex = Hash(i, pKey, nSize);
         // Sets bit nIndex of vData
         vData[nIndex >> 3] |= (1 << (7 & nIndex));
     }
     isEmpty = false;
 }
 
+void CBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    insert(vKey.data(), vKey.size());
+}
+
 void CBloomFilter::insert(const COutPoint& outpoint)
 {
-    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
-    stream << outpoint;
-    std::vector<unsigned char> data(stream.begin(), stream.end());
-    insert(data);
+    unsigned char data[SERIALIZED_OUTPOINT_SIZE];
+    SerializeOutPoint(outpoint, data);
+    insert(data, sizeof(data));
 }
 
 void CBloomFilter::insert(const uint256& hash)
 {
-    std::vector<unsigned char> data(hash.begin(), hash.end());
-    insert(data);
+    insert(hash.begin(), hash.size());
 }
 
-bool CBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+bool CBloomFilter::contains(const unsigned char* pKey, size_t nSize) const
 {
     if (isFull)
         return true;
@@ -91,7 +148,7 @@ bool CBloomFilter::contains(const std::vector<unsigned char>& vKey) const
         return false;
     for (unsigned int i = 0; i < nHashFuncs; i++)
     {
-        unsigned int nIndex = Hash(i, vKey);
+        unsigned int nIndex = Hash(i, pKey, nSize);
         // Checks bit nIndex of vData
         if (!(vData[nIndex >> 3] & (1 << (7 & nIndex))))
             return false;
@@ -99,18 +156,21 @@ bool CBloomFilter::contains(const std::vector<unsigned char>& vKey) const
     return true;
 }
 
+bool CBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+{
+    return contains(vKey.data(), vKey.size());
+}
+
 bool CBloomFilter::contains(const COutPoint& outpoint) const
 {
-    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
-    stream << outpoint;
-    std::vector<unsigned char> data(stream.begin(), stream.end());
-    return contains(data);
+    unsigned char data[SERIALIZED_OUTPOINT_SIZE];
+    SerializeOutPoint(outpoint, data);
+    return contains(data, sizeof(data));
 }
 
 bool CBloomFilter::contains(const uint256& hash) const
 {
-    std::vector<unsigned char> data(hash.begin(), hash.end());
-    return contains(data);
+    return contains(hash.begin(), hash.size());
 }
 
 void CBloomFilter::clear()
@@ -132,6 +192,15 @@ bool CBloomFilter::IsWithinSizeConstraints() const
 }
 
 bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
+{
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    return IsRelevantAndUpdate(tx, CBloomFilterElements(tx));
+}
+
+bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const CBloomFilterElements& elements)
 {
     bool fFound = false;
     // Match if the filter contains the hash of tx
@@ -144,21 +213,16 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
     if (contains(hash))
         fFound = true;
 
+    assert(elements.OutputCount() == tx.vout.size() && elements.InputCount() == tx.vin.size());
     for (unsigned int i = 0; i < tx.vout.size(); i++)
     {
-        const CTxOut& txout = tx.vout[i];
         // Match if the filter contains any arbitrary script data element in any scriptPubKey in tx
         // If this matches, also add the specific output that was matched.
         // This means clients don't have to update the filter themselves when a new relevant tx 
         // is discovered in order to find spending transactions, which avoids round-tripping and race conditions.
-        CScript::const_iterator pc = txout.scriptPubKey.begin();
-        std::vector<unsigned char> data;
-        while (pc < txout.scriptPubKey.end())
+        for (uint32_t e = elements.OutputBegin(i); e < elements.OutputEnd(i); e++)
         {
-            opcodetype opcode;
-            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+            if (contains(elements.ElementData(e), elements.ElementSize(e)))
             {
                 fFound = true;
                 if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
@@ -167,7 +231,7 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
                 {
                     txnouttype type;
                     std::vector<std::vector<unsigned char> > vSolutions;
-                    if (Solver(txout.scriptPubKey, type, vSolutions) &&
+                    if (Solver(tx.vout[i].scriptPubKey, type, vSolutions) &&
                             (type == TX_PUBKEY || type == TX_MULTISIG))
                         insert(COutPoint(hash, i));
                 }
@@ -179,21 +243,13 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
     if (fFound)
         return true;
 
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    // Match if the filter contains an outpoint tx spends, or any arbitrary
+    // script data element in any scriptSig in tx (the prevout is each input's first element)
+    for (uint32_t i = 0; i < elements.InputCount(); i++)
     {
-        // Match if the filter contains an outpoint tx spends
-        if (contains(txin.prevout))
-            return true;
-
-        // Match if the filter contains any arbitrary script data element in any scriptSig in tx
-        CScript::const_iterator pc = txin.scriptSig.begin();
-        std::vector<unsigned char> data;
-        while (pc < txin.scriptSig.end())
+        for (uint32_t e = elements.InputBegin(i); e < elements.InputEnd(i); e++)
         {
-            opcodetype opcode;
-            if (!txin.scriptSig.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+            if (contains(elements.ElementData(e), elements.ElementSize(e)))
                 return true;
         }
     }
@@ -214,6 +270,11 @@ void CBloomFilter::UpdateEmptyFull()
     isEmpty = empty;
 }
 
+size_t CBloomFilter::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(vData);
+}
+
 CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
 {
     double logFpRate = log(fpRate);
@@ -311,3 +372,174 @@ void CRollingBloomFilter::reset()
         *it = 0;
     }
 }
+
+size_t CRollingBloomFilter::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(data);
+}
+
+/**
+ * Expected false positive rate of a blocked bloom filter holding nElements in
+ * nBlocks blocks of nBlockBits: the number of elements in a block is Poisson
+ * distributed, and a lookup fails if all its nHashFuncs probes hit set bits.
+ */
+static double BlockedBloomFPRate(uint32_t nElements, uint32_t nBlocks, unsigned int nBlockBits, int nHashFuncs)
+{
+    double lambda = (double)nElements / nBlocks;
+    double p = exp(-lambda);
+    double fpRate = 0;
+    for (int n = 0; ; n++) {
+        if (n > 0)
+            p *= lambda / n;
+        fpRate += p * pow(1.0 - pow(1.0 - 1.0 / nBlockBits, (double)nHashFuncs * n), nHashFuncs);
+        if (n > lambda && p < 1e-12)
+            break;
+    }
+    return fpRate;
+}
+
+CBlockedRollingBloomFilter::CBlockedRollingBloomFilter(unsigned int nElements, double fpRate)
+{
+    /* Same number of hash functions and generations as CRollingBloomFilter. */
+    nHashFuncs = std::max(1, std::min((int)round(log(fpRate) / log(0.5)), 50));
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    uint32_t nMaxElements = nEntriesPerGeneration * 3;
+    /* Find the smallest number of blocks meeting fpRate, starting from the
+     * point where every block would be expected to be saturated. */
+    uint32_t nLow = std::max<uint32_t>(1, (uint64_t)nMaxElements * nHashFuncs / BLOCK_POSITIONS);
+    uint32_t nHigh = nLow;
+    while (BlockedBloomFPRate(nMaxElements, nHigh, BLOCK_POSITIONS, nHashFuncs) > fpRate) {
+        nLow = nHigh + 1;
+        nHigh *= 2;
+    }
+    while (nLow < nHigh) {
+        uint32_t nMid = nLow + (nHigh - nLow) / 2;
+        if (BlockedBloomFPRate(nMaxElements, nMid, BLOCK_POSITIONS, nHashFuncs) > fpRate)
+            nLow = nMid + 1;
+        else
+            nHigh = nMid;
+    }
+    nBlocks = nHigh;
+    /* As in CRollingBloomFilter, position P of a block is bit (P & 63) of its
+     * words (P >> 6) * 2 and (P >> 6) * 2 + 1. Room is left to start the
+     * blocks on a cache line boundary. */
+    data.resize((size_t)nBlocks * BLOCK_WORDS + BLOCK_WORDS - 1);
+    reset();
+}
+
+const uint64_t* CBlockedRollingBloomFilter::Blocks() const
+{
+    return data.data() + ((64 - ((uintptr_t)data.data() & 63)) & 63) / sizeof(uint64_t);
+}
+
+uint64_t* CBlockedRollingBloomFilter::Blocks()
+{
+    return data.data() + ((64 - ((uintptr_t)data.data() & 63)) & 63) / sizeof(uint64_t);
+}
+
+/** The block an element's hash maps to: its upper 32 bits scaled to nBlocks. */
+static inline uint32_t BlockedBloomIndex(uint64_t hash, uint32_t nBlocks)
+{
+    return ((hash >> 32) * nBlocks) >> 32;
+}
+
+void CBlockedRollingBloomFilter::ProbeMasks(uint64_t hash, uint64_t masks[BLOCK_WORDS / 2]) const
+{
+    // The upper half of hash picks the block; the probes come from a
+    // SplitMix64 sequence seeded with it, eight 8-bit positions per step.
+    for (unsigned int i = 0; i < BLOCK_WORDS / 2; i++)
+        masks[i] = 0;
+    uint64_t state = hash, z = 0;
+    for (int n = 0; n < nHashFuncs; n++) {
+        if ((n & 7) == 0) {
+            state += 0x9E3779B97F4A7C15ULL;
+            z = state;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            z ^= z >> 31;
+        }
+        unsigned int pos = z & (BLOCK_POSITIONS - 1);
+        z >>= 8;
+        masks[pos >> 6] |= ((uint64_t)1) << (pos & 63);
+    }
+}
+
+void CBlockedRollingBloomFilter::insert(uint64_t hash)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration) {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4) {
+            nGeneration = 1;
+        }
+        uint64_t nGenerationMask1 = -(uint64_t)(nGeneration & 1);
+        uint64_t nGenerationMask2 = -(uint64_t)(nGeneration >> 1);
+        /* Wipe old entries that used this generation number. */
+        uint64_t* words = Blocks();
+        for (size_t p = 0; p < (size_t)nBlocks * BLOCK_WORDS; p += 2) {
+            uint64_t p1 = words[p], p2 = words[p + 1];
+            uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            words[p] = p1 & mask;
+            words[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    uint64_t masks[BLOCK_WORDS / 2];
+    ProbeMasks(hash, masks);
+    uint64_t* block = Blocks() + (size_t)BlockedBloomIndex(hash, nBlocks) * BLOCK_WORDS;
+    uint64_t nGenerationMask1 = -(uint64_t)(nGeneration & 1);
+    uint64_t nGenerationMask2 = -(uint64_t)(nGeneration >> 1);
+    for (unsigned int i = 0; i < BLOCK_WORDS / 2; i++) {
+        block[2 * i] = (block[2 * i] & ~masks[i]) | (masks[i] & nGenerationMask1);
+        block[2 * i + 1] = (block[2 * i + 1] & ~masks[i]) | (masks[i] & nGenerationMask2);
+    }
+}
+
+bool CBlockedRollingBloomFilter::contains(uint64_t hash) const
+{
+    uint64_t masks[BLOCK_WORDS / 2];
+    ProbeMasks(hash, masks);
+    const uint64_t* block = Blocks() + (size_t)BlockedBloomIndex(hash, nBlocks) * BLOCK_WORDS;
+    uint64_t missing = 0;
+    for (unsigned int i = 0; i < BLOCK_WORDS / 2; i++) {
+        /* A position is set if its bit is set in either word of the pair */
+        missing |= masks[i] & ~(block[2 * i] | block[2 * i + 1]);
+    }
+    return missing == 0;
+}
+
+void CBlockedRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    insert(CSipHasher(k0, k1).Write(vKey.data(), vKey.size()).Finalize());
+}
+
+void CBlockedRollingBloomFilter::insert(const uint256& hash)
+{
+    // Identical to hashing the 32 bytes of hash
+    insert(SipHashUint256(k0, k1, hash));
+}
+
+bool CBlockedRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+{
+    return contains(CSipHasher(k0, k1).Write(vKey.data(), vKey.size()).Finalize());
+}
+
+bool CBlockedRollingBloomFilter::contains(const uint256& hash) const
+{
+    return contains(SipHashUint256(k0, k1, hash));
+}
+
+void CBlockedRollingBloomFilter::reset()
+{
+    k0 = GetRand(std::numeric_limits<uint64_t>::max());
+    k1 = GetRand(std::numeric_limits<uint64_t>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(data.begin(), data.end(), 0);
+}
+
+size_t CBlockedRollingBloomFilter::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(data);
+}
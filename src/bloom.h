@@ -10,6 +10,7 @@
 #include <vector>
 
 class COutPoint;
+class CScript;
 class CTransaction;
 class uint256;
 
@@ -30,6 +31,46 @@ enum bloomflags
     BLOOM_UPDATE_MASK = 3,
 };
 
+/**
+ * The data elements of a transaction that a CBloomFilter is matched against:
+ * the push data of every scriptPubKey, and for every input the serialized
+ * prevout followed by the push data of its scriptSig. Extracting them once lets
+ * a transaction be tested against many filters without parsing its scripts or
+ * serializing its outpoints again, e.g. a new block requested by many SPV peers.
+ */
+class CBloomFilterElements
+{
+private:
+    //! All elements, concatenated
+    std::vector<unsigned char> vData;
+    //! Element i spans vData[ElementBegin(i), vElementEnd[i])
+    std::vector<uint32_t> vElementEnd;
+    //! The pushes of output i are the elements [OutputBegin(i), vOutputEnd[i])
+    std::vector<uint32_t> vOutputEnd;
+    //! The prevout and pushes of input i are the elements [InputBegin(i), vInputEnd[i])
+    std::vector<uint32_t> vInputEnd;
+
+    void AddElement(const unsigned char* pbegin, const unsigned char* pend);
+    void AddPushes(const CScript& script);
+
+public:
+    explicit CBloomFilterElements(const CTransaction& tx);
+
+    uint32_t ElementBegin(uint32_t i) const { return i ? vElementEnd[i - 1] : 0; }
+    const unsigned char* ElementData(uint32_t i) const { return vData.data() + ElementBegin(i); }
+    uint32_t ElementSize(uint32_t i) const { return vElementEnd[i] - ElementBegin(i); }
+
+    uint32_t OutputCount() const { return vOutputEnd.size(); }
+    uint32_t OutputBegin(uint32_t i) const { return i ? vOutputEnd[i - 1] : 0; }
+    uint32_t OutputEnd(uint32_t i) const { return vOutputEnd[i]; }
+
+    uint32_t InputCount() const { return vInputEnd.size(); }
+    uint32_t InputBegin(uint32_t i) const { return i ? vInputEnd[i - 1] : OutputBegin(OutputCount()); }
+    uint32_t InputEnd(uint32_t i) const { return vInputEnd[i]; }
+
+    size_t DynamicMemoryUsage() const;
+};
+
 /**
  * BloomFilter is a probabilistic filter which SPV clients provide
  * so that we can filter the transactions we send them.
@@ -51,7 +92,10 @@ private:
     unsigned int nTweak;
     unsigned char nFlags;
 
-    unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
+    unsigned int Hash(unsigned int nHashNum, const unsigned char* pDataToHash, size_t nSize) const;
+
+    void insert(const unsigned char* pKey, size_t nSize);
+    bool contains(const unsigned char* pKey, size_t nSize) const;
 
     // Private constructor for CRollingBloomFilter, no restrictions on size
     CBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak);
@@ -97,9 +141,13 @@ public:
 
     //! Also adds any outputs which match the filter to the filter (to match their spending txes)
     bool IsRelevantAndUpdate(const CTransaction& tx);
+    //! As above, using elements already extracted from tx
+    bool IsRelevantAndUpdate(const CTransaction& tx, const CBloomFilterElements& elements);
 
     //! Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
+
+    size_t DynamicMemoryUsage() const;
 };
 
 /**
@@ -131,6 +179,8 @@ public:
 
     void reset();
 
+    size_t DynamicMemoryUsage() const;
+
 private:
     int nEntriesPerGeneration;
     int nEntriesThisGeneration;
@@ -140,4 +190,55 @@ private:
     int nHashFuncs;
 };
 
+/**
+ * A CRollingBloomFilter variant in which all probes for an element fall into a
+ * single 64-byte cache line: one SipHash of the element picks a block of 256
+ * positions (with both generation bits of each position in that block), and
+ * the probe positions within the block are derived from the same hash. An
+ * insert or lookup therefore costs one hash and one cache miss instead of
+ * nHashFuncs of each. Generations roll over exactly as in CRollingBloomFilter.
+ *
+ * Confining the probes to a block makes the filter less accurate per bit, so it
+ * is sized (see the constructor) to still meet the requested false positive
+ * rate, at the cost of roughly 1.8x the memory of CRollingBloomFilter at a
+ * rate of one in a million.
+ */
+class CBlockedRollingBloomFilter
+{
+public:
+    // A random bloom filter calls GetRand() at creation time.
+    // Don't create global CBlockedRollingBloomFilter objects, as they may be
+    // constructed before the randomizer is properly initialized.
+    CBlockedRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+
+    void reset();
+
+    size_t DynamicMemoryUsage() const;
+
+private:
+    //! Positions per block, and the 64-bit words holding their two generation bits
+    static const unsigned int BLOCK_POSITIONS = 256;
+    static const unsigned int BLOCK_WORDS = BLOCK_POSITIONS * 2 / 64;
+
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    //! nBlocks blocks of BLOCK_WORDS words, starting at the first 64-byte boundary in data
+    std::vector<uint64_t> data;
+    uint32_t nBlocks;
+    uint64_t k0, k1;
+    int nHashFuncs;
+
+    const uint64_t* Blocks() const;
+    uint64_t* Blocks();
+    void ProbeMasks(uint64_t hash, uint64_t masks[BLOCK_WORDS / 2]) const;
+    void insert(uint64_t hash);
+    bool contains(uint64_t hash) const;
+};
+
 #endif // BITCOIN_BLOOM_H
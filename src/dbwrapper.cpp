@@ -15,6 +15,40 @@
 #include <memenv.h>
 #include <stdint.h>
 
+/** Block cache that counts how many lookups it could serve */
+class CCountingCache : public leveldb::Cache
+{
+private:
+    leveldb::Cache* pcache;
+    CDBWrapperStats& stats;
+
+public:
+    CCountingCache(leveldb::Cache* pcacheIn, CDBWrapperStats& statsIn) : pcache(pcacheIn), stats(statsIn) {}
+    ~CCountingCache() { delete pcache; }
+
+    Handle* Insert(const leveldb::Slice& key, void* value, size_t charge, void (*deleter)(const leveldb::Slice& key, void* value))
+    {
+        return pcache->Insert(key, value, charge, deleter);
+    }
+
+    Handle* Lookup(const leveldb::Slice& key)
+    {
+        Handle* handle = pcache->Lookup(key);
+        if (handle)
+            stats.nBlockCacheHits++;
+        else
+            stats.nBlockCacheMisses++;
+        return handle;
+    }
+
+    void Release(Handle* handle) { pcache->Release(handle); }
+    void* Value(Handle* handle) { return pcache->Value(handle); }
+    void Erase(const leveldb::Slice& key) { pcache->Erase(key); }
+    uint64_t NewId() { return pcache->NewId(); }
+    void Prune() { pcache->Prune(); }
+    size_t TotalCharge() const { return pcache->TotalCharge(); }
+};
+
 static leveldb::Options GetOptions(size_t nCacheSize)
 {
     leveldb::Options options;
@@ -39,6 +73,7 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
     options = GetOptions(nCacheSize);
+    options.block_cache = new CCountingCache(options.block_cache, stats);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -58,6 +93,7 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
 
     // The base-case obfuscation key, which is a noop.
     obfuscate_key = std::vector<unsigned char>(OBFUSCATE_KEY_NUM_BYTES, '\000');
+    obfuscated = false;
 
     bool key_exists = Read(OBFUSCATE_KEY_KEY, obfuscate_key);
 
@@ -72,6 +108,7 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
 
         LogPrintf("Wrote new obfuscate key for %s: %s\n", path.string(), HexStr(obfuscate_key));
     }
+    obfuscated = std::find_if(obfuscate_key.begin(), obfuscate_key.end(), [](unsigned char c) { return c != 0; }) != obfuscate_key.end();
 
     LogPrintf("Using obfuscation key for %s: %s\n", path.string(), HexStr(obfuscate_key));
 }
@@ -90,7 +127,9 @@ CDBWrapper::~CDBWrapper()
 
 bool CDBWrapper::WriteBatch(CDBBatch& batch, bool fSync)
 {
+    int64_t nTimeStart = GetTimeMicros();
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
+    stats.write.Add(GetTimeMicros() - nTimeStart, batch.SizeEstimate());
     dbwrapper_private::HandleError(status);
     return true;
 }
@@ -122,10 +161,72 @@ bool CDBWrapper::IsEmpty()
     return !(it->Valid());
 }
 
+bool CDBWrapper::GetProperty(const std::string& strProperty, std::string& strValue) const
+{
+    return pdb->GetProperty(strProperty, &strValue);
+}
+
+std::vector<int> CDBWrapper::GetFilesPerLevel() const
+{
+    std::vector<int> vFiles;
+    std::string strValue;
+    // LevelDB rejects levels past the last one
+    while (GetProperty(strprintf("leveldb.num-files-at-level%d", vFiles.size()), strValue))
+        vFiles.push_back(atoi(strValue));
+    return vFiles;
+}
+
+size_t CDBWrapper::GetBlockCacheUsage() const
+{
+    return options.block_cache->TotalCharge();
+}
+
+static std::string FormatOpStats(const CDBOpStats& op)
+{
+    uint64_t nCount = op.nCount;
+    return strprintf("%u (avg %uus, max %uus)", nCount, nCount ? op.nTotalMicros / nCount : 0, op.nMaxMicros);
+}
+
+void CDBWrapper::LogStats(const std::string& strName) const
+{
+    std::string strLevels;
+    for (int nFiles : GetFilesPerLevel())
+        strLevels += strprintf("%s%d", strLevels.empty() ? "" : "/", nFiles);
+    std::string strMemory;
+    GetProperty("leveldb.approximate-memory-usage", strMemory);
+    uint64_t nHits = stats.nBlockCacheHits, nMisses = stats.nBlockCacheMisses;
+    LogPrint("dbstats", "%s: files per level %s, memory %.1fMiB, block cache %.1fMiB with %.1f%% hits, reads %s with %u misses, writes %s of %.1fMiB, seeks %s, iterator steps %u\n",
+        strName, strLevels, atoi64(strMemory) * (1.0 / 1048576.0),
+        GetBlockCacheUsage() * (1.0 / 1048576.0), nHits + nMisses ? 100.0 * nHits / (nHits + nMisses) : 0.0,
+        FormatOpStats(stats.read), stats.nReadMisses,
+        FormatOpStats(stats.write), stats.write.nBytes * (1.0 / 1048576.0),
+        FormatOpStats(stats.seek), stats.nIteratorSteps);
+}
+
+CDBOpStats::CDBOpStats() : nCount(0), nBytes(0), nTotalMicros(0), nMaxMicros(0)
+{
+    for (int i = 0; i < NUM_BUCKETS; i++)
+        vBuckets[i] = 0;
+}
+
+void CDBOpStats::Add(int64_t nMicros, size_t nBytesIn)
+{
+    uint64_t nValue = std::max<int64_t>(nMicros, 0);
+    int nBucket = 0;
+    while (nBucket < NUM_BUCKETS - 1 && nValue >= BucketLimit(nBucket))
+        nBucket++;
+    vBuckets[nBucket]++;
+    nCount++;
+    nBytes += nBytesIn;
+    nTotalMicros += nValue;
+    uint64_t nMax = nMaxMicros;
+    while (nValue > nMax && !nMaxMicros.compare_exchange_weak(nMax, nValue)) {}
+}
+
 CDBIterator::~CDBIterator() { delete piter; }
 bool CDBIterator::Valid() { return piter->Valid(); }
 void CDBIterator::SeekToFirst() { piter->SeekToFirst(); }
-void CDBIterator::Next() { piter->Next(); }
+void CDBIterator::Next() { parent.stats.nIteratorSteps++; piter->Next(); }
 
 namespace dbwrapper_private {
 
@@ -148,4 +249,43 @@ const std::vector<unsigned char>& GetObfuscateKey(const CDBWrapper &w)
     return w.obfuscate_key;
 }
 
+bool IsObfuscated(const CDBWrapper &w)
+{
+    return w.obfuscated;
+}
+
+void Xor(char* pch, size_t nSize, const std::vector<unsigned char>& key, size_t nKeyOffset)
+{
+    const size_t nKeySize = key.size();
+    if (nKeySize == 0)
+        return;
+    size_t j = nKeyOffset % nKeySize;
+
+    // Byte by byte until the key lines up with its start...
+    while (nSize > 0 && j != 0) {
+        *pch++ ^= key[j++];
+        if (j == nKeySize)
+            j = 0;
+        nSize--;
+    }
+
+    // ...then a word at a time for the usual 8 byte key
+    if (nKeySize == sizeof(uint64_t)) {
+        uint64_t nKeyWord;
+        memcpy(&nKeyWord, key.data(), sizeof(nKeyWord));
+        for (; nSize >= sizeof(uint64_t); nSize -= sizeof(uint64_t), pch += sizeof(uint64_t)) {
+            uint64_t nWord;
+            memcpy(&nWord, pch, sizeof(nWord));
+            nWord ^= nKeyWord;
+            memcpy(pch, &nWord, sizeof(nWord));
+        }
+    }
+
+    for (; nSize > 0; nSize--) {
+        *pch++ ^= key[j++];
+        if (j == nKeySize)
+            j = 0;
+    }
+}
+
 };
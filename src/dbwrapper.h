@@ -6,12 +6,16 @@
 #define BITCOIN_DBWRAPPER_H
 
 #include "clientversion.h"
+#include "prevector.h"
 #include "serialize.h"
 #include "streams.h"
 #include "util.h"
 #include "utilstrencodings.h"
+#include "utiltime.h"
 #include "version.h"
 
+#include <atomic>
+
 #include <boost/filesystem/path.hpp>
 
 #include <leveldb/db.h>
@@ -28,6 +32,41 @@ public:
 
 class CDBWrapper;
 
+/** Count, size and latency histogram of one kind of database operation.
+ * Updated without locking, as reads come from several threads at once.
+ */
+class CDBOpStats
+{
+public:
+    //! bucket 0 counts operations that took no measurable time, bucket i those that took [2^(i-1), 2^i) microseconds
+    static const int NUM_BUCKETS = 24;
+
+    std::atomic<uint64_t> nCount;
+    std::atomic<uint64_t> nBytes;
+    std::atomic<uint64_t> nTotalMicros;
+    std::atomic<uint64_t> nMaxMicros;
+    std::atomic<uint64_t> vBuckets[NUM_BUCKETS];
+
+    CDBOpStats();
+    void Add(int64_t nMicros, size_t nBytesIn);
+    /** Upper bound (exclusive) of the latencies counted in a bucket */
+    static uint64_t BucketLimit(int nBucket) { return (uint64_t)1 << nBucket; }
+};
+
+/** Wrapper-level statistics of a CDBWrapper */
+struct CDBWrapperStats
+{
+    CDBOpStats read;  //! Read and Exists; bytes are value sizes
+    CDBOpStats write; //! WriteBatch; bytes are batch size estimates
+    CDBOpStats seek;  //! iterator seeks
+    std::atomic<uint64_t> nReadMisses;       //! lookups of keys that don't exist
+    std::atomic<uint64_t> nIteratorSteps;    //! iterator Next() calls
+    std::atomic<uint64_t> nBlockCacheHits;   //! block cache lookups that hit
+    std::atomic<uint64_t> nBlockCacheMisses; //! block cache lookups that had to go to disk
+
+    CDBWrapperStats() : nReadMisses(0), nIteratorSteps(0), nBlockCacheHits(0), nBlockCacheMisses(0) {}
+};
+
 /** These should be considered an implementation detail of the specific database.
  */
 namespace dbwrapper_private {
@@ -42,6 +81,82 @@ void HandleError(const leveldb::Status& status);
  */
 const std::vector<unsigned char>& GetObfuscateKey(const CDBWrapper &w);
 
+/** Whether the obfuscation key of a database is anything other than all zeroes.
+ */
+bool IsObfuscated(const CDBWrapper &w);
+
+/** XOR a buffer with the repeating obfuscation key, as if the buffer started
+ * at byte nKeyOffset of the obfuscated record.
+ */
+void Xor(char* pch, size_t nSize, const std::vector<unsigned char>& key, size_t nKeyOffset = 0);
+
+/** Serializes a database key into an inline buffer, so that keys of up to
+ * DBWRAPPER_PREALLOC_KEY_SIZE bytes can be looked up without touching the heap.
+ */
+class KeyWriter
+{
+private:
+    prevector<DBWRAPPER_PREALLOC_KEY_SIZE, char> vch;
+
+public:
+    template <typename K>
+    explicit KeyWriter(const K& key)
+    {
+        ::Serialize(*this, key);
+    }
+
+    void write(const char* pch, size_t nSize)
+    {
+        vch.insert(vch.end(), pch, pch + nSize);
+    }
+
+    int GetType() const { return SER_DISK; }
+    int GetVersion() const { return CLIENT_VERSION; }
+
+    leveldb::Slice GetSlice() const { return leveldb::Slice(vch.data(), vch.size()); }
+};
+
+/** Deserializes straight out of a LevelDB slice, removing the obfuscation
+ * from each piece as it is read instead of copying the whole record first.
+ */
+class SliceReader
+{
+private:
+    const leveldb::Slice& slice;
+    const std::vector<unsigned char>* pkey; //! NULL if the data is not obfuscated
+    size_t nReadPos;
+
+public:
+    SliceReader(const leveldb::Slice& sliceIn, const std::vector<unsigned char>* pkeyIn) : slice(sliceIn), pkey(pkeyIn), nReadPos(0) {}
+
+    void read(char* pch, size_t nSize)
+    {
+        if (nSize > slice.size() - nReadPos)
+            throw std::ios_base::failure("SliceReader::read(): end of data");
+        memcpy(pch, slice.data() + nReadPos, nSize);
+        if (pkey)
+            Xor(pch, nSize, *pkey, nReadPos);
+        nReadPos += nSize;
+    }
+
+    void ignore(size_t nSize)
+    {
+        if (nSize > slice.size() - nReadPos)
+            throw std::ios_base::failure("SliceReader::ignore(): end of data");
+        nReadPos += nSize;
+    }
+
+    template <typename T>
+    SliceReader& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj);
+        return *this;
+    }
+
+    int GetType() const { return SER_DISK; }
+    int GetVersion() const { return CLIENT_VERSION; }
+};
+
 };
 
 /** Batch of changes queued to be written to a CDBWrapper */
@@ -56,11 +171,19 @@ private:
     CDataStream ssKey;
     CDataStream ssValue;
 
+    size_t size_estimate;
+
 public:
     /**
      * @param[in] _parent   CDBWrapper that this batch is to be submitted to
      */
-    CDBBatch(const CDBWrapper &_parent) : parent(_parent), ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION) { };
+    CDBBatch(const CDBWrapper &_parent) : parent(_parent), ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION), size_estimate(0) { };
+
+    void Clear()
+    {
+        batch.Clear();
+        size_estimate = 0;
+    }
 
     template <typename K, typename V>
     void Write(const K& key, const V& value)
@@ -71,10 +194,19 @@ public:
 
         ssValue.reserve(DBWRAPPER_PREALLOC_VALUE_SIZE);
         ssValue << value;
-        ssValue.Xor(dbwrapper_private::GetObfuscateKey(parent));
+        if (dbwrapper_private::IsObfuscated(parent))
+            dbwrapper_private::Xor(ssValue.data(), ssValue.size(), dbwrapper_private::GetObfuscateKey(parent));
         leveldb::Slice slValue(ssValue.data(), ssValue.size());
 
         batch.Put(slKey, slValue);
+        // LevelDB serializes writes as:
+        // - byte: header
+        // - varint: key length (1 byte up to 127B, 2 bytes up to 16383B, ...)
+        // - byte[]: key
+        // - varint: value length
+        // - byte[]: value
+        // The formula below assumes the key and value are both less than 16k.
+        size_estimate += 3 + (slKey.size() > 127) + slKey.size() + (slValue.size() > 127) + slValue.size();
         ssKey.clear();
         ssValue.clear();
     }
@@ -87,8 +219,16 @@ public:
         leveldb::Slice slKey(ssKey.data(), ssKey.size());
 
         batch.Delete(slKey);
+        // LevelDB serializes erases as:
+        // - byte: header
+        // - varint: key length
+        // - byte[]: key
+        // The formula below assumes the key is less than 16kB.
+        size_estimate += 2 + (slKey.size() > 127) + slKey.size();
         ssKey.clear();
     }
+
+    size_t SizeEstimate() const { return size_estimate; }
 };
 
 class CDBIterator
@@ -111,21 +251,14 @@ public:
 
     void SeekToFirst();
 
-    template<typename K> void Seek(const K& key) {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
-        ssKey << key;
-        leveldb::Slice slKey(ssKey.data(), ssKey.size());
-        piter->Seek(slKey);
-    }
+    template<typename K> void Seek(const K& key);
 
     void Next();
 
     template<typename K> bool GetKey(K& key) {
         leveldb::Slice slKey = piter->key();
         try {
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            ssKey >> key;
+            dbwrapper_private::SliceReader(slKey, NULL) >> key;
         } catch (const std::exception&) {
             return false;
         }
@@ -139,9 +272,10 @@ public:
     template<typename V> bool GetValue(V& value) {
         leveldb::Slice slValue = piter->value();
         try {
-            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-            ssValue.Xor(dbwrapper_private::GetObfuscateKey(parent));
-            ssValue >> value;
+            const std::vector<unsigned char>* pkey = NULL;
+            if (dbwrapper_private::IsObfuscated(parent))
+                pkey = &dbwrapper_private::GetObfuscateKey(parent);
+            dbwrapper_private::SliceReader(slValue, pkey) >> value;
         } catch (const std::exception&) {
             return false;
         }
@@ -157,6 +291,8 @@ public:
 class CDBWrapper
 {
     friend const std::vector<unsigned char>& dbwrapper_private::GetObfuscateKey(const CDBWrapper &w);
+    friend bool dbwrapper_private::IsObfuscated(const CDBWrapper &w);
+    friend class CDBIterator;
 private:
     //! custom environment this database is using (may be NULL in case of default environment)
     leveldb::Env* penv;
@@ -182,6 +318,12 @@ private:
     //! a key used for optional XOR-obfuscation of the database
     std::vector<unsigned char> obfuscate_key;
 
+    //! whether obfuscate_key is non-zero, so reads and writes can skip the XOR otherwise
+    bool obfuscated;
+
+    //! operation counters and latencies, see GetStats()
+    mutable CDBWrapperStats stats;
+
     //! the key under which the obfuscation key is stored
     static const std::string OBFUSCATE_KEY_KEY;
 
@@ -205,23 +347,23 @@ public:
     template <typename K, typename V>
     bool Read(const K& key, V& value) const
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
-        ssKey << key;
-        leveldb::Slice slKey(ssKey.data(), ssKey.size());
+        dbwrapper_private::KeyWriter keyWriter(key);
 
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        int64_t nTimeStart = GetTimeMicros();
+        leveldb::Status status = pdb->Get(readoptions, keyWriter.GetSlice(), &strValue);
+        stats.read.Add(GetTimeMicros() - nTimeStart, strValue.size());
         if (!status.ok()) {
-            if (status.IsNotFound())
+            if (status.IsNotFound()) {
+                stats.nReadMisses++;
                 return false;
+            }
             LogPrintf("LevelDB read failure: %s\n", status.ToString());
             dbwrapper_private::HandleError(status);
         }
         try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
-            ssValue.Xor(obfuscate_key);
-            ssValue >> value;
+            leveldb::Slice slValue(strValue);
+            dbwrapper_private::SliceReader(slValue, obfuscated ? &obfuscate_key : NULL) >> value;
         } catch (const std::exception&) {
             return false;
         }
@@ -239,16 +381,17 @@ public:
     template <typename K>
     bool Exists(const K& key) const
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
-        ssKey << key;
-        leveldb::Slice slKey(ssKey.data(), ssKey.size());
+        dbwrapper_private::KeyWriter keyWriter(key);
 
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        int64_t nTimeStart = GetTimeMicros();
+        leveldb::Status status = pdb->Get(readoptions, keyWriter.GetSlice(), &strValue);
+        stats.read.Add(GetTimeMicros() - nTimeStart, strValue.size());
         if (!status.ok()) {
-            if (status.IsNotFound())
+            if (status.IsNotFound()) {
+                stats.nReadMisses++;
                 return false;
+            }
             LogPrintf("LevelDB read failure: %s\n", status.ToString());
             dbwrapper_private::HandleError(status);
         }
@@ -286,7 +429,31 @@ public:
      * Return true if the database managed by this class contains no entries.
      */
     bool IsEmpty();
+
+    /**
+     * Look up a LevelDB property such as "leveldb.stats", "leveldb.sstables",
+     * "leveldb.num-files-at-level<N>" or "leveldb.approximate-memory-usage".
+     */
+    bool GetProperty(const std::string& strProperty, std::string& strValue) const;
+
+    /** Number of table files on each level, from level 0 up */
+    std::vector<int> GetFilesPerLevel() const;
+
+    /** Memory currently held by the block cache */
+    size_t GetBlockCacheUsage() const;
+
+    const CDBWrapperStats& GetStats() const { return stats; }
+
+    /** Write a one line summary of the statistics to the debug log */
+    void LogStats(const std::string& strName) const;
 };
 
+template<typename K> void CDBIterator::Seek(const K& key) {
+    dbwrapper_private::KeyWriter keyWriter(key);
+    int64_t nTimeStart = GetTimeMicros();
+    piter->Seek(keyWriter.GetSlice());
+    parent.stats.seek.Add(GetTimeMicros() - nTimeStart, 0);
+}
+
 #endif // BITCOIN_DBWRAPPER_H
 
@@ -13,20 +13,20 @@ inline uint32_t ROTL32(uint32_t x, int8_t r)
     return (x << r) | (x >> (32 - r));
 }
 
-unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash)
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pDataToHash, size_t nSize)
 {
     // The following is MurmurHash3 (x86_32), see http://code.google.com/p/smhasher/source/browse/trunk/MurmurHash3.cpp
     uint32_t h1 = nHashSeed;
-    if (vDataToHash.size() > 0)
+    if (nSize > 0)
     {
         const uint32_t c1 = 0xcc9e2d51;
         const uint32_t c2 = 0x1b873593;
 
-        const int nblocks = vDataToHash.size() / 4;
+        const int nblocks = nSize / 4;
 
         //----------
         // body
-        const uint8_t* blocks = &vDataToHash[0] + nblocks * 4;
+        const uint8_t* blocks = pDataToHash + nblocks * 4;
 
         for (int i = -nblocks; i; i++) {
             uint32_t k1 = ReadLE32(blocks + i*4);
@@ -42,11 +42,11 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
 
         //----------
         // tail
-        const uint8_t* tail = (const uint8_t*)(&vDataToHash[0] + nblocks * 4);
+        const uint8_t* tail = (const uint8_t*)(pDataToHash + nblocks * 4);
 
         uint32_t k1 = 0;
 
-        switch (vDataToHash.size() & 3) {
+        switch (nSize & 3) {
         case 3:
             k1 ^= tail[2] << 16;
         case 2:
@@ -62,7 +62,7 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
 
     //----------
     // finalization
-    h1 ^= vDataToHash.size();
+    h1 ^= nSize;
     h1 ^= h1 >> 16;
     h1 *= 0x85ebca6b;
     h1 ^= h1 >> 13;
@@ -72,6 +72,11 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
     return h1;
 }
 
+unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash)
+{
+    return MurmurHash3(nHashSeed, vDataToHash.data(), vDataToHash.size());
+}
+
 void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64])
 {
     unsigned char num[4];
@@ -208,3 +213,91 @@ uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val)
     SIPROUND;
     return v0 ^ v1 ^ v2 ^ v3;
 }
+
+static inline void SipRoundx4(uint64_t v0[4], uint64_t v1[4], uint64_t v2[4], uint64_t v3[4])
+{
+    for (int i = 0; i < 4; i++) {
+        v0[i] += v1[i]; v1[i] = ROTL(v1[i], 13); v1[i] ^= v0[i];
+        v0[i] = ROTL(v0[i], 32);
+        v2[i] += v3[i]; v3[i] = ROTL(v3[i], 16); v3[i] ^= v2[i];
+        v0[i] += v3[i]; v3[i] = ROTL(v3[i], 21); v3[i] ^= v0[i];
+        v2[i] += v1[i]; v1[i] = ROTL(v1[i], 17); v1[i] ^= v2[i];
+        v2[i] = ROTL(v2[i], 32);
+    }
+}
+
+void SipHashUint256x4(uint64_t k0, uint64_t k1, const uint256* const vals[4], uint64_t out[4])
+{
+    uint64_t v0[4], v1[4], v2[4], v3[4], d[4];
+    for (int i = 0; i < 4; i++) {
+        d[i] = vals[i]->GetUint64(0);
+        v0[i] = 0x736f6d6570736575ULL ^ k0;
+        v1[i] = 0x646f72616e646f6dULL ^ k1;
+        v2[i] = 0x6c7967656e657261ULL ^ k0;
+        v3[i] = 0x7465646279746573ULL ^ k1 ^ d[i];
+    }
+    for (int w = 0; w < 4; w++) {
+        if (w > 0) {
+            for (int i = 0; i < 4; i++) {
+                d[i] = vals[i]->GetUint64(w);
+                v3[i] ^= d[i];
+            }
+        }
+        SipRoundx4(v0, v1, v2, v3);
+        SipRoundx4(v0, v1, v2, v3);
+        for (int i = 0; i < 4; i++) v0[i] ^= d[i];
+    }
+    for (int i = 0; i < 4; i++) v3[i] ^= ((uint64_t)4) << 59;
+    SipRoundx4(v0, v1, v2, v3);
+    SipRoundx4(v0, v1, v2, v3);
+    for (int i = 0; i < 4; i++) {
+        v0[i] ^= ((uint64_t)4) << 59;
+        v2[i] ^= 0xFF;
+    }
+    SipRoundx4(v0, v1, v2, v3);
+    SipRoundx4(v0, v1, v2, v3);
+    SipRoundx4(v0, v1, v2, v3);
+    SipRoundx4(v0, v1, v2, v3);
+    for (int i = 0; i < 4; i++) out[i] = v0[i] ^ v1[i] ^ v2[i] ^ v3[i];
+}
+
+uint64_t SipHashUint256Extra(uint64_t k0, uint64_t k1, const uint256& val, uint32_t extra)
+{
+    /* Specialized implementation for efficiency */
+    uint64_t d = val.GetUint64(0);
+
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1 ^ d;
+
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = val.GetUint64(1);
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = val.GetUint64(2);
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = val.GetUint64(3);
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = (((uint64_t)36) << 56) | extra;
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
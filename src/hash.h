@@ -170,6 +170,7 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL
 }
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pDataToHash, size_t nSize);
 
 void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
 
@@ -206,5 +207,11 @@ public:
  *      .Finalize()
  */
 uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+/** Like SipHashUint256, with a further 4 bytes (extra, little endian)
+ *  appended to the 32 bytes of val. */
+uint64_t SipHashUint256Extra(uint64_t k0, uint64_t k1, const uint256& val, uint32_t extra);
+/** Compute SipHashUint256 of four values at once. The four hashes run in
+ *  lockstep, so their rounds can be vectorized or at least overlapped. */
+void SipHashUint256x4(uint64_t k0, uint64_t k1, const uint256* const vals[4], uint64_t out[4]);
 
 #endif // BITCOIN_HASH_H
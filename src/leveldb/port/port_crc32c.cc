@@ -0,0 +1,124 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// Hardware CRC-32C, using the SSE4.2 crc32 instruction on x86 and the
+// ARMv8 CRC extension on ARM. This file is compiled with the flags that
+// enable those instructions (-msse4.2 or -march=armv8-a+crc), so nothing
+// else may live in it: its code is only run once HasAcceleratedCRC32C()
+// confirmed that the CPU supports them. Built without them, it reports no
+// support and the portable implementation in util/crc32c.cc is used.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(LEVELDB_PLATFORM_WINDOWS)
+#include "port/port_win.h"
+#else
+#include "port/port_posix.h"
+#endif
+
+#if defined(__SSE4_2__)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+namespace leveldb {
+namespace port {
+
+#if defined(__SSE4_2__)
+
+bool HasAcceleratedCRC32C() {
+#if defined(_MSC_VER)
+  int cpu_info[4];
+  __cpuid(cpu_info, 1);
+  return (cpu_info[2] & (1 << 20)) != 0;
+#else
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  return (ecx & bit_SSE4_2) != 0;
+#endif
+}
+
+uint32_t AcceleratedCRC32C(uint32_t crc, const char* buf, size_t size) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(buf);
+  const uint8_t* e = p + size;
+  uint32_t l = crc ^ 0xffffffffu;
+
+  // Process bytes until p is 8-byte aligned, then 8 bytes at a time
+  while (p != e && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+    l = _mm_crc32_u8(l, *p++);
+  }
+#if defined(__x86_64__) || defined(_M_X64)
+  uint64_t l64 = l;
+  while (e - p >= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    l64 = _mm_crc32_u64(l64, v);
+    p += 8;
+  }
+  l = static_cast<uint32_t>(l64);
+#endif
+  while (e - p >= 4) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    l = _mm_crc32_u32(l, v);
+    p += 4;
+  }
+  while (p != e) {
+    l = _mm_crc32_u8(l, *p++);
+  }
+  return l ^ 0xffffffffu;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32) && defined(__linux__)
+
+bool HasAcceleratedCRC32C() {
+  return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+uint32_t AcceleratedCRC32C(uint32_t crc, const char* buf, size_t size) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(buf);
+  const uint8_t* e = p + size;
+  uint32_t l = crc ^ 0xffffffffu;
+
+  while (p != e && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+    l = __crc32cb(l, *p++);
+  }
+  while (e - p >= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    l = __crc32cd(l, v);
+    p += 8;
+  }
+  while (p != e) {
+    l = __crc32cb(l, *p++);
+  }
+  return l ^ 0xffffffffu;
+}
+
+#else
+
+bool HasAcceleratedCRC32C() {
+  return false;
+}
+
+uint32_t AcceleratedCRC32C(uint32_t crc, const char* buf, size_t size) {
+  return 0;
+}
+
+#endif
+
+}  // namespace port
+}  // namespace leveldb
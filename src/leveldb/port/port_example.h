@@ -129,6 +129,14 @@ extern bool Snappy_Uncompress(const char* input_data, size_t input_length,
 // The concatenation of all "data[0,n-1]" fragments is the heap profile.
 extern bool GetHeapProfile(void (*func)(void*, const char*, int), void* arg);
 
+// Returns true if this CPU can compute CRC-32C in hardware, so that
+// AcceleratedCRC32C() may be called.
+extern bool HasAcceleratedCRC32C();
+
+// Extend the CRC-32C "crc" to cover buf[0,size-1], using the CPU's CRC
+// instructions. Must only be called if HasAcceleratedCRC32C() returned true.
+extern uint32_t AcceleratedCRC32C(uint32_t crc, const char* buf, size_t size);
+
 }  // namespace port
 }  // namespace leveldb
 
@@ -8,6 +8,8 @@
 #include "util/crc32c.h"
 
 #include <stdint.h>
+#include <string.h>
+#include "port/port.h"
 #include "util/coding.h"
 
 namespace leveldb {
@@ -283,7 +285,7 @@ static inline uint32_t LE_LOAD32(const uint8_t *p) {
   return DecodeFixed32(reinterpret_cast<const char*>(p));
 }
 
-uint32_t Extend(uint32_t crc, const char* buf, size_t size) {
+uint32_t ExtendPortable(uint32_t crc, const char* buf, size_t size) {
   const uint8_t *p = reinterpret_cast<const uint8_t *>(buf);
   const uint8_t *e = p + size;
   uint32_t l = crc ^ 0xffffffffu;
@@ -328,5 +330,30 @@ uint32_t Extend(uint32_t crc, const char* buf, size_t size) {
   return l ^ 0xffffffffu;
 }
 
+// Only use the hardware implementation if it reproduces the standard
+// results from rfc3720 section B.4.
+static bool CanAccelerateCRC32C() {
+  if (!port::HasAcceleratedCRC32C()) {
+    return false;
+  }
+  char buf[32];
+  memset(buf, 0xff, sizeof(buf));
+  if (port::AcceleratedCRC32C(0, buf, sizeof(buf)) != 0x62a8ab43) {
+    return false;
+  }
+  for (int i = 0; i < 32; i++) {
+    buf[i] = i;
+  }
+  return port::AcceleratedCRC32C(0, buf, sizeof(buf)) == 0x46dd794e;
+}
+
+uint32_t Extend(uint32_t crc, const char* buf, size_t size) {
+  static const bool accelerate = CanAccelerateCRC32C();
+  if (accelerate) {
+    return port::AcceleratedCRC32C(crc, buf, size);
+  }
+  return ExtendPortable(crc, buf, size);
+}
+
 }  // namespace crc32c
 }  // namespace leveldb
@@ -3,6 +3,7 @@
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
 #include "util/crc32c.h"
+#include "port/port.h"
 #include "util/testharness.h"
 
 namespace leveldb {
@@ -47,6 +48,47 @@ TEST(CRC, StandardResults) {
   ASSERT_EQ(0xd9963a56, Value(reinterpret_cast<char*>(data), sizeof(data)));
 }
 
+TEST(CRC, AcceleratedMatchesPortable) {
+  if (!port::HasAcceleratedCRC32C()) {
+    fprintf(stderr, "skipping: no hardware CRC-32C\n");
+    return;
+  }
+
+  // The vectors from StandardResults
+  char buf[32];
+  memset(buf, 0, sizeof(buf));
+  ASSERT_EQ(0x8a9136aa, port::AcceleratedCRC32C(0, buf, sizeof(buf)));
+  ASSERT_EQ(Value(buf, sizeof(buf)), ExtendPortable(0, buf, sizeof(buf)));
+
+  memset(buf, 0xff, sizeof(buf));
+  ASSERT_EQ(0x62a8ab43, port::AcceleratedCRC32C(0, buf, sizeof(buf)));
+  ASSERT_EQ(Value(buf, sizeof(buf)), ExtendPortable(0, buf, sizeof(buf)));
+
+  for (int i = 0; i < 32; i++) {
+    buf[i] = i;
+  }
+  ASSERT_EQ(0x46dd794e, port::AcceleratedCRC32C(0, buf, sizeof(buf)));
+  ASSERT_EQ(Value(buf, sizeof(buf)), ExtendPortable(0, buf, sizeof(buf)));
+
+  for (int i = 0; i < 32; i++) {
+    buf[i] = 31 - i;
+  }
+  ASSERT_EQ(0x113fdb5c, port::AcceleratedCRC32C(0, buf, sizeof(buf)));
+  ASSERT_EQ(Value(buf, sizeof(buf)), ExtendPortable(0, buf, sizeof(buf)));
+
+  // Every alignment and length, extending a running crc
+  char data[300];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = static_cast<char>(i * 131 + 7);
+  }
+  for (size_t start = 0; start < 16; start++) {
+    for (size_t n = 0; start + n <= sizeof(data); n++) {
+      ASSERT_EQ(ExtendPortable(0x12345678, data + start, n),
+                port::AcceleratedCRC32C(0x12345678, data + start, n));
+    }
+  }
+}
+
 TEST(CRC, Values) {
   ASSERT_NE(Value("a", 1), Value("foo", 3));
 }
@@ -9,9 +9,23 @@
 #include "consensus/consensus.h"
 #include "utilstrencodings.h"
 
-CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
+CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter) : CMerkleBlock(block, filter, ExtractFilterElements(block))
+{
+}
+
+std::vector<CBloomFilterElements> CMerkleBlock::ExtractFilterElements(const CBlock& block)
+{
+    std::vector<CBloomFilterElements> vElements;
+    vElements.reserve(block.vtx.size());
+    for (const CTransactionRef& tx : block.vtx)
+        vElements.emplace_back(*tx);
+    return vElements;
+}
+
+CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter, const std::vector<CBloomFilterElements>& vElements)
 {
     header = block.GetBlockHeader();
+    assert(vElements.size() == block.vtx.size());
 
     std::vector<bool> vMatch;
     std::vector<uint256> vHashes;
@@ -22,7 +36,7 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const uint256& hash = block.vtx[i]->GetHash();
-        if (filter.IsRelevantAndUpdate(*block.vtx[i]))
+        if (filter.IsRelevantAndUpdate(*block.vtx[i], vElements[i]))
         {
             vMatch.push_back(true);
             vMatchedTxn.push_back(std::make_pair(i, hash));
@@ -140,6 +140,15 @@ public:
      */
     CMerkleBlock(const CBlock& block, CBloomFilter& filter);
 
+    /**
+     * As above, with the filter elements of each transaction in block already
+     * extracted (see ExtractFilterElements), so they can be shared by many filters.
+     */
+    CMerkleBlock(const CBlock& block, CBloomFilter& filter, const std::vector<CBloomFilterElements>& vElements);
+
+    //! Extract the bloom filter elements of every transaction in block
+    static std::vector<CBloomFilterElements> ExtractFilterElements(const CBlock& block);
+
     // Create from a CBlock, matching the txids in the set
     CMerkleBlock(const CBlock& block, const std::set<uint256>& txids);
 
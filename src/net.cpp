@@ -16,6 +16,7 @@
 #include "crypto/common.h"
 #include "crypto/sha256.h"
 #include "hash.h"
+#include "memusage.h"
 #include "primitives/transaction.h"
 #include "netbase.h"
 #include "scheduler.h"
@@ -28,6 +29,11 @@
 #include <fcntl.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -438,6 +444,7 @@ void CConnman::ClearBanned()
     {
         LOCK(cs_setBanned);
         setBanned.clear();
+        banIndex.Clear();
         setBannedIsDirty = true;
     }
     DumpBanlist(); //store banlist to disk
@@ -447,19 +454,8 @@ void CConnman::ClearBanned()
 
 bool CConnman::IsBanned(CNetAddr ip)
 {
-    bool fResult = false;
-    {
-        LOCK(cs_setBanned);
-        for (banmap_t::iterator it = setBanned.begin(); it != setBanned.end(); it++)
-        {
-            CSubNet subNet = (*it).first;
-            CBanEntry banEntry = (*it).second;
-
-            if(subNet.Match(ip) && GetTime() < banEntry.nBanUntil)
-                fResult = true;
-        }
-    }
-    return fResult;
+    LOCK(cs_setBanned);
+    return banIndex.IsBanned(ip, GetTime());
 }
 
 bool CConnman::IsBanned(CSubNet subnet)
@@ -497,6 +493,7 @@ void CConnman::Ban(const CSubNet& subNet, const BanReason &banReason, int64_t ba
         LOCK(cs_setBanned);
         if (setBanned[subNet].nBanUntil < banEntry.nBanUntil) {
             setBanned[subNet] = banEntry;
+            banIndex.Insert(subNet, banEntry.nBanUntil);
             setBannedIsDirty = true;
         }
         else
@@ -525,6 +522,7 @@ bool CConnman::Unban(const CSubNet &subNet) {
         LOCK(cs_setBanned);
         if (!setBanned.erase(subNet))
             return false;
+        banIndex.Erase(subNet);
         setBannedIsDirty = true;
     }
     if(clientInterface)
@@ -543,6 +541,7 @@ void CConnman::SetBanned(const banmap_t &banMap)
 {
     LOCK(cs_setBanned);
     setBanned = banMap;
+    banIndex.Rebuild(setBanned);
     setBannedIsDirty = true;
 }
 
@@ -551,6 +550,7 @@ void CConnman::SweepBanned()
     int64_t now = GetTime();
 
     LOCK(cs_setBanned);
+    bool fRemoved = false;
     banmap_t::iterator it = setBanned.begin();
     while(it != setBanned.end())
     {
@@ -560,11 +560,15 @@ void CConnman::SweepBanned()
         {
             setBanned.erase(it++);
             setBannedIsDirty = true;
+            fRemoved = true;
             LogPrint("net", "%s: Removed banned node ip/subnet from banlist.dat: %s\n", __func__, subNet.ToString());
         }
         else
             ++it;
     }
+    // Rebuilding also drops the trie paths left behind by expired and unbanned entries
+    if (fRemoved)
+        banIndex.Rebuild(setBanned);
 }
 
 bool CConnman::BannedSetIsDirty()
@@ -655,6 +659,10 @@ void CNode::copyStats(CNodeStats &stats)
         X(mapRecvBytesPerMsgCmd);
         X(nRecvBytes);
     }
+    {
+        LOCK(cs_msgStats);
+        X(msgStats);
+    }
     X(fWhitelisted);
 
     // It is common for nodes with good ping times to suddenly become lagged,
@@ -676,9 +684,51 @@ void CNode::copyStats(CNodeStats &stats)
     // Leave string empty if addrLocal invalid (not filled in yet)
     CService addrLocalUnlocked = GetAddrLocal();
     stats.addrLocal = addrLocalUnlocked.IsValid() ? addrLocalUnlocked.ToString() : "";
+
+    X(nMemoryUsage);
 }
 #undef X
 
+size_t CNode::GetMemoryUsage(std::set<const CSharedNetMsgPayload*>* psetShared)
+{
+    size_t nUsage = nOrphanMemoryUsage + nRelayMemoryUsage;
+    {
+        LOCK(cs_vSend);
+        nUsage += nSendSize + memusage::MallocUsage(sizeof(CNetSendBuffer)) * vSendMsg.size();
+        for (const CNetSendBuffer& buffer : vSendMsg) {
+            if (buffer.GetShared()) {
+                nUsage -= buffer.size();
+                if (psetShared)
+                    psetShared->insert(buffer.GetShared());
+            }
+        }
+    }
+    BOOST_FOREACH(const CNetMessage& msg, vRecvMsg)
+        nUsage += memusage::MallocUsage(sizeof(CNetMessage)) + msg.vRecv.size();
+    {
+        LOCK(cs_vProcessMsg);
+        nUsage += nProcessQueueSize + memusage::MallocUsage(sizeof(CNetMessage)) * vProcessMsg.size();
+    }
+    nUsage += recvBufferPool.GetMemoryUsage();
+    {
+        LOCK(cs_inventory);
+        nUsage += filterInventoryKnown.DynamicMemoryUsage();
+        nUsage += memusage::DynamicUsage(setInventoryTxToSend);
+        nUsage += memusage::DynamicUsage(vInventoryBlockToSend);
+        nUsage += memusage::DynamicUsage(vBlockHashesToAnnounce);
+    }
+    {
+        LOCK(cs_addrSend);
+        nUsage += addrKnown.DynamicMemoryUsage();
+    }
+    {
+        LOCK(cs_filter);
+        if (pfilter)
+            nUsage += memusage::MallocUsage(sizeof(CBloomFilter)) + pfilter->DynamicMemoryUsage();
+    }
+    return nUsage;
+}
+
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete)
 {
     complete = false;
@@ -710,6 +760,10 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
             return false;
         }
 
+        // Header just completed: receive the payload into a pooled buffer
+        if (msg.in_data && msg.nDataPos == 0 && msg.vRecv.empty())
+            recvBufferPool.Get(msg.vRecv, msg.hdr.nMessageSize);
+
         pch += handled;
         nBytes -= handled;
 
@@ -722,6 +776,12 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
                 i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
             assert(i != mapRecvBytesPerMsgCmd.end());
             i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+            {
+                LOCK(cs_msgStats);
+                CNetMsgCmdStats& cmdStats = msgStats.mapCmdStats[i->first];
+                cmdStats.nMsgsRecv++;
+                cmdStats.nBytesRecv += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+            }
 
             msg.nTime = nTimeMicros;
             complete = true;
@@ -731,6 +791,70 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
     return true;
 }
 
+void CNode::RecordProcessedMessage(const std::string& strCommand, int64_t nQueueWait, int64_t nProcessTime)
+{
+    LOCK(cs_msgStats);
+    // Only commands that were counted on receipt get their own entry
+    mapMsgCmdStats::iterator it = msgStats.mapCmdStats.find(strCommand);
+    if (it == msgStats.mapCmdStats.end())
+        it = msgStats.mapCmdStats.insert(std::make_pair(NET_MESSAGE_COMMAND_OTHER, CNetMsgCmdStats())).first;
+    it->second.nMsgsProcessed++;
+    it->second.nProcessTime += nProcessTime;
+    msgStats.histQueueWait.Add(std::max(nQueueWait, (int64_t)0));
+    msgStats.histProcessTime.Add(std::max(nProcessTime, (int64_t)0));
+}
+
+void CNode::RecordSendMessagesTime(int64_t nTime)
+{
+    LOCK(cs_msgStats);
+    msgStats.histSendMessagesTime.Add(std::max(nTime, (int64_t)0));
+}
+
+void CNetHistogram::SetNull()
+{
+    nCount = 0;
+    nSum = 0;
+    nMax = 0;
+    memset(vBuckets, 0, sizeof(vBuckets));
+}
+
+void CNetHistogram::Add(uint64_t nValue)
+{
+    int nBucket = 0;
+    while (nBucket < NUM_BUCKETS - 1 && nValue >= BucketLimit(nBucket))
+        nBucket++;
+    vBuckets[nBucket]++;
+    nCount++;
+    nSum += nValue;
+    nMax = std::max(nMax, nValue);
+}
+
+void CNetHistogram::Merge(const CNetHistogram& other)
+{
+    for (int i = 0; i < NUM_BUCKETS; i++)
+        vBuckets[i] += other.vBuckets[i];
+    nCount += other.nCount;
+    nSum += other.nSum;
+    nMax = std::max(nMax, other.nMax);
+}
+
+void CNetMsgStats::Merge(const CNetMsgStats& other)
+{
+    BOOST_FOREACH(const mapMsgCmdStats::value_type& item, other.mapCmdStats) {
+        CNetMsgCmdStats& cmdStats = mapCmdStats[item.first];
+        cmdStats.nMsgsSent += item.second.nMsgsSent;
+        cmdStats.nBytesSent += item.second.nBytesSent;
+        cmdStats.nMsgsRecv += item.second.nMsgsRecv;
+        cmdStats.nBytesRecv += item.second.nBytesRecv;
+        cmdStats.nMsgsProcessed += item.second.nMsgsProcessed;
+        cmdStats.nProcessTime += item.second.nProcessTime;
+    }
+    histQueueWait.Merge(other.histQueueWait);
+    histProcessTime.Merge(other.histProcessTime);
+    histSendMessagesTime.Merge(other.histSendMessagesTime);
+    histSendQueueBytes.Merge(other.histSendQueueBytes);
+}
+
 void CNode::SetSendVersion(int nVersionIn)
 {
     // Send version may only be changed in the version message, and
@@ -761,23 +885,21 @@ int CNode::GetSendVersion() const
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
     memcpy(&hdrbuf[nHdrPos], pch, nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
         return nCopy;
 
-    // deserialize to CMessageHeader
-    try {
-        hdrbuf >> hdr;
-    }
-    catch (const std::exception&) {
-        return -1;
-    }
+    // deserialize to CMessageHeader, straight from the fixed size buffer
+    memcpy(hdr.pchMessageStart, hdrbuf, CMessageHeader::MESSAGE_START_SIZE);
+    memcpy(hdr.pchCommand, hdrbuf + CMessageHeader::MESSAGE_START_SIZE, CMessageHeader::COMMAND_SIZE);
+    hdr.nMessageSize = ReadLE32((const unsigned char*)hdrbuf + CMessageHeader::MESSAGE_SIZE_OFFSET);
+    memcpy(hdr.pchChecksum, hdrbuf + CMessageHeader::CHECKSUM_OFFSET, CMessageHeader::CHECKSUM_SIZE);
 
     // reject messages larger than MAX_SIZE
     if (hdr.nMessageSize > MAX_SIZE)
@@ -814,6 +936,69 @@ const uint256& CNetMessage::GetMessageHash() const
     return data_hash;
 }
 
+// Receive buffer size classes, and how many free buffers of each a connection keeps
+static const size_t RECV_POOL_CLASS_SIZE[CNetRecvBufferPool::NUM_SIZE_CLASSES] = {1024, 8 * 1024, 64 * 1024};
+static const size_t RECV_POOL_CLASS_COUNT[CNetRecvBufferPool::NUM_SIZE_CLASSES] = {16, 4, 1};
+
+void CNetRecvBufferPool::Get(CDataStream& stream, size_t nSize)
+{
+    int nClass = 0;
+    while (nClass < NUM_SIZE_CLASSES && RECV_POOL_CLASS_SIZE[nClass] < nSize)
+        nClass++;
+    if (nClass == NUM_SIZE_CLASSES)
+        return;
+
+    CSerializeData buf;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!vFree[nClass].empty()) {
+            buf.swap(vFree[nClass].back());
+            vFree[nClass].pop_back();
+        }
+    }
+    // Allocate whole classes, so the buffer can be pooled again afterwards
+    if (buf.capacity() < RECV_POOL_CLASS_SIZE[nClass])
+        buf.reserve(RECV_POOL_CLASS_SIZE[nClass]);
+    stream.swap(buf);
+}
+
+void CNetRecvBufferPool::Put(CDataStream& stream)
+{
+    CSerializeData buf;
+    stream.swap(buf);
+    int nClass = NUM_SIZE_CLASSES - 1;
+    while (nClass >= 0 && buf.capacity() < RECV_POOL_CLASS_SIZE[nClass])
+        nClass--;
+    // Too small to be worth keeping, or too large to keep around
+    if (nClass < 0 || buf.capacity() > 2 * RECV_POOL_CLASS_SIZE[nClass])
+        return;
+
+    buf.clear();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (vFree[nClass].size() < RECV_POOL_CLASS_COUNT[nClass])
+        vFree[nClass].push_back(std::move(buf));
+}
+
+size_t CNetRecvBufferPool::GetFreeCount() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t nCount = 0;
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++)
+        nCount += vFree[i].size();
+    return nCount;
+}
+
+size_t CNetRecvBufferPool::GetMemoryUsage() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t nUsage = 0;
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        BOOST_FOREACH(const CSerializeData& buf, vFree[i])
+            nUsage += memusage::MallocUsage(buf.capacity());
+    }
+    return nUsage;
+}
+
 
 
 
@@ -823,33 +1008,63 @@ const uint256& CNetMessage::GetMessageHash() const
 
 
 // requires LOCK(cs_vSend)
-size_t CConnman::SocketSendData(CNode *pnode) const
+size_t CConnman::SocketSendData(CNode *pnode, size_t nMaxBytes, size_t* pnSentByPriority) const
 {
     auto it = pnode->vSendMsg.begin();
     size_t nSentSize = 0;
 
-    while (it != pnode->vSendMsg.end()) {
-        const auto &data = *it;
-        assert(data.size() > pnode->nSendOffset);
+    while (it != pnode->vSendMsg.end() && nSentSize < nMaxBytes) {
+        assert(it->size() > pnode->nSendOffset);
+        size_t nBudget = nMaxBytes - nSentSize;
         int nBytes = 0;
+        size_t nAttempted = 0;
         {
             LOCK(pnode->cs_hSocket);
             if (pnode->hSocket == INVALID_SOCKET)
                 break;
-            nBytes = send(pnode->hSocket, reinterpret_cast<const char*>(data.data()) + pnode->nSendOffset, data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#ifdef WIN32
+            nAttempted = std::min(it->size() - pnode->nSendOffset, nBudget);
+            nBytes = send(pnode->hSocket, reinterpret_cast<const char*>(it->data()) + pnode->nSendOffset, nAttempted, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+            // Hand as many queued buffers as we can to the kernel in one call
+            struct iovec iov[MAX_SEND_IOV];
+            int nIov = 0;
+            size_t nOffset = pnode->nSendOffset;
+            for (auto itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV && nAttempted < nBudget; ++itIov, ++nIov) {
+                iov[nIov].iov_base = const_cast<unsigned char*>(itIov->data()) + nOffset;
+                iov[nIov].iov_len = std::min(itIov->size() - nOffset, nBudget - nAttempted);
+                nAttempted += iov[nIov].iov_len;
+                nOffset = 0;
+            }
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = nIov;
+            nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         }
         if (nBytes > 0) {
             pnode->nLastSend = GetSystemTimeInSeconds();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             nSentSize += nBytes;
-            if (pnode->nSendOffset == data.size()) {
+            // Drop the buffers that went out completely
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                size_t nRemaining = it->size() - pnode->nSendOffset;
+                if (nLeft < nRemaining) {
+                    pnSentByPriority[it->priority()] += nLeft;
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                pnSentByPriority[it->priority()] += nRemaining;
+                nLeft -= nRemaining;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
-                pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
+                pnode->nSendSize -= it->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
+            if ((size_t)nBytes < nAttempted) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -1101,305 +1316,795 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
     {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
+        WakeSocketHandler(pnode);
     }
 }
 
-void CConnman::ThreadSocketHandler()
+void CConnman::DisconnectNodes()
 {
-    unsigned int nPrevNodeCount = 0;
-    while (!interruptNet)
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        std::vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            std::vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect)
             {
-                if (pnode->fDisconnect)
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+#ifdef USE_EPOLL
+                UnregisterSocketEvents(pnode);
+#endif
 
-                    // hold in disconnected pool until all refs are released
-                    pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+
+                // hold in disconnected pool until all refs are released
+                pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        std::list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            std::list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
-            {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0) {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_inventory, lockInv);
-                        if (lockInv) {
-                            TRY_LOCK(pnode->cs_vSend, lockSend);
-                            if (lockSend) {
-                                fDelete = true;
-                            }
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0) {
+                bool fDelete = false;
+                {
+                    TRY_LOCK(pnode->cs_inventory, lockInv);
+                    if (lockInv) {
+                        TRY_LOCK(pnode->cs_vSend, lockSend);
+                        if (lockSend) {
+                            fDelete = true;
                         }
                     }
-                    if (fDelete) {
-                        vNodesDisconnected.remove(pnode);
-                        DeleteNode(pnode);
+                }
+                if (fDelete) {
+                    vNodesDisconnected.remove(pnode);
+#ifdef USE_EPOLL
+                    {
+                        std::lock_guard<std::mutex> lock(mutexSocketEvents);
+                        vSocketEventsPending.erase(std::remove(vSocketEventsPending.begin(), vSocketEventsPending.end(), pnode), vSocketEventsPending.end());
                     }
+                    setPausedNodes.erase(pnode);
+#endif
+                    DeleteNode(pnode);
                 }
             }
         }
-        size_t vNodesSize;
+    }
+}
+
+void CConnman::NotifyNumConnectionsChanged()
+{
+    size_t vNodesSize;
+    {
+        LOCK(cs_vNodes);
+        vNodesSize = vNodes.size();
+    }
+    if(vNodesSize != nPrevNodeCount) {
+        nPrevNodeCount = vNodesSize;
+        if(clientInterface)
+            clientInterface->NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+void CConnman::InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetSystemTimeInSeconds();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
         {
-            LOCK(cs_vNodes);
-            vNodesSize = vNodes.size();
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
         }
-        if(vNodesSize != nPrevNodeCount) {
-            nPrevNodeCount = vNodesSize;
-            if(clientInterface)
-                clientInterface->NotifyNumConnectionsChanged(nPrevNodeCount);
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
         }
+        else if (!pnode->fSuccessfullyConnected)
+        {
+            LogPrintf("version handshake timeout from %d\n", pnode->id);
+            pnode->fDisconnect = true;
+        }
+    }
+}
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
+void CConnman::ServiceNodeSocket(CNode* pnode, bool recvSet, bool sendSet, bool errorSet)
+{
+    //
+    // Receive
+    //
+    if (recvSet || errorSet)
+    {
+        // typical socket buffer is 8K-64K
+        char pchBuf[0x10000];
+        int nBytes = 0;
+        {
+            LOCK(pnode->cs_hSocket);
+            if (pnode->hSocket == INVALID_SOCKET)
+                return;
+            nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+        }
+        if (nBytes > 0)
+        {
+            bool notify = false;
+            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
+                pnode->CloseSocketDisconnect();
+            RecordBytesRecv(nBytes);
+            if (notify) {
+                size_t nSizeAdded = 0;
+                auto it(pnode->vRecvMsg.begin());
+                for (; it != pnode->vRecvMsg.end(); ++it) {
+                    if (!it->complete())
+                        break;
+                    nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
+                }
+                {
+                    LOCK(pnode->cs_vProcessMsg);
+                    pnode->vProcessMsg.splice(pnode->vProcessMsg.end(), pnode->vRecvMsg, pnode->vRecvMsg.begin(), it);
+                    pnode->nProcessQueueSize += nSizeAdded;
+                    pnode->fPauseRecv = pnode->nProcessQueueSize > nReceiveFloodSize;
+                }
+                WakeMessageHandler(pnode);
+            }
+        }
+        else if (nBytes == 0)
+        {
+            // socket closed gracefully
+            if (!pnode->fDisconnect)
+                LogPrint("net", "socket closed\n");
+            pnode->CloseSocketDisconnect();
+        }
+        else if (nBytes < 0)
+        {
+            // error
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            {
+                if (!pnode->fDisconnect)
+                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+                pnode->CloseSocketDisconnect();
+            }
+        }
+    }
 
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
+    //
+    // Send
+    //
+    if (sendSet)
+    {
+        size_t vSentByPriority[SEND_PRIORITY_COUNT] = {};
+        size_t nBytes;
+        {
+            LOCK(pnode->cs_vSend);
+            nBytes = SocketSendData(pnode, pnode->nSendAllowance, vSentByPriority);
+            if (pnode->nSendAllowance != std::numeric_limits<size_t>::max())
+                pnode->nSendAllowance -= nBytes;
         }
+        if (nBytes) {
+            RecordBytesSent(nBytes);
+            uploadScheduler.Consume(vSentByPriority);
+        }
+    }
+}
 
+void CConnman::SocketHandlerSelect()
+{
+    //
+    // Find which sockets have data to receive
+    //
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = SOCKET_HANDLER_INTERVAL * 1000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = std::max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is space left in the receive buffer, select() for
+            //   receiving data.
+            // * Hand off all complete messages to the processor, to be handled without
+            //   blocking here.
+
+            // * A peer that has used up its upload allowance for this round
+            //   waits for the next one, and may receive meanwhile.
+
+            bool select_recv = !pnode->fPauseRecv;
+            bool select_send;
             {
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is space left in the receive buffer, select() for
-                //   receiving data.
-                // * Hand off all complete messages to the processor, to be handled without
-                //   blocking here.
-
-                bool select_recv = !pnode->fPauseRecv;
-                bool select_send;
-                {
-                    LOCK(pnode->cs_vSend);
-                    select_send = !pnode->vSendMsg.empty();
-                }
+                LOCK(pnode->cs_vSend);
+                select_send = !pnode->vSendMsg.empty() && pnode->nSendAllowance > 0;
+            }
 
-                LOCK(pnode->cs_hSocket);
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
+            LOCK(pnode->cs_hSocket);
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
 
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = std::max(hSocketMax, pnode->hSocket);
+            have_fds = true;
 
-                if (select_send) {
-                    FD_SET(pnode->hSocket, &fdsetSend);
-                    continue;
-                }
-                if (select_recv) {
-                    FD_SET(pnode->hSocket, &fdsetRecv);
-                }
+            if (select_send) {
+                FD_SET(pnode->hSocket, &fdsetSend);
+                continue;
+            }
+            if (select_recv) {
+                FD_SET(pnode->hSocket, &fdsetRecv);
             }
         }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (interruptNet)
+        return;
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        if (!interruptNet.sleep_for(std::chrono::milliseconds(timeout.tv_usec/1000)))
+            return;
+    }
+
+    //
+    // Accept new connections
+    //
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+    {
+        if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+        {
+            AcceptConnection(hListenSocket);
+        }
+    }
+
+    //
+    // Service each socket
+    //
+    std::vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
         if (interruptNet)
             return;
 
-        if (nSelect == SOCKET_ERROR)
+        bool recvSet = false;
+        bool sendSet = false;
+        bool errorSet = false;
         {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            if (!interruptNet.sleep_for(std::chrono::milliseconds(timeout.tv_usec/1000)))
-                return;
+            LOCK(pnode->cs_hSocket);
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            recvSet = FD_ISSET(pnode->hSocket, &fdsetRecv);
+            sendSet = FD_ISSET(pnode->hSocket, &fdsetSend);
+            errorSet = FD_ISSET(pnode->hSocket, &fdsetError);
         }
+        ServiceNodeSocket(pnode, recvSet, sendSet, errorSet);
 
         //
-        // Accept new connections
+        // Inactivity checking
         //
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
-        {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
+        InactivityCheck(pnode);
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
+}
+
+#ifdef USE_EPOLL
+bool CConnman::InitSocketEvents(std::string& strError)
+{
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd == -1) {
+        strError = strprintf("Error: Couldn't create epoll instance: %s", NetworkErrorString(errno));
+        return false;
+    }
+    if (pipe2(wakeupPipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+        wakeupPipe[0] = wakeupPipe[1] = -1;
+        strError = strprintf("Error: Couldn't create socket handler wakeup pipe: %s", NetworkErrorString(errno));
+        return false;
+    }
+
+    std::vector<int> vFds;
+    vFds.push_back(wakeupPipe[0]);
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        vFds.push_back(hListenSocket.socket);
+    BOOST_FOREACH(int fd, vFds) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = 0;
+        event.data.fd = fd;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            strError = strprintf("Error: Couldn't add socket to epoll instance: %s", NetworkErrorString(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+void CConnman::UpdateSocketEvents(CNode* pnode)
+{
+    // Same logic as the select() loop: drain the send queue before receiving
+    // more, and don't receive while the process queue is full.
+    bool fSend;
+    {
+        LOCK(pnode->cs_vSend);
+        fSend = !pnode->vSendMsg.empty() && pnode->nSendAllowance > 0;
+    }
+    bool fPauseRecv = pnode->fPauseRecv;
+    uint32_t nEvents = 0;
+    if (fSend)
+        nEvents = EPOLLOUT;
+    else if (!fPauseRecv)
+        nEvents = EPOLLIN;
+
+    LOCK(pnode->cs_hSocket);
+    if (pnode->hSocket == INVALID_SOCKET) {
+        setPausedNodes.erase(pnode);
+        return;
+    }
+    // The message handler unpauses nodes without telling us, so paused
+    // nodes are rechecked on every pass.
+    if (fPauseRecv)
+        setPausedNodes.insert(pnode);
+    else
+        setPausedNodes.erase(pnode);
+
+    if (pnode->hSocketEvents != INVALID_SOCKET && pnode->nSocketEvents == nEvents)
+        return;
+
+    struct epoll_event event;
+    event.events = nEvents;
+    event.data.u64 = 0;
+    event.data.fd = pnode->hSocket;
+    int op = pnode->hSocketEvents == INVALID_SOCKET ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(epollfd, op, pnode->hSocket, &event) != 0) {
+        LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(errno));
+        pnode->fDisconnect = true;
+        return;
+    }
+    if (op == EPOLL_CTL_ADD) {
+        pnode->hSocketEvents = pnode->hSocket;
+        mapSocketNodes[pnode->hSocket] = pnode;
+    }
+    pnode->nSocketEvents = nEvents;
+}
+
+void CConnman::UnregisterSocketEvents(CNode* pnode)
+{
+    setPausedNodes.erase(pnode);
+    if (pnode->hSocketEvents == INVALID_SOCKET)
+        return;
+
+    auto it = mapSocketNodes.find(pnode->hSocketEvents);
+    if (it != mapSocketNodes.end() && it->second == pnode)
+        mapSocketNodes.erase(it);
+
+    LOCK(pnode->cs_hSocket);
+    // A socket closed elsewhere has left the epoll set already, and its
+    // descriptor may have been reused by now.
+    if (pnode->hSocket == pnode->hSocketEvents)
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, pnode->hSocket, NULL);
+    pnode->hSocketEvents = INVALID_SOCKET;
+}
+
+void CConnman::SocketHandlerEpoll()
+{
+    std::vector<CNode*> vPending;
+    {
+        std::lock_guard<std::mutex> lock(mutexSocketEvents);
+        vPending.swap(vSocketEventsPending);
+    }
+    BOOST_FOREACH(CNode* pnode, vPending)
+        UpdateSocketEvents(pnode);
+    std::vector<CNode*> vPaused(setPausedNodes.begin(), setPausedNodes.end());
+    BOOST_FOREACH(CNode* pnode, vPaused)
+        UpdateSocketEvents(pnode);
+
+    struct epoll_event events[256];
+    int nEvents = epoll_wait(epollfd, events, ARRAYLEN(events), SOCKET_HANDLER_INTERVAL);
+    if (interruptNet)
+        return;
+
+    if (nEvents == -1)
+    {
+        int nErr = errno;
+        if (nErr != EINTR) {
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+            interruptNet.sleep_for(std::chrono::milliseconds(SOCKET_HANDLER_INTERVAL));
+        }
+        return;
+    }
+
+    // Nodes are only deleted by this thread, in DisconnectNodes, which also
+    // drops their registrations, so the pointers found here stay valid.
+    std::vector<std::pair<CNode*, uint32_t> > vReady;
+    for (int i = 0; i < nEvents; i++)
+    {
+        int fd = events[i].data.fd;
+        if (fd == wakeupPipe[0]) {
+            char buf[64];
+            while (read(fd, buf, sizeof(buf)) > 0) {}
+            continue;
+        }
+
+        bool fListen = false;
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+            if (hListenSocket.socket == (SOCKET)fd) {
                 AcceptConnection(hListenSocket);
+                fListen = true;
+                break;
             }
         }
+        if (fListen)
+            continue;
 
-        //
-        // Service each socket
-        //
-        std::vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
+        auto it = mapSocketNodes.find(fd);
+        if (it != mapSocketNodes.end())
+            vReady.push_back(std::make_pair(it->second, (uint32_t)events[i].events));
+    }
+
+    for (const auto& ready : vReady)
+    {
+        if (interruptNet)
+            return;
+        CNode* pnode = ready.first;
+        ServiceNodeSocket(pnode, ready.second & EPOLLIN, ready.second & EPOLLOUT, ready.second & (EPOLLERR | EPOLLHUP));
+        UpdateSocketEvents(pnode);
+    }
+}
+#endif
+
+void CConnman::WakeSocketHandler(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    bool fWake;
+    {
+        std::lock_guard<std::mutex> lock(mutexSocketEvents);
+        fWake = vSocketEventsPending.empty();
+        if (pnode)
+            vSocketEventsPending.push_back(pnode);
+    }
+    if ((fWake || !pnode) && wakeupPipe[1] != -1) {
+        char c = 0;
+        if (write(wakeupPipe[1], &c, 1) != 1) {
+            // The pipe is full, so a wakeup is pending anyway
         }
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
-        {
-            if (interruptNet)
-                return;
+    }
+#endif
+}
 
-            //
-            // Receive
-            //
-            bool recvSet = false;
-            bool sendSet = false;
-            bool errorSet = false;
-            {
-                LOCK(pnode->cs_hSocket);
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                recvSet = FD_ISSET(pnode->hSocket, &fdsetRecv);
-                sendSet = FD_ISSET(pnode->hSocket, &fdsetSend);
-                errorSet = FD_ISSET(pnode->hSocket, &fdsetError);
-            }
-            if (recvSet || errorSet)
-            {
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = 0;
-                        {
-                            LOCK(pnode->cs_hSocket);
-                            if (pnode->hSocket == INVALID_SOCKET)
-                                continue;
-                            nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        }
-                        if (nBytes > 0)
-                        {
-                            bool notify = false;
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
-                                pnode->CloseSocketDisconnect();
-                            RecordBytesRecv(nBytes);
-                            if (notify) {
-                                size_t nSizeAdded = 0;
-                                auto it(pnode->vRecvMsg.begin());
-                                for (; it != pnode->vRecvMsg.end(); ++it) {
-                                    if (!it->complete())
-                                        break;
-                                    nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
-                                }
-                                {
-                                    LOCK(pnode->cs_vProcessMsg);
-                                    pnode->vProcessMsg.splice(pnode->vProcessMsg.end(), pnode->vRecvMsg, pnode->vRecvMsg.begin(), it);
-                                    pnode->nProcessQueueSize += nSizeAdded;
-                                    pnode->fPauseRecv = pnode->nProcessQueueSize > nReceiveFloodSize;
-                                }
-                                WakeMessageHandler();
-                            }
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
+void CConnman::CheckPeerMemory()
+{
+    std::vector<std::pair<size_t, CNode*> > vNodeUsage;
+    std::set<const CSharedNetMsgPayload*> setShared;
+    size_t nTotalUsage = 0;
 
-            //
-            // Send
-            //
-            if (sendSet)
-            {
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes) {
+        size_t nUsage = pnode->GetMemoryUsage(&setShared);
+        pnode->nMemoryUsage = nUsage;
+        nTotalUsage += nUsage;
+        // As in AttemptToEvictConnection, only inbound peers are candidates:
+        // outbound peers were picked by us.
+        if (pnode->fInbound && !pnode->fDisconnect && !pnode->fWhitelisted)
+            vNodeUsage.push_back(std::make_pair(nUsage, pnode));
+    }
+    // Payloads queued for several peers (such as new blocks) count once
+    BOOST_FOREACH(const CSharedNetMsgPayload* pshared, setShared)
+        nTotalUsage += memusage::MallocUsage(sizeof(CSharedNetMsgPayload)) + memusage::DynamicUsage(pshared->data);
+    if (nMaxPeerMemory == 0 || nTotalUsage <= nMaxPeerMemory)
+        return;
+
+    // Disconnect the heaviest peers first: they free the most memory per
+    // lost connection, and are the likeliest to be misbehaving. Shared
+    // payloads stay until every peer has sent them, so they aren't part of
+    // what a disconnection frees.
+    std::sort(vNodeUsage.begin(), vNodeUsage.end(), std::greater<std::pair<size_t, CNode*> >());
+    BOOST_FOREACH(const PAIRTYPE(size_t, CNode*)& nodeUsage, vNodeUsage) {
+        if (nTotalUsage <= nMaxPeerMemory)
+            break;
+        LogPrintf("Peer memory usage %u exceeds budget %u, disconnecting peer=%d using %u bytes\n",
+                  nTotalUsage, nMaxPeerMemory, nodeUsage.second->GetId(), nodeUsage.first);
+        nodeUsage.second->fDisconnect = true;
+        nTotalUsage -= nodeUsage.first;
+    }
+}
+
+void CConnman::ScheduleUploads()
+{
+    // Pace historical blocks so the rest of the -maxuploadtarget budget,
+    // less the buffer kept for relaying new blocks, lasts until the cycle ends
+    bool fHistoricalLimited = nMaxHistoricalUploadRate != 0;
+    uint64_t nHistoricalRate = nMaxHistoricalUploadRate;
+    {
+        LOCK(cs_totalBytesSent);
+        if (nMaxOutboundLimit != 0) {
+            uint64_t timeLeftInCycle = GetMaxOutboundTimeLeftInCycle();
+            uint64_t buffer = timeLeftInCycle / 600 * MAX_BLOCK_SERIALIZED_SIZE;
+            uint64_t nTargetRate = 0;
+            if (buffer < nMaxOutboundLimit && nMaxOutboundTotalBytesSentInCycle < nMaxOutboundLimit - buffer)
+                nTargetRate = (nMaxOutboundLimit - buffer - nMaxOutboundTotalBytesSentInCycle) / std::max<uint64_t>(timeLeftInCycle, 1);
+            nHistoricalRate = fHistoricalLimited ? std::min(nHistoricalRate, nTargetRate) : nTargetRate;
+            fHistoricalLimited = true;
+        }
+    }
+    uploadScheduler.SetClassRate(SEND_PRIORITY_HISTORICAL, fHistoricalLimited, nHistoricalRate);
+
+    bool fLimited = uploadScheduler.IsLimited();
+    if (!fLimited && !fUploadsScheduled)
+        return;
+    fUploadsScheduled = fLimited;
+    if (fLimited)
+        uploadScheduler.Refill(GetTimeMicros());
+
+    std::vector<CNode*> vChanged;
+    {
+        LOCK(cs_vNodes);
+        // A peer's demand is the run of buffers at the front of its queue in
+        // the same class, so that messages still go out in the order queued.
+        std::vector<std::pair<int, size_t> > vDemand;
+        vDemand.reserve(vNodes.size());
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            int nPriority = SEND_PRIORITY_BLOCK;
+            size_t nDemand = 0;
+            if (fLimited) {
                 LOCK(pnode->cs_vSend);
-                size_t nBytes = SocketSendData(pnode);
-                if (nBytes) {
-                    RecordBytesSent(nBytes);
+                size_t nOffset = pnode->nSendOffset;
+                int nBuffers = 0;
+                for (auto it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nBuffers < MAX_SEND_IOV; ++it, ++nBuffers) {
+                    if (nBuffers == 0)
+                        nPriority = it->priority();
+                    else if (it->priority() != nPriority)
+                        break;
+                    nDemand += it->size() - nOffset;
+                    nOffset = 0;
                 }
             }
+            vDemand.push_back(std::make_pair(nPriority, nDemand));
+        }
+        std::vector<size_t> vAllowance;
+        if (fLimited)
+            vAllowance = uploadScheduler.Allocate(vDemand);
+        else
+            vAllowance.assign(vNodes.size(), std::numeric_limits<size_t>::max());
+        for (size_t i = 0; i < vNodes.size(); i++) {
+            CNode* pnode = vNodes[i];
+            LOCK(pnode->cs_vSend);
+            if ((pnode->nSendAllowance > 0) != (vAllowance[i] > 0))
+                vChanged.push_back(pnode);
+            pnode->nSendAllowance = vAllowance[i];
+        }
+    }
+#ifdef USE_EPOLL
+    // Nodes are only deleted by this thread, so the pointers stay valid
+    BOOST_FOREACH(CNode* pnode, vChanged)
+        UpdateSocketEvents(pnode);
+#endif
+}
+
+int GetSendPriority(const std::string& command)
+{
+    if (command == NetMsgType::BLOCK || command == NetMsgType::CMPCTBLOCK || command == NetMsgType::BLOCKTXN || command == NetMsgType::MERKLEBLOCK)
+        return SEND_PRIORITY_BLOCK;
+    if (command == NetMsgType::TX)
+        return SEND_PRIORITY_TX;
+    return SEND_PRIORITY_HEADERS;
+}
+
+void CUploadScheduler::Bucket::SetRate(bool fLimitedIn, uint64_t nRateIn)
+{
+    if (fLimitedIn && !fLimited) {
+        // Start out with one second's worth
+        nTokens = nRateIn;
+    } else if (fLimitedIn) {
+        nTokens = std::min(nTokens, (int64_t)nRateIn);
+    }
+    fLimited = fLimitedIn;
+    nRate = fLimitedIn ? nRateIn : 0;
+}
+
+CUploadScheduler::CUploadScheduler() : nLastRefill(0)
+{
+}
+
+void CUploadScheduler::SetRate(uint64_t nBytesPerSecond)
+{
+    LOCK(cs);
+    global.SetRate(nBytesPerSecond != 0, nBytesPerSecond);
+}
+
+void CUploadScheduler::SetClassRate(int nPriority, bool fLimited, uint64_t nBytesPerSecond)
+{
+    assert(nPriority >= 0 && nPriority < SEND_PRIORITY_COUNT);
+    LOCK(cs);
+    vClass[nPriority].SetRate(fLimited, nBytesPerSecond);
+}
+
+bool CUploadScheduler::IsLimited() const
+{
+    LOCK(cs);
+    if (global.fLimited)
+        return true;
+    for (int i = 0; i < SEND_PRIORITY_COUNT; i++) {
+        if (vClass[i].fLimited)
+            return true;
+    }
+    return false;
+}
+
+bool CUploadScheduler::AllowsImmediateSend(int nPriority) const
+{
+    // New blocks and control messages shouldn't sit out a round; the bytes
+    // they send still count against the node-wide bucket.
+    LOCK(cs);
+    if (vClass[nPriority].fLimited)
+        return false;
+    return !global.fLimited || nPriority <= SEND_PRIORITY_HEADERS;
+}
+
+void CUploadScheduler::Refill(int64_t nTimeMicros)
+{
+    LOCK(cs);
+    int64_t nElapsed = nLastRefill == 0 ? 0 : nTimeMicros - nLastRefill;
+    nLastRefill = nTimeMicros;
+    if (nElapsed <= 0)
+        return;
+    for (int i = -1; i < SEND_PRIORITY_COUNT; i++) {
+        Bucket* bucket = i < 0 ? &global : &vClass[i];
+        if (!bucket->fLimited)
+            continue;
+        // Don't let buckets overflow, or a long idle time would allow a burst
+        int64_t nEarned = std::min<int64_t>(nElapsed, 1000000) * bucket->nRate / 1000000;
+        bucket->nTokens = std::min<int64_t>(bucket->nTokens + nEarned, bucket->nRate);
+    }
+}
+
+std::vector<size_t> CUploadScheduler::Allocate(const std::vector<std::pair<int, size_t> >& vDemand) const
+{
+    static const size_t UNLIMITED = std::numeric_limits<size_t>::max();
+    std::vector<size_t> vAllowance(vDemand.size(), 0);
+
+    LOCK(cs);
+    size_t nGlobalLeft = global.fLimited ? (size_t)std::max<int64_t>(global.nTokens, 0) : UNLIMITED;
+    for (int nPriority = 0; nPriority < SEND_PRIORITY_COUNT; nPriority++) {
+        size_t nBudget = nGlobalLeft;
+        if (vClass[nPriority].fLimited)
+            nBudget = std::min(nBudget, (size_t)std::max<int64_t>(vClass[nPriority].nTokens, 0));
+        if (nBudget == UNLIMITED) {
+            // Peers in an unpaced class may send whatever they come to have queued
+            for (size_t i = 0; i < vDemand.size(); i++) {
+                if (vDemand[i].first == nPriority)
+                    vAllowance[i] = UNLIMITED;
+            }
+            continue;
+        }
+
+        // Fair sharing: serve the smallest demands first, each to at most an
+        // equal share of what is left, so big queues split the remainder
+        std::vector<std::pair<size_t, size_t> > vClassDemand;
+        for (size_t i = 0; i < vDemand.size(); i++) {
+            if (vDemand[i].first == nPriority && vDemand[i].second > 0)
+                vClassDemand.push_back(std::make_pair(vDemand[i].second, i));
+        }
+        std::sort(vClassDemand.begin(), vClassDemand.end());
+        for (size_t i = 0; i < vClassDemand.size(); i++) {
+            size_t nGranted = std::min(vClassDemand[i].first, nBudget / (vClassDemand.size() - i));
+            vAllowance[vClassDemand[i].second] = nGranted;
+            nBudget -= nGranted;
+            if (nGlobalLeft != UNLIMITED)
+                nGlobalLeft -= nGranted;
+        }
+    }
+    return vAllowance;
+}
+
+void CUploadScheduler::Consume(const size_t* pnSentByPriority)
+{
+    LOCK(cs);
+    for (int i = 0; i < SEND_PRIORITY_COUNT; i++) {
+        if (global.fLimited)
+            global.nTokens -= pnSentByPriority[i];
+        if (vClass[i].fLimited)
+            vClass[i].nTokens -= pnSentByPriority[i];
+    }
+}
+
+void CConnman::ThreadSocketHandler()
+{
+    int64_t nLastSweep = 0;
+    int64_t nLastMemoryCheck = 0;
+    while (!interruptNet)
+    {
+        int64_t nNow = GetTimeMillis();
+        if (nNow - nLastMemoryCheck >= PEER_MEMORY_CHECK_INTERVAL || nNow < nLastMemoryCheck) {
+            nLastMemoryCheck = nNow;
+            CheckPeerMemory();
+        }
+#ifdef USE_EPOLL
+        // Passes only visit sockets that had events, so the sweeps over all
+        // nodes run at the rate the select() loop would poll at.
+        bool fSweep = nNow - nLastSweep >= SOCKET_HANDLER_INTERVAL || nNow < nLastSweep;
+#else
+        bool fSweep = true;
+#endif
+        if (fSweep) {
+            nLastSweep = nNow;
+            DisconnectNodes();
+            NotifyNumConnectionsChanged();
+            ScheduleUploads();
+        }
+
+#ifdef USE_EPOLL
+        SocketHandlerEpoll();
 
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetSystemTimeInSeconds();
-            if (nTime - pnode->nTimeConnected > 60)
+        if (fSweep) {
+            std::vector<CNode*> vNodesCopy;
             {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-                else if (!pnode->fSuccessfullyConnected)
-                {
-                    LogPrintf("version handshake timeout from %d\n", pnode->id);
-                    pnode->fDisconnect = true;
-                }
+                LOCK(cs_vNodes);
+                vNodesCopy = vNodes;
             }
-        }
-        {
-            LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+                InactivityCheck(pnode);
         }
+#else
+        SocketHandlerSelect();
+#endif
     }
 }
 
@@ -1407,9 +2112,30 @@ void CConnman::WakeMessageHandler()
 {
     {
         std::lock_guard<std::mutex> lock(mutexMsgProc);
-        fMsgProcWake = true;
+        std::fill(vMsgProcWake.begin(), vMsgProcWake.end(), true);
     }
-    condMsgProc.notify_one();
+    condMsgProc.notify_all();
+}
+
+void CConnman::WakeMessageHandler(const CNode* pnode)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutexMsgProc);
+        if (vMsgProcWake.empty())
+            return;
+        vMsgProcWake[GetMessageHandlerThread(pnode)] = true;
+    }
+    // The condition variable is shared between the threads, so make sure
+    // the one we flagged gets to see it.
+    if (nMessageHandlerThreads == 1)
+        condMsgProc.notify_one();
+    else
+        condMsgProc.notify_all();
+}
+
+int CConnman::GetMessageHandlerThread(const CNode* pnode) const
+{
+    return pnode->GetId() % nMessageHandlerThreads;
 }
 
 
@@ -1630,10 +2356,18 @@ void CConnman::ThreadDNSAddressSeed()
 
 void CConnman::DumpAddresses()
 {
+    // peers.dat already matches the in-memory tables
+    uint64_t nChangeCount = addrman.GetChangeCount();
+    if (nChangeCount == nAddrManChangeCountDumped) {
+        LogPrint("net", "Skipped flushing unchanged peers.dat\n");
+        return;
+    }
+
     int64_t nStart = GetTimeMillis();
 
     CAddrDB adb;
-    adb.Write(addrman);
+    if (adb.Write(addrman))
+        nAddrManChangeCountDumped = nChangeCount;
 
     LogPrint("net", "Flushed %d addresses to peers.dat  %dms\n",
            addrman.size(), GetTimeMillis() - nStart);
@@ -1960,21 +2694,27 @@ bool CConnman::OpenNetworkConnection(const CAddress& addrConnect, bool fCountFai
     {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
+        WakeSocketHandler(pnode);
     }
 
     return true;
 }
 
-void CConnman::ThreadMessageHandler()
+void CConnman::ThreadMessageHandler(int nThread)
 {
     while (!flagInterruptMsgProc)
     {
+        // Each thread serves a fixed share of the peers, so a peer's messages
+        // are always processed in order by the same thread.
         std::vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
-                pnode->AddRef();
+            vNodesCopy.reserve(vNodes.size() / nMessageHandlerThreads + 1);
+            BOOST_FOREACH(CNode* pnode, vNodes) {
+                if (GetMessageHandlerThread(pnode) == nThread) {
+                    pnode->AddRef();
+                    vNodesCopy.push_back(pnode);
+                }
             }
         }
 
@@ -1994,7 +2734,9 @@ void CConnman::ThreadMessageHandler()
             // Send messages
             {
                 LOCK(pnode->cs_sendProcessing);
+                int64_t nSendStart = GetTimeMicros();
                 GetNodeSignals().SendMessages(pnode, *this, flagInterruptMsgProc);
+                pnode->RecordSendMessagesTime(GetTimeMicros() - nSendStart);
             }
             if (flagInterruptMsgProc)
                 return;
@@ -2008,9 +2750,9 @@ void CConnman::ThreadMessageHandler()
 
         std::unique_lock<std::mutex> lock(mutexMsgProc);
         if (!fMoreWork) {
-            condMsgProc.wait_until(lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(100), [this] { return fMsgProcWake; });
+            condMsgProc.wait_until(lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(100), [this, nThread] { return vMsgProcWake[nThread]; });
         }
-        fMsgProcWake = false;
+        vMsgProcWake[nThread] = false;
     }
 }
 
@@ -2196,13 +2938,23 @@ CConnman::CConnman(uint64_t nSeed0In, uint64_t nSeed1In) : nSeed0(nSeed0In), nSe
     setBannedIsDirty = false;
     fAddressesInitialized = false;
     nLastNodeId = 0;
+    nAddrManChangeCountDumped = 0;
     nSendBufferMaxSize = 0;
     nReceiveFloodSize = 0;
+    nMaxPeerMemory = 0;
+    nMaxHistoricalUploadRate = 0;
+    fUploadsScheduled = false;
     semOutbound = NULL;
     semAddnode = NULL;
     nMaxConnections = 0;
     nMaxOutbound = 0;
     nMaxAddnode = 0;
+    nPrevNodeCount = 0;
+    nMessageHandlerThreads = DEFAULT_MESSAGE_HANDLER_THREADS;
+#ifdef USE_EPOLL
+    epollfd = -1;
+    wakeupPipe[0] = wakeupPipe[1] = -1;
+#endif
     nBestHeight = 0;
     clientInterface = NULL;
     flagInterruptMsgProc = false;
@@ -2229,10 +2981,15 @@ bool CConnman::Start(CScheduler& scheduler, std::string& strNodeError, Options c
 
     nSendBufferMaxSize = connOptions.nSendBufferMaxSize;
     nReceiveFloodSize = connOptions.nReceiveFloodSize;
+    nMaxPeerMemory = connOptions.nMaxPeerMemory;
+    uploadScheduler.SetRate(connOptions.nMaxUploadRate);
+    nMaxHistoricalUploadRate = connOptions.nMaxHistoricalUploadRate;
 
     nMaxOutboundLimit = connOptions.nMaxOutboundLimit;
     nMaxOutboundTimeframe = connOptions.nMaxOutboundTimeframe;
 
+    nMessageHandlerThreads = std::max(1, std::min(connOptions.nMessageHandlerThreads, MAX_MESSAGE_HANDLER_THREADS));
+
     SetBestHeight(connOptions.nBestHeight);
 
     clientInterface = connOptions.uiInterface;
@@ -2242,9 +2999,10 @@ bool CConnman::Start(CScheduler& scheduler, std::string& strNodeError, Options c
     int64_t nStart = GetTimeMillis();
     {
         CAddrDB adb;
-        if (adb.Read(addrman))
+        if (adb.Read(addrman)) {
+            nAddrManChangeCountDumped = addrman.GetChangeCount();
             LogPrintf("Loaded %i addresses from peers.dat  %dms\n", addrman.size(), GetTimeMillis() - nStart);
-        else {
+        } else {
             addrman.Clear(); // Addrman can be in an inconsistent state after failure, reset it
             LogPrintf("Invalid or missing peers.dat; recreating\n");
             DumpAddresses();
@@ -2291,9 +3049,14 @@ bool CConnman::Start(CScheduler& scheduler, std::string& strNodeError, Options c
 
     {
         std::unique_lock<std::mutex> lock(mutexMsgProc);
-        fMsgProcWake = false;
+        vMsgProcWake.assign(nMessageHandlerThreads, false);
     }
 
+#ifdef USE_EPOLL
+    if (!InitSocketEvents(strNodeError))
+        return false;
+#endif
+
     // Send and receive from sockets, accept connections
     threadSocketHandler = std::thread(&TraceThread<std::function<void()> >, "net", std::function<void()>(std::bind(&CConnman::ThreadSocketHandler, this)));
 
@@ -2310,7 +3073,13 @@ bool CConnman::Start(CScheduler& scheduler, std::string& strNodeError, Options c
         threadOpenConnections = std::thread(&TraceThread<std::function<void()> >, "opencon", std::function<void()>(std::bind(&CConnman::ThreadOpenConnections, this)));
 
     // Process messages
-    threadMessageHandler = std::thread(&TraceThread<std::function<void()> >, "msghand", std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this)));
+    static const char* const pszMsgHandNames[MAX_MESSAGE_HANDLER_THREADS] = {
+        "msghand.0", "msghand.1", "msghand.2", "msghand.3", "msghand.4", "msghand.5", "msghand.6", "msghand.7",
+        "msghand.8", "msghand.9", "msghand.10", "msghand.11", "msghand.12", "msghand.13", "msghand.14", "msghand.15"};
+    for (int i = 0; i < nMessageHandlerThreads; i++) {
+        const char* pszThreadName = nMessageHandlerThreads == 1 ? "msghand" : pszMsgHandNames[i];
+        threadMessageHandlers.push_back(std::thread(&TraceThread<std::function<void()> >, pszThreadName, std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this, i))));
+    }
 
     // Dump network addresses
     scheduler.scheduleEvery(boost::bind(&CConnman::DumpData, this), DUMP_ADDRESSES_INTERVAL);
@@ -2342,6 +3111,7 @@ void CConnman::Interrupt()
     condMsgProc.notify_all();
 
     interruptNet();
+    WakeSocketHandler(NULL);
     InterruptSocks5(true);
 
     if (semOutbound) {
@@ -2359,8 +3129,11 @@ void CConnman::Interrupt()
 
 void CConnman::Stop()
 {
-    if (threadMessageHandler.joinable())
-        threadMessageHandler.join();
+    BOOST_FOREACH(std::thread& threadMessageHandler, threadMessageHandlers) {
+        if (threadMessageHandler.joinable())
+            threadMessageHandler.join();
+    }
+    threadMessageHandlers.clear();
     if (threadOpenConnections.joinable())
         threadOpenConnections.join();
     if (threadOpenAddedConnections.joinable())
@@ -2394,6 +3167,19 @@ void CConnman::Stop()
     vNodes.clear();
     vNodesDisconnected.clear();
     vhListenSocket.clear();
+#ifdef USE_EPOLL
+    if (epollfd != -1)
+        close(epollfd);
+    epollfd = -1;
+    for (int i = 0; i < 2; i++) {
+        if (wakeupPipe[i] != -1)
+            close(wakeupPipe[i]);
+        wakeupPipe[i] = -1;
+    }
+    vSocketEventsPending.clear();
+    mapSocketNodes.clear();
+    setPausedNodes.clear();
+#endif
     delete semOutbound;
     semOutbound = NULL;
     delete semAddnode;
@@ -2407,6 +3193,24 @@ void CConnman::DeleteNode(CNode* pnode)
     GetNodeSignals().FinalizeNode(pnode->GetId(), fUpdateConnectionTime);
     if(fUpdateConnectionTime)
         addrman.Connected(pnode->addr);
+    {
+        LOCK(pnode->cs_msgStats);
+        const CNetMsgStats& stats = pnode->msgStats;
+        if (LogAcceptCategory("netstats")) {
+            uint64_t nMsgsRecv = 0, nMsgsSent = 0;
+            int64_t nProcessTime = 0;
+            BOOST_FOREACH(const mapMsgCmdStats::value_type& item, stats.mapCmdStats) {
+                nMsgsRecv += item.second.nMsgsRecv;
+                nMsgsSent += item.second.nMsgsSent;
+                nProcessTime += item.second.nProcessTime;
+            }
+            LogPrintf("peer=%d message stats: %u received, %u sent, %.3fs processing, %.3fs in SendMessages, max queue wait %.3fs, max send queue %u bytes\n",
+                pnode->GetId(), nMsgsRecv, nMsgsSent, nProcessTime * 0.000001, stats.histSendMessagesTime.nSum * 0.000001,
+                stats.histQueueWait.nMax * 0.000001, stats.histSendQueueBytes.nMax);
+        }
+        LOCK(cs_msgStatsDisconnected);
+        msgStatsDisconnected.Merge(stats);
+    }
     delete pnode;
 }
 
@@ -2496,6 +3300,19 @@ void CConnman::GetNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+void CConnman::GetMsgStatsTotals(CNetMsgStats& stats)
+{
+    {
+        LOCK(cs_msgStatsDisconnected);
+        stats = msgStatsDisconnected;
+    }
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes) {
+        LOCK(pnode->cs_msgStats);
+        stats.Merge(pnode->msgStats);
+    }
+}
+
 bool CConnman::DisconnectNode(const std::string& strNode)
 {
     LOCK(cs_vNodes);
@@ -2659,6 +3476,8 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     nServices = NODE_NONE;
     nServicesExpected = NODE_NONE;
     hSocket = hSocketIn;
+    hSocketEvents = INVALID_SOCKET;
+    nSocketEvents = 0;
     nRecvVersion = INIT_PROTO_VERSION;
     nLastSend = 0;
     nLastRecv = 0;
@@ -2678,6 +3497,7 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    nSendAllowance = std::numeric_limits<size_t>::max();
     hashContinue = uint256();
     nStartingHeight = -1;
     filterInventoryKnown.reset();
@@ -2702,6 +3522,9 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     nextSendTimeFeeFilter = 0;
     fPauseRecv = false;
     fPauseSend = false;
+    nMemoryUsage = 0;
+    nOrphanMemoryUsage = 0;
+    nRelayMemoryUsage = 0;
     nProcessQueueSize = 0;
 
     BOOST_FOREACH(const std::string &msg, getAllNetMessageTypes())
@@ -2761,41 +3584,65 @@ bool CConnman::NodeFullyConnected(const CNode* pnode)
     return pnode && pnode->fSuccessfullyConnected && !pnode->fDisconnect;
 }
 
-void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
+void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg, int nPriority)
 {
-    size_t nMessageSize = msg.data.size();
+    if (nPriority < 0 || nPriority >= SEND_PRIORITY_COUNT)
+        nPriority = GetSendPriority(msg.command);
+    size_t nMessageSize = msg.payload ? msg.payload->data.size() : msg.data.size();
     size_t nTotalSize = nMessageSize + CMessageHeader::HEADER_SIZE;
     LogPrint("net", "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), nMessageSize, pnode->id);
 
     std::vector<unsigned char> serializedHeader;
     serializedHeader.reserve(CMessageHeader::HEADER_SIZE);
-    uint256 hash = Hash(msg.data.data(), msg.data.data() + nMessageSize);
+    // Shared payloads carry their checksum, so it's computed once for all peers
+    uint256 hash = msg.payload ? msg.payload->hash : Hash(msg.data.data(), msg.data.data() + nMessageSize);
     CMessageHeader hdr(Params().MessageStart(), msg.command.c_str(), nMessageSize);
     memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
 
     CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, serializedHeader, 0, hdr};
 
     size_t nBytesSent = 0;
+    size_t vSentByPriority[SEND_PRIORITY_COUNT] = {};
+    bool fWakeSocketHandler = false;
     {
         LOCK(pnode->cs_vSend);
         bool optimisticSend(pnode->vSendMsg.empty());
 
         //log total amount of bytes per command
         pnode->mapSendBytesPerMsgCmd[msg.command] += nTotalSize;
+        {
+            LOCK(pnode->cs_msgStats);
+            CNetMsgCmdStats& cmdStats = pnode->msgStats.mapCmdStats[msg.command];
+            cmdStats.nMsgsSent++;
+            cmdStats.nBytesSent += nTotalSize;
+            pnode->msgStats.histSendQueueBytes.Add(pnode->nSendSize);
+        }
         pnode->nSendSize += nTotalSize;
 
         if (pnode->nSendSize > nSendBufferMaxSize)
             pnode->fPauseSend = true;
-        pnode->vSendMsg.push_back(std::move(serializedHeader));
-        if (nMessageSize)
-            pnode->vSendMsg.push_back(std::move(msg.data));
+        pnode->vSendMsg.emplace_back(std::move(serializedHeader), nPriority);
+        if (nMessageSize) {
+            if (msg.payload)
+                pnode->vSendMsg.emplace_back(std::move(msg.payload), nPriority);
+            else
+                pnode->vSendMsg.emplace_back(std::move(msg.data), nPriority);
+        }
 
-        // If write queue empty, attempt "optimistic write"
-        if (optimisticSend == true)
-            nBytesSent = SocketSendData(pnode);
+        // If write queue empty, attempt "optimistic write", unless this
+        // class has to wait for the upload scheduler's next round
+        if (optimisticSend == true && uploadScheduler.AllowsImmediateSend(nPriority)) {
+            nBytesSent = SocketSendData(pnode, std::numeric_limits<size_t>::max(), vSentByPriority);
+        }
+        // and have the socket handler wait for the rest to be sendable
+        fWakeSocketHandler = optimisticSend && !pnode->vSendMsg.empty();
     }
-    if (nBytesSent)
+    if (nBytesSent) {
         RecordBytesSent(nBytesSent);
+        uploadScheduler.Consume(vSentByPriority);
+    }
+    if (fWakeSocketHandler)
+        WakeSocketHandler(pnode);
 }
 
 bool CConnman::ForNode(NodeId id, std::function<bool(CNode* pnode)> func)
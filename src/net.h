@@ -8,6 +8,7 @@
 
 #include "addrdb.h"
 #include "addrman.h"
+#include "banindex.h"
 #include "amount.h"
 #include "bloom.h"
 #include "compat.h"
@@ -27,6 +28,7 @@
 #include <thread>
 #include <memory>
 #include <condition_variable>
+#include <unordered_map>
 
 #ifndef WIN32
 #include <arpa/inet.h>
@@ -56,6 +58,10 @@ static const unsigned int MAX_INV_SZ = 50000;
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
 /** Maximum length of incoming protocol messages (no message over 4 MB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 4 * 1000 * 1000;
+/** Longest the socket handler waits for socket events before polling send queues and timeouts again (in milliseconds). */
+static const int SOCKET_HANDLER_INTERVAL = 50;
+/** Maximum number of queued send buffers handed to the kernel in a single send call. */
+static const int MAX_SEND_IOV = 64;
 /** Maximum length of strSubVer in `version` message */
 static const unsigned int MAX_SUBVERSION_LENGTH = 256;
 /** Maximum number of automatic outgoing nodes */
@@ -80,12 +86,24 @@ static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
 static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
 /** The default timeframe for -maxuploadtarget. 1 day. */
 static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
+/** The default for -maxuploadrate, in KB per second. 0 = Unlimited */
+static const uint64_t DEFAULT_MAX_UPLOAD_RATE = 0;
+/** The default for -maxhistoricaluploadrate, in KB per second. 0 = Unlimited */
+static const uint64_t DEFAULT_MAX_HISTORICAL_UPLOAD_RATE = 0;
 /** Default for blocks only*/
 static const bool DEFAULT_BLOCKSONLY = false;
 
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
+/** Default number of message handler threads, each serving its own share of the peers */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 1;
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
+/** Default for -maxpeermemory, the memory (in MB) all peers' buffers and relay state may use together. 0 = unlimited */
+static const unsigned int DEFAULT_MAX_PEER_MEMORY = 1000;
+/** Time between tallies of the memory used by each peer (in milliseconds) */
+static const int PEER_MEMORY_CHECK_INTERVAL = 1000;
 
 static const ServiceFlags REQUIRED_SERVICES = NODE_NETWORK;
 
@@ -102,10 +120,76 @@ struct AddedNodeInfo
     bool fInbound;
 };
 
+/** Upload priority classes, most urgent first */
+enum SendPriority
+{
+    SEND_PRIORITY_BLOCK = 0,    //!< New blocks, compact blocks and block transactions
+    SEND_PRIORITY_HEADERS,      //!< Headers and all other control messages
+    SEND_PRIORITY_TX,           //!< Transactions
+    SEND_PRIORITY_HISTORICAL,   //!< Old blocks served to syncing peers
+    SEND_PRIORITY_COUNT
+};
+
+/** The priority class a message is sent in, unless it was given one explicitly */
+int GetSendPriority(const std::string& command);
+
+/**
+ * Token buckets pacing upload bandwidth: one node-wide, plus optional ones
+ * per priority class. Each socket handler round shares the available tokens
+ * out to peers' send queues, the most urgent class first and fairly between
+ * peers within a class; bytes actually sent are taken out afterwards.
+ */
+class CUploadScheduler
+{
+public:
+    CUploadScheduler();
+
+    //! Set the node-wide rate in bytes per second (0 = unlimited)
+    void SetRate(uint64_t nBytesPerSecond);
+    //! Limit one priority class to a rate in bytes per second (which may be 0), on top of the node-wide rate
+    void SetClassRate(int nPriority, bool fLimited, uint64_t nBytesPerSecond);
+    //! Whether any rate is set, i.e. whether sends need scheduling at all
+    bool IsLimited() const;
+    //! Whether messages of a class may go out as soon as they are queued rather than waiting for the next round
+    bool AllowsImmediateSend(int nPriority) const;
+
+    //! Add the tokens earned since the last refill, up to one second's worth
+    void Refill(int64_t nTimeMicros);
+    //! Share the available tokens out between demands, given as (priority, bytes) pairs
+    std::vector<size_t> Allocate(const std::vector<std::pair<int, size_t> >& vDemand) const;
+    //! Take bytes sent, given per priority class, out of the buckets. Urgent sends may run them into debt.
+    void Consume(const size_t* pnSentByPriority);
+
+private:
+    struct Bucket
+    {
+        bool fLimited;
+        uint64_t nRate;
+        int64_t nTokens;
+
+        Bucket() : fLimited(false), nRate(0), nTokens(0) {}
+        void SetRate(bool fLimitedIn, uint64_t nRateIn);
+    };
+
+    mutable CCriticalSection cs;
+    Bucket global;
+    Bucket vClass[SEND_PRIORITY_COUNT];
+    int64_t nLastRefill;
+};
+
 class CTransaction;
 class CNodeStats;
 class CClientUIInterface;
 
+/** An immutable serialized payload, with its checksum, that can be queued to many peers without copying */
+struct CSharedNetMsgPayload
+{
+    explicit CSharedNetMsgPayload(std::vector<unsigned char>&& dataIn) : data(std::move(dataIn)), hash(Hash(data.begin(), data.end())) {}
+
+    const std::vector<unsigned char> data;
+    const uint256 hash;
+};
+
 struct CSerializedNetMsg
 {
     CSerializedNetMsg() = default;
@@ -117,6 +201,72 @@ struct CSerializedNetMsg
 
     std::vector<unsigned char> data;
     std::string command;
+    // If set, sent instead of data
+    std::shared_ptr<const CSharedNetMsgPayload> payload;
+};
+
+/** A buffer queued for sending: either owned bytes or a payload shared with other peers */
+class CNetSendBuffer
+{
+public:
+    CNetSendBuffer(std::vector<unsigned char>&& vchIn, int nPriorityIn) : vch(std::move(vchIn)), nPriority(nPriorityIn) {}
+    CNetSendBuffer(std::shared_ptr<const CSharedNetMsgPayload> sharedIn, int nPriorityIn) : shared(std::move(sharedIn)), nPriority(nPriorityIn) {}
+
+    const unsigned char* data() const { return shared ? shared->data.data() : vch.data(); }
+    size_t size() const { return shared ? shared->data.size() : vch.size(); }
+    int priority() const { return nPriority; }
+    //! The payload shared with other peers, or NULL if this buffer owns its data
+    const CSharedNetMsgPayload* GetShared() const { return shared.get(); }
+
+private:
+    std::vector<unsigned char> vch;
+    std::shared_ptr<const CSharedNetMsgPayload> shared;
+    int nPriority;
+};
+
+
+/** Histogram with power-of-two buckets: bucket 0 counts zeros, bucket i counts values in [2^(i-1), 2^i) */
+class CNetHistogram
+{
+public:
+    static const int NUM_BUCKETS = 32;
+
+    uint64_t nCount;
+    uint64_t nSum;
+    uint64_t nMax;
+    uint64_t vBuckets[NUM_BUCKETS];
+
+    CNetHistogram() { SetNull(); }
+    void SetNull();
+
+    void Add(uint64_t nValue);
+    void Merge(const CNetHistogram& other);
+    /** Upper bound (exclusive) of the values counted in a bucket */
+    static uint64_t BucketLimit(int nBucket) { return (uint64_t)1 << nBucket; }
+};
+
+/** Traffic and processing time of one message type */
+struct CNetMsgCmdStats
+{
+    uint64_t nMsgsSent = 0;
+    uint64_t nBytesSent = 0;
+    uint64_t nMsgsRecv = 0;
+    uint64_t nBytesRecv = 0;
+    uint64_t nMsgsProcessed = 0;
+    int64_t nProcessTime = 0;       // microseconds spent in ProcessMessage
+};
+typedef std::map<std::string, CNetMsgCmdStats> mapMsgCmdStats;
+
+/** Per message type counters and timing histograms of a peer, or of many peers together */
+struct CNetMsgStats
+{
+    mapMsgCmdStats mapCmdStats;
+    CNetHistogram histQueueWait;        // microseconds a received message waited before being processed
+    CNetHistogram histProcessTime;      // microseconds spent in ProcessMessage
+    CNetHistogram histSendMessagesTime; // microseconds spent in SendMessages
+    CNetHistogram histSendQueueBytes;   // bytes already queued when a message is pushed
+
+    void Merge(const CNetMsgStats& other);
 };
 
 
@@ -145,6 +295,10 @@ public:
         unsigned int nReceiveFloodSize = 0;
         uint64_t nMaxOutboundTimeframe = 0;
         uint64_t nMaxOutboundLimit = 0;
+        int nMessageHandlerThreads = DEFAULT_MESSAGE_HANDLER_THREADS;
+        uint64_t nMaxPeerMemory = 0;
+        uint64_t nMaxUploadRate = 0;
+        uint64_t nMaxHistoricalUploadRate = 0;
     };
     CConnman(uint64_t seed0, uint64_t seed1);
     ~CConnman();
@@ -159,7 +313,8 @@ public:
 
     bool ForNode(NodeId id, std::function<bool(CNode* pnode)> func);
 
-    void PushMessage(CNode* pnode, CSerializedNetMsg&& msg);
+    /** Queue a message, in the given SendPriority class (-1: the one its command belongs to) */
+    void PushMessage(CNode* pnode, CSerializedNetMsg&& msg, int nPriority = -1);
 
     template<typename Callable>
     void ForEachNode(Callable&& func)
@@ -244,6 +399,8 @@ public:
 
     size_t GetNodeCount(NumConnections num);
     void GetNodeStats(std::vector<CNodeStats>& vstats);
+    /** Message statistics of all peers since startup, including those that disconnected */
+    void GetMsgStatsTotals(CNetMsgStats& stats);
     bool DisconnectNode(const std::string& node);
     bool DisconnectNode(NodeId id);
 
@@ -285,7 +442,10 @@ public:
 
     unsigned int GetReceiveFloodSize() const;
 
+    /** Wake all message handler threads */
     void WakeMessageHandler();
+    /** Wake the message handler thread serving pnode */
+    void WakeMessageHandler(const CNode* pnode);
 private:
     struct ListenSocket {
         SOCKET socket;
@@ -297,8 +457,22 @@ private:
     void ThreadOpenAddedConnections();
     void ProcessOneShot();
     void ThreadOpenConnections();
-    void ThreadMessageHandler();
+    void ThreadMessageHandler(int nThread);
+    int GetMessageHandlerThread(const CNode* pnode) const;
     void AcceptConnection(const ListenSocket& hListenSocket);
+    void DisconnectNodes();
+    void NotifyNumConnectionsChanged();
+    void InactivityCheck(CNode* pnode);
+    void ServiceNodeSocket(CNode* pnode, bool recvSet, bool sendSet, bool errorSet);
+    void SocketHandlerSelect();
+#ifdef USE_EPOLL
+    bool InitSocketEvents(std::string& strError);
+    void SocketHandlerEpoll();
+    void UpdateSocketEvents(CNode* pnode);
+    void UnregisterSocketEvents(CNode* pnode);
+#endif
+    /** Wake the socket handler, and have it update pnode's socket events (if given) */
+    void WakeSocketHandler(CNode* pnode);
     void ThreadSocketHandler();
     void ThreadDNSAddressSeed();
 
@@ -317,7 +491,8 @@ private:
 
     NodeId GetNewNodeId();
 
-    size_t SocketSendData(CNode *pnode) const;
+    //! Send up to nMaxBytes of pnode's queue, adding the bytes sent per priority class to pnSentByPriority
+    size_t SocketSendData(CNode *pnode, size_t nMaxBytes, size_t* pnSentByPriority) const;
     //!check is the banlist has unwritten changes
     bool BannedSetIsDirty();
     //!set the "dirty" flag for the banlist
@@ -328,6 +503,12 @@ private:
     void DumpData();
     void DumpBanlist();
 
+    //! Tally the memory used by each peer and disconnect the heaviest inbound ones while over nMaxPeerMemory
+    void CheckPeerMemory();
+
+    //! Refill the upload buckets and hand each peer its send allowance for this round
+    void ScheduleUploads();
+
     // Network stats
     void RecordBytesRecv(uint64_t bytes);
     void RecordBytesSent(uint64_t bytes);
@@ -340,6 +521,8 @@ private:
     CCriticalSection cs_totalBytesSent;
     uint64_t nTotalBytesRecv;
     uint64_t nTotalBytesSent;
+    CCriticalSection cs_msgStatsDisconnected;
+    CNetMsgStats msgStatsDisconnected;
 
     // outbound limit & stats
     uint64_t nMaxOutboundTotalBytesSentInCycle;
@@ -354,14 +537,20 @@ private:
 
     unsigned int nSendBufferMaxSize;
     unsigned int nReceiveFloodSize;
+    uint64_t nMaxPeerMemory;
+    uint64_t nMaxHistoricalUploadRate;
+    CUploadScheduler uploadScheduler;
+    bool fUploadsScheduled; // only used by the socket handler thread
 
     std::vector<ListenSocket> vhListenSocket;
     std::atomic<bool> fNetworkActive;
     banmap_t setBanned;
+    CBanIndex banIndex; // index of setBanned for address lookups, protected by cs_setBanned
     CCriticalSection cs_setBanned;
     bool setBannedIsDirty;
     bool fAddressesInitialized;
     CAddrMan addrman;
+    uint64_t nAddrManChangeCountDumped; // addrman change count as of the last peers.dat read or write
     std::deque<std::string> vOneShots;
     CCriticalSection cs_vOneShots;
     std::vector<std::string> vAddedNodes;
@@ -369,6 +558,7 @@ private:
     std::vector<CNode*> vNodes;
     std::list<CNode*> vNodesDisconnected;
     mutable CCriticalSection cs_vNodes;
+    unsigned int nPrevNodeCount;
     std::atomic<NodeId> nLastNodeId;
 
     /** Services this instance offers */
@@ -389,8 +579,10 @@ private:
     /** SipHasher seeds for deterministic randomness */
     const uint64_t nSeed0, nSeed1;
 
-    /** flag for waking the message processor. */
-    bool fMsgProcWake;
+    /** Number of message handler threads; peers are assigned to them by node id. */
+    int nMessageHandlerThreads;
+    /** flags for waking each message processor thread. */
+    std::vector<bool> vMsgProcWake;
 
     std::condition_variable condMsgProc;
     std::mutex mutexMsgProc;
@@ -398,11 +590,24 @@ private:
 
     CThreadInterrupt interruptNet;
 
+#ifdef USE_EPOLL
+    /** epoll instance holding the listening and node sockets */
+    int epollfd;
+    /** Pipe whose read end is in epollfd, written to to wake the socket handler */
+    int wakeupPipe[2];
+    /** Nodes that need their socket events registered or updated */
+    std::vector<CNode*> vSocketEventsPending;
+    std::mutex mutexSocketEvents;
+    /** Registered sockets and paused nodes; only used by the socket handler thread */
+    std::unordered_map<SOCKET, CNode*> mapSocketNodes;
+    std::set<CNode*> setPausedNodes;
+#endif
+
     std::thread threadDNSAddressSeed;
     std::thread threadSocketHandler;
     std::thread threadOpenAddedConnections;
     std::thread threadOpenConnections;
-    std::thread threadMessageHandler;
+    std::vector<std::thread> threadMessageHandlers;
 };
 extern std::unique_ptr<CConnman> g_connman;
 void Discover(boost::thread_group& threadGroup);
@@ -509,6 +714,8 @@ public:
     double dMinPing;
     std::string addrLocal;
     CAddress addr;
+    CNetMsgStats msgStats;
+    uint64_t nMemoryUsage;
 };
 
 
@@ -521,7 +728,7 @@ private:
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
+    char hdrbuf[CMessageHeader::HEADER_SIZE]; // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
@@ -530,8 +737,7 @@ public:
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
-        hdrbuf.resize(24);
+    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
@@ -549,7 +755,6 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
@@ -558,6 +763,30 @@ public:
 };
 
 
+/**
+ * Free receive buffers of a connection, kept in a few size classes so that
+ * the steady stream of small messages (inv, tx, ...) reuses memory instead
+ * of going to the allocator for every message. Large messages such as
+ * blocks are not pooled.
+ */
+class CNetRecvBufferPool
+{
+public:
+    static const int NUM_SIZE_CLASSES = 3;
+
+    /** Give stream an empty pooled buffer with room for nSize bytes, if nSize is poolable */
+    void Get(CDataStream& stream, size_t nSize);
+    /** Take back the buffer of a processed message */
+    void Put(CDataStream& stream);
+
+    size_t GetFreeCount() const;
+    size_t GetMemoryUsage() const;
+
+private:
+    mutable std::mutex mutex;
+    std::vector<CSerializeData> vFree[NUM_SIZE_CLASSES];
+};
+
 /** Information about a peer */
 class CNode
 {
@@ -569,19 +798,24 @@ public:
     SOCKET hSocket;
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
+    size_t nSendAllowance; // bytes the socket handler may send this round, set by CConnman::ScheduleUploads
     uint64_t nSendBytes;
-    std::deque<std::vector<unsigned char>> vSendMsg;
+    std::deque<CNetSendBuffer> vSendMsg;
     CCriticalSection cs_vSend;
     CCriticalSection cs_hSocket;
     CCriticalSection cs_vRecv;
 
     CCriticalSection cs_vProcessMsg;
     std::list<CNetMessage> vProcessMsg;
+    CNetRecvBufferPool recvBufferPool;
     size_t nProcessQueueSize;
 
     CCriticalSection cs_sendProcessing;
 
     std::deque<CInv> vRecvGetData;
+    // Orphans to retry now that a parent sent by this peer was accepted.
+    // Only used by the message handler thread, like vRecvGetData.
+    std::set<uint256> setOrphanWorkSet;
     uint64_t nRecvBytes;
     std::atomic<int> nRecvVersion;
 
@@ -620,24 +854,41 @@ public:
     const uint64_t nKeyedNetGroup;
     std::atomic_bool fPauseRecv;
     std::atomic_bool fPauseSend;
+    // Memory held by this peer as of the socket handler's last tally, and the
+    // parts of it held in orphan transactions and in its position in the
+    // transaction relay queue (kept up to date by net_processing)
+    std::atomic<size_t> nMemoryUsage;
+    std::atomic<size_t> nOrphanMemoryUsage;
+    std::atomic<size_t> nRelayMemoryUsage;
+    // Socket registered with the socket handler's epoll instance and the
+    // events it waits for. Only used by the socket handler thread.
+    SOCKET hSocketEvents;
+    uint32_t nSocketEvents;
 protected:
 
     mapMsgCmdSize mapSendBytesPerMsgCmd;
     mapMsgCmdSize mapRecvBytesPerMsgCmd;
+    CCriticalSection cs_msgStats;
+    CNetMsgStats msgStats;
 
 public:
     uint256 hashContinue;
     std::atomic<int> nStartingHeight;
 
     // flood relay
+    // vAddrToSend and addrKnown are protected by cs_addrSend, since other
+    // peers' message handler threads push relayed addresses to them
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
+    CCriticalSection cs_addrSend;
     bool fGetAddr;
     std::set<uint256> setKnown;
     int64_t nNextAddrSend;
     int64_t nNextLocalAddrSend;
 
     // inventory based relay
+    // Kept on the unblocked filter: the blocked one would cost every peer
+    // about 0.4 MB more at this size and false positive rate.
     CRollingBloomFilter filterInventoryKnown;
     // Set of transaction ids we still have to announce.
     // They are sorted by the mempool before relay, so the order is not important.
@@ -722,6 +973,10 @@ public:
 
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete);
 
+    /** Account a message that has been through ProcessMessage */
+    void RecordProcessedMessage(const std::string& strCommand, int64_t nQueueWait, int64_t nProcessTime);
+    void RecordSendMessagesTime(int64_t nTime);
+
     void SetRecvVersion(int nVersionIn)
     {
         nRecvVersion = nVersionIn;
@@ -752,11 +1007,13 @@ public:
 
     void AddAddressKnown(const CAddress& _addr)
     {
+        LOCK(cs_addrSend);
         addrKnown.insert(_addr.GetKey());
     }
 
     void PushAddress(const CAddress& _addr, FastRandomContext &insecure_rand)
     {
+        LOCK(cs_addrSend);
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
@@ -802,6 +1059,13 @@ public:
 
     void copyStats(CNodeStats &stats);
 
+    //! Memory held in this peer's message buffers, relay state, filters and
+    //! orphans. Payloads shared with other peers aren't counted, as
+    //! disconnecting this peer doesn't free them; they are added to
+    //! psetShared instead, if given. Only the socket handler thread may call
+    //! this, as it owns vRecvMsg.
+    size_t GetMemoryUsage(std::set<const CSharedNetMsgPayload*>* psetShared = NULL);
+
     ServiceFlags GetLocalServices() const
     {
         return nLocalServices;
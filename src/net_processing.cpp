@@ -10,6 +10,7 @@
 #include "blockencodings.h"
 #include "chainparams.h"
 #include "consensus/validation.h"
+#include "core_memusage.h"
 #include "hash.h"
 #include "init.h"
 #include "validation.h"
@@ -30,6 +31,9 @@
 #include "utilstrencodings.h"
 #include "validationinterface.h"
 
+#include <limits>
+#include <unordered_map>
+
 #include <boost/thread.hpp>
 
 #if defined(NDEBUG)
@@ -52,9 +56,22 @@ struct COrphanTx {
     CTransactionRef tx;
     NodeId fromPeer;
     int64_t nTimeExpire;
+    size_t nPeerPos;
 };
 std::map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);
-std::map<COutPoint, std::set<std::map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByPrev GUARDED_BY(cs_main);
+std::unordered_map<COutPoint, std::set<std::map<uint256, COrphanTx>::iterator, IteratorComparator>, SaltedOutpointHasher> mapOrphanTransactionsByPrev GUARDED_BY(cs_main);
+/** Orphans held on behalf of one peer. */
+struct COrphanPeer {
+    //! The peer's orphans, in no particular order. COrphanTx::nPeerPos is the index into this.
+    std::vector<std::map<uint256, COrphanTx>::iterator> vOrphans;
+    //! Total weight of the peer's orphans
+    size_t nWeight;
+    //! Memory held by the peer's orphans and their index entries
+    size_t nMemoryUsage;
+
+    COrphanPeer() : nWeight(0), nMemoryUsage(0) {}
+};
+std::map<NodeId, COrphanPeer> mapOrphanPeers GUARDED_BY(cs_main);
 void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
 static size_t vExtraTxnForCompactIt = 0;
@@ -94,9 +111,11 @@ namespace {
      * million to make it highly unlikely for users to have issues with this
      * filter.
      *
-     * Memory used: 1.3 MB
+     * Memory used: 2.3 MB (the cache-line-blocked filter takes about 1.8x the
+     * 1.3 MB of CRollingBloomFilter, in exchange for one hash and one cache
+     * miss per lookup)
      */
-    std::unique_ptr<CRollingBloomFilter> recentRejects;
+    std::unique_ptr<CBlockedRollingBloomFilter> recentRejects;
     uint256 hashRecentRejectsChainTip;
 
     /** Blocks that are in flight, and that are in the queue to be downloaded. Protected by cs_main. */
@@ -104,6 +123,7 @@ namespace {
         uint256 hash;
         const CBlockIndex* pindex;                               //!< Optional.
         bool fValidatedHeaders;                                  //!< Whether this block has validated headers at the time of request.
+        int64_t nTimeRequested;                                  //!< When we asked for it (in microseconds).
         std::unique_ptr<PartiallyDownloadedBlock> partialBlock;  //!< Optional, used for CMPCTBLOCK downloads
     };
     std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> > mapBlocksInFlight;
@@ -122,6 +142,9 @@ namespace {
     MapRelay mapRelay;
     /** Expiration-time ordered list of (expire time, relay map entry) pairs, protected by cs_main). */
     std::deque<std::pair<int64_t, MapRelay::iterator>> vRelayExpiration;
+
+    /** Transactions relayed to all peers, protected by cs_main. */
+    CTxRelayQueue txRelayQueue;
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -175,6 +198,8 @@ struct CNodeState {
     int64_t nDownloadingSince;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! Moving average of the time this peer takes per requested block (in microseconds), or 0 if not measured yet.
+    int64_t nAvgBlockDeliveryTime;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
@@ -211,6 +236,7 @@ struct CNodeState {
         nDownloadingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nAvgBlockDeliveryTime = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
         fPreferHeaderAndIDs = false;
@@ -269,6 +295,7 @@ void InitializeNode(CNode *pnode, CConnman& connman) {
     {
         LOCK(cs_main);
         mapNodeState.emplace_hint(mapNodeState.end(), std::piecewise_construct, std::forward_as_tuple(nodeid), std::forward_as_tuple(addr, std::move(addrName)));
+        txRelayQueue.AddPeer(nodeid);
     }
     if(!pnode->fInbound)
         PushNodeVersion(pnode, connman, GetTime());
@@ -295,6 +322,7 @@ void FinalizeNode(NodeId nodeid, bool& fUpdateConnectionTime) {
     assert(nPeersWithValidatedDownloads >= 0);
 
     mapNodeState.erase(nodeid);
+    txRelayQueue.RemovePeer(nodeid);
 
     if (mapNodeState.empty()) {
         // Do a consistency check after the last peer is removed.
@@ -307,10 +335,22 @@ void FinalizeNode(NodeId nodeid, bool& fUpdateConnectionTime) {
 // Requires cs_main.
 // Returns a bool indicating whether we requested this block.
 // Also used if a block was /not/ received and timed out or started with another peer
-bool MarkBlockAsReceived(const uint256& hash) {
+// nodeFrom is the peer that delivered the block, if it was delivered at all.
+bool MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1) {
     std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
+        if (itInFlight->second.first == nodeFrom && state->vBlocksInFlight.begin() == itInFlight->second.second) {
+            // Peers deliver blocks in the order we asked for them, so the time the
+            // first block on the queue took is what the peer needs per block.
+            int64_t nDeliveryTime = GetTimeMicros() - std::max(state->nDownloadingSince, itInFlight->second.second->nTimeRequested);
+            if (nDeliveryTime > 0) {
+                if (state->nAvgBlockDeliveryTime == 0)
+                    state->nAvgBlockDeliveryTime = nDeliveryTime;
+                else
+                    state->nAvgBlockDeliveryTime = (state->nAvgBlockDeliveryTime * 7 + nDeliveryTime) / 8;
+            }
+        }
         state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
         if (state->nBlocksInFlightValidHeaders == 0 && itInFlight->second.second->fValidatedHeaders) {
             // Last validated block on the queue was received.
@@ -347,7 +387,7 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     MarkBlockAsReceived(hash);
 
     std::list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(),
-            {hash, pindex, pindex != NULL, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : NULL)});
+            {hash, pindex, pindex != NULL, GetTimeMicros(), std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : NULL)});
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += it->fValidatedHeaders;
     if (state->nBlocksInFlight == 1) {
@@ -363,6 +403,35 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     return true;
 }
 
+/** How many blocks we keep in flight from a peer: enough to cover BLOCK_DOWNLOAD_QUEUE_TIME at its measured rate. */
+int GetMaxBlocksInFlight(const CNodeState* state) {
+    if (state->nAvgBlockDeliveryTime == 0)
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nBlocks = BLOCK_DOWNLOAD_QUEUE_TIME / state->nAvgBlockDeliveryTime;
+    return std::max<int64_t>(MIN_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER, nBlocks));
+}
+
+/**
+ * Whether to take over the block holding up the download window from the peer
+ * it's in flight from (the staller), rather than wait for the stall timeout:
+ * we must have seen both peers deliver, and the staller must have been on the
+ * block for longer than twice what we take per block, and be at least twice
+ * as slow as us.
+ * Requires cs_main.
+ */
+bool ShouldRefetchStalledBlock(const CNodeState* state, const uint256& hash, int64_t nNow) {
+    std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::const_iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end())
+        return false;
+    const CNodeState* stateStaller = State(itInFlight->second.first);
+    if (state->nAvgBlockDeliveryTime == 0 || stateStaller->nAvgBlockDeliveryTime == 0)
+        return false;
+    int64_t nWaitingSince = itInFlight->second.second->nTimeRequested;
+    if (stateStaller->vBlocksInFlight.begin() == itInFlight->second.second)
+        nWaitingSince = std::max(nWaitingSince, stateStaller->nDownloadingSince);
+    return nNow - nWaitingSince > 2 * state->nAvgBlockDeliveryTime && stateStaller->nAvgBlockDeliveryTime > 2 * state->nAvgBlockDeliveryTime;
+}
+
 /** Check whether the last unknown block a peer advertised is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid) {
     CNodeState *state = State(nodeid);
@@ -468,7 +537,7 @@ const CBlockIndex* LastCommonAncestor(const CBlockIndex* pa, const CBlockIndex*
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
  *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const Consensus::Params& consensusParams) {
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const CBlockIndex*& pindexStalled, const Consensus::Params& consensusParams) {
     if (count == 0)
         return;
 
@@ -504,6 +573,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
     int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    const CBlockIndex* pindexWaitingFor = NULL;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -539,6 +609,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
+                        pindexStalled = pindexWaitingFor;
                     }
                     return;
                 }
@@ -549,6 +620,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -603,6 +675,13 @@ void AddToCompactExtraTransactions(const CTransactionRef& tx)
     vExtraTxnForCompactIt = (vExtraTxnForCompactIt + 1) % max_extra_txn;
 }
 
+static size_t OrphanMemoryUsage(const CTransactionRef& tx)
+{
+    return memusage::DynamicUsage(tx) + RecursiveDynamicUsage(*tx) +
+           memusage::MallocUsage(sizeof(memusage::stl_tree_node<std::pair<const uint256, COrphanTx> >)) +
+           memusage::MallocUsage(sizeof(std::map<uint256, COrphanTx>::iterator)) * tx->vin.size();
+}
+
 bool AddOrphanTx(const CTransactionRef& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     const uint256& hash = tx->GetHash();
@@ -623,11 +702,16 @@ bool AddOrphanTx(const CTransactionRef& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRE
         return false;
     }
 
-    auto ret = mapOrphanTransactions.emplace(hash, COrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME});
+    auto ret = mapOrphanTransactions.emplace(hash, COrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME, 0});
     assert(ret.second);
     BOOST_FOREACH(const CTxIn& txin, tx->vin) {
         mapOrphanTransactionsByPrev[txin.prevout].insert(ret.first);
     }
+    COrphanPeer& peerOrphans = mapOrphanPeers[peer];
+    ret.first->second.nPeerPos = peerOrphans.vOrphans.size();
+    peerOrphans.vOrphans.push_back(ret.first);
+    peerOrphans.nWeight += sz;
+    peerOrphans.nMemoryUsage += OrphanMemoryUsage(tx);
 
     AddToCompactExtraTransactions(tx);
 
@@ -650,6 +734,21 @@ int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+
+    // Move the peer's last orphan into the slot this one leaves behind
+    auto itPeer = mapOrphanPeers.find(it->second.fromPeer);
+    assert(itPeer != mapOrphanPeers.end());
+    COrphanPeer& peerOrphans = itPeer->second;
+    size_t nPeerPos = it->second.nPeerPos;
+    assert(nPeerPos < peerOrphans.vOrphans.size() && peerOrphans.vOrphans[nPeerPos] == it);
+    peerOrphans.vOrphans[nPeerPos] = peerOrphans.vOrphans.back();
+    peerOrphans.vOrphans[nPeerPos]->second.nPeerPos = nPeerPos;
+    peerOrphans.vOrphans.pop_back();
+    peerOrphans.nWeight -= GetTransactionWeight(*it->second.tx);
+    peerOrphans.nMemoryUsage -= OrphanMemoryUsage(it->second.tx);
+    if (peerOrphans.vOrphans.empty())
+        mapOrphanPeers.erase(itPeer);
+
     mapOrphanTransactions.erase(it);
     return 1;
 }
@@ -657,14 +756,12 @@ int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 void EraseOrphansFor(NodeId peer)
 {
     int nErased = 0;
-    std::map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
+    auto itPeer = mapOrphanPeers.find(peer);
+    while (itPeer != mapOrphanPeers.end())
     {
-        std::map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
-        {
-            nErased += EraseOrphanTx(maybeErase->second.tx->GetHash());
-        }
+        // Erasing the peer's last orphan also erases its entry in mapOrphanPeers
+        nErased += EraseOrphanTx(itPeer->second.vOrphans.back()->first);
+        itPeer = mapOrphanPeers.find(peer);
     }
     if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer=%d\n", nErased, peer);
 }
@@ -695,17 +792,58 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRE
     }
     while (mapOrphanTransactions.size() > nMaxOrphans)
     {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        std::map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+        // Evict a random orphan of the peer whose orphans weigh the most, so
+        // a peer flooding us with orphans mostly pushes out its own:
+        auto itPeer = mapOrphanPeers.begin();
+        for (auto it = mapOrphanPeers.begin(); it != mapOrphanPeers.end(); ++it) {
+            if (it->second.nWeight > itPeer->second.nWeight)
+                itPeer = it;
+        }
+        const std::vector<std::map<uint256, COrphanTx>::iterator>& vOrphans = itPeer->second.vOrphans;
+        EraseOrphanTx(vOrphans[GetRand(vOrphans.size())]->first);
         ++nEvicted;
     }
     return nEvicted;
 }
 
+/**
+ * Try to accept a transaction that was rejected for paying too low a fee as a
+ * package together with an orphan that spends it, so the orphan's fee can pay
+ * for its parent. Only children that are complete once the parent is known
+ * are tried. Returns the orphan that made it in (and removes it from the
+ * orphan pool), or an empty reference if none did.
+ */
+CTransactionRef static AcceptOrphanPackage(const CTransactionRef& ptx) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    std::vector<CTransactionRef> vChildren;
+    for (unsigned int i = 0; i < ptx->vout.size(); i++) {
+        auto itByPrev = mapOrphanTransactionsByPrev.find(COutPoint(ptx->GetHash(), i));
+        if (itByPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi) {
+            if (std::find(vChildren.begin(), vChildren.end(), (*mi)->second.tx) == vChildren.end())
+                vChildren.push_back((*mi)->second.tx);
+        }
+    }
+
+    BOOST_FOREACH(const CTransactionRef& pchild, vChildren) {
+        std::vector<CTransactionRef> package;
+        package.push_back(ptx);
+        package.push_back(pchild);
+        // Use a dummy CValidationState for the same reason as orphan
+        // resolution does: the child's failure must not be blamed on whoever
+        // relayed the parent.
+        CValidationState stateDummy;
+        if (AcceptPackageToMemoryPool(mempool, stateDummy, package)) {
+            LogPrint("mempool", "   accepted orphan tx %s paying for parent %s\n",
+                pchild->GetHash().ToString(), ptx->GetHash().ToString());
+            EraseOrphanTx(pchild->GetHash());
+            return pchild;
+        }
+    }
+    return CTransactionRef();
+}
+
 // Requires cs_main.
 void Misbehaving(NodeId pnode, int howmuch)
 {
@@ -740,7 +878,7 @@ void Misbehaving(NodeId pnode, int howmuch)
 
 PeerLogicValidation::PeerLogicValidation(CConnman* connmanIn) : connman(connmanIn) {
     // Initialize global variables that cannot be constructed at startup.
-    recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
+    recentRejects.reset(new CBlockedRollingBloomFilter(120000, 0.000001));
 }
 
 void PeerLogicValidation::SyncTransaction(const CTransaction& tx, const CBlockIndex* pindex, int nPosInBlock) {
@@ -776,6 +914,163 @@ static std::shared_ptr<const CBlock> most_recent_block;
 static std::shared_ptr<const CBlockHeaderAndShortTxIDs> most_recent_compact_block;
 static uint256 most_recent_block_hash;
 
+// Blocks stored during initial block download, waiting for the validation
+// thread to connect them, so that the message handler can go on requesting
+// the next ones meanwhile. At most MAX_BLOCK_VALIDATION_QUEUE of them are
+// held in memory; beyond that the thread reads them back from disk.
+static boost::mutex cs_validation_queue;
+static boost::condition_variable cond_validation_queue;
+static std::deque<std::shared_ptr<const CBlock>> queue_validation_blocks;
+static bool validation_pending = false;
+static bool validation_thread_running = false;
+
+static bool IsBlockValidationThreadRunning()
+{
+    boost::unique_lock<boost::mutex> lock(cs_validation_queue);
+    return validation_thread_running;
+}
+
+static void QueueBlockValidation(const std::shared_ptr<const CBlock>& pblock)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs_validation_queue);
+        if (queue_validation_blocks.size() < MAX_BLOCK_VALIDATION_QUEUE)
+            queue_validation_blocks.push_back(pblock);
+        validation_pending = true;
+    }
+    cond_validation_queue.notify_one();
+}
+
+void ThreadBlockValidation()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs_validation_queue);
+        validation_thread_running = true;
+    }
+    try {
+        while (true) {
+            std::shared_ptr<const CBlock> pblock;
+            {
+                boost::unique_lock<boost::mutex> lock(cs_validation_queue);
+                while (!validation_pending)
+                    cond_validation_queue.wait(lock);
+                if (!queue_validation_blocks.empty()) {
+                    pblock = queue_validation_blocks.front();
+                    queue_validation_blocks.pop_front();
+                }
+                validation_pending = !queue_validation_blocks.empty();
+            }
+            boost::this_thread::interruption_point();
+
+            // Connects every block that is ready, not only this one; the
+            // block is only handed over to save reading it from disk.
+            CValidationState state;
+            if (!ActivateBestChain(state, Params(), pblock))
+                LogPrintf("%s: ActivateBestChain failed\n", __func__);
+        }
+    } catch (...) {
+        // Leave whatever is left to the message handler and the next startup
+        boost::unique_lock<boost::mutex> lock(cs_validation_queue);
+        validation_thread_running = false;
+        queue_validation_blocks.clear();
+        validation_pending = false;
+        throw;
+    }
+}
+
+// The last full block served through getdata, serialized with and without
+// witness data, so that a block requested by many peers is only read and
+// serialized once and its bytes are shared by all of their send queues.
+static CCriticalSection cs_served_block;
+static uint256 served_block_hash[2];
+static std::shared_ptr<const CSharedNetMsgPayload> served_block_payload[2];
+
+static std::shared_ptr<const CSharedNetMsgPayload> GetServedBlockPayload(const uint256& hash, bool fWitness)
+{
+    LOCK(cs_served_block);
+    if (served_block_hash[fWitness] == hash)
+        return served_block_payload[fWitness];
+    return nullptr;
+}
+
+static void SetServedBlockPayload(const uint256& hash, bool fWitness, const std::shared_ptr<const CSharedNetMsgPayload>& payload)
+{
+    LOCK(cs_served_block);
+    served_block_hash[fWitness] = hash;
+    served_block_payload[fWitness] = payload;
+}
+
+// The bloom filter elements of the last block served as a merkleblock. SPV
+// peers all ask for the same new block, so its scripts are parsed once and
+// matched against each peer's filter.
+static uint256 served_filtered_block_hash;
+static std::shared_ptr<const std::vector<CBloomFilterElements>> served_filtered_block_elements;
+
+static std::shared_ptr<const std::vector<CBloomFilterElements>> GetServedBlockFilterElements(const CBlock& block)
+{
+    const uint256 hash = block.GetHash();
+    {
+        LOCK(cs_served_block);
+        if (served_filtered_block_hash == hash)
+            return served_filtered_block_elements;
+    }
+    std::shared_ptr<const std::vector<CBloomFilterElements>> elements = std::make_shared<const std::vector<CBloomFilterElements>>(CMerkleBlock::ExtractFilterElements(block));
+    LOCK(cs_served_block);
+    served_filtered_block_hash = hash;
+    served_filtered_block_elements = elements;
+    return elements;
+}
+
+// Serialized headers messages for full MAX_HEADERS_RESULTS chunks of the
+// active chain, keyed by the height of their first header. Peers syncing
+// headers from scratch all ask for the same chunks, so each is built once.
+// An entry is only used while the active chain still has its last header at
+// that height; entries above a fork point are dropped on reorg.
+struct CachedHeadersChunk {
+    uint256 hashLast;
+    std::shared_ptr<const CSharedNetMsgPayload> payload;
+    int64_t nLastUsed;
+};
+static CCriticalSection cs_headers_cache;
+static std::map<int, CachedHeadersChunk> mapHeadersCache;
+
+static std::shared_ptr<const CSharedNetMsgPayload> GetCachedHeaders(int nHeight, const uint256& hashLast)
+{
+    LOCK(cs_headers_cache);
+    std::map<int, CachedHeadersChunk>::iterator it = mapHeadersCache.find(nHeight);
+    if (it == mapHeadersCache.end() || it->second.hashLast != hashLast)
+        return nullptr;
+    it->second.nLastUsed = GetTimeMicros();
+    return it->second.payload;
+}
+
+static void SetCachedHeaders(int nHeight, const uint256& hashLast, const std::shared_ptr<const CSharedNetMsgPayload>& payload)
+{
+    LOCK(cs_headers_cache);
+    if (mapHeadersCache.size() >= MAX_HEADERS_CACHE_CHUNKS && !mapHeadersCache.count(nHeight)) {
+        std::map<int, CachedHeadersChunk>::iterator itOldest = mapHeadersCache.begin();
+        for (std::map<int, CachedHeadersChunk>::iterator it = mapHeadersCache.begin(); it != mapHeadersCache.end(); it++) {
+            if (it->second.nLastUsed < itOldest->second.nLastUsed)
+                itOldest = it;
+        }
+        mapHeadersCache.erase(itOldest);
+    }
+    mapHeadersCache[nHeight] = {hashLast, payload, GetTimeMicros()};
+}
+
+static void InvalidateCachedHeaders(const CBlockIndex* pindexFork)
+{
+    LOCK(cs_headers_cache);
+    if (pindexFork == NULL) {
+        mapHeadersCache.clear();
+        return;
+    }
+    // Drop the chunks that reach beyond the fork point
+    std::map<int, CachedHeadersChunk>::iterator it = mapHeadersCache.lower_bound(pindexFork->nHeight - (int)MAX_HEADERS_RESULTS + 2);
+    while (it != mapHeadersCache.end())
+        mapHeadersCache.erase(it++);
+}
+
 void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& pblock) {
     std::shared_ptr<const CBlockHeaderAndShortTxIDs> pcmpctblock = std::make_shared<const CBlockHeaderAndShortTxIDs> (*pblock, true);
     const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
@@ -797,8 +1092,10 @@ void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std:
         most_recent_compact_block = pcmpctblock;
     }
 
-    connman->ForEachNode([this, &pcmpctblock, pindex, &msgMaker, fWitnessEnabled, &hashBlock](CNode* pnode) {
-        // TODO: Avoid the repeated-serialization here
+    // Serialized on first use and shared by every peer we announce to
+    std::shared_ptr<const CSharedNetMsgPayload> cmpctblockPayload;
+
+    connman->ForEachNode([this, &pcmpctblock, &cmpctblockPayload, pindex, &msgMaker, fWitnessEnabled, &hashBlock](CNode* pnode) {
         if (pnode->nVersion < INVALID_CB_NO_BAN_VERSION || pnode->fDisconnect)
             return;
         ProcessBlockAvailability(pnode->GetId());
@@ -810,7 +1107,9 @@ void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std:
 
             LogPrint("net", "%s sending header-and-ids %s to peer=%d\n", "PeerLogicValidation::NewPoWValidBlock",
                     hashBlock.ToString(), pnode->id);
-            connman->PushMessage(pnode, msgMaker.Make(NetMsgType::CMPCTBLOCK, *pcmpctblock));
+            if (!cmpctblockPayload)
+                cmpctblockPayload = msgMaker.MakeShared(0, *pcmpctblock);
+            connman->PushMessage(pnode, msgMaker.MakeFromShared(NetMsgType::CMPCTBLOCK, cmpctblockPayload));
             state.pindexBestHeaderSent = pindex;
         }
     });
@@ -820,6 +1119,8 @@ void PeerLogicValidation::UpdatedBlockTip(const CBlockIndex *pindexNew, const CB
     const int nNewHeight = pindexNew->nHeight;
     connman->SetBestHeight(nNewHeight);
 
+    InvalidateCachedHeaders(pindexFork);
+
     if (!fInitialDownload) {
         // Find the hashes of all blocks that weren't previously in the best chain.
         std::vector<uint256> vHashes;
@@ -919,13 +1220,137 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
-static void RelayTransaction(const CTransaction& tx, CConnman& connman)
-{
-    CInv inv(MSG_TX, tx.GetHash());
-    connman.ForEachNode([&inv](CNode* pnode)
+namespace {
+/** Heap element: an entry and its queue position, or NO_QUEUE_POS for entries from outside the queue. */
+typedef std::pair<const CTxRelayQueue::Entry*, uint64_t> TxRelayCandidate;
+const uint64_t NO_QUEUE_POS = std::numeric_limits<uint64_t>::max();
+
+/** As std::make_heap produces a max-heap, we want the entries with the
+ *  fewest ancestors/highest feerate to sort later. */
+struct CompareTxRelayCandidate {
+    bool operator()(const TxRelayCandidate& a, const TxRelayCandidate& b) const
     {
-        pnode->PushInventory(inv);
-    });
+        if (a.first->nCountWithAncestors != b.first->nCountWithAncestors) return a.first->nCountWithAncestors > b.first->nCountWithAncestors;
+        if (!(a.first->feeRate == b.first->feeRate)) return a.first->feeRate < b.first->feeRate;
+        return a.first->txid < b.first->txid;
+    }
+};
+} // anon namespace
+
+void CTxRelayQueue::Push(const Entry& entry)
+{
+    vQueue.push_back(entry);
+    if (vQueue.size() > nMaxSize) {
+        // Peers this far behind skip the oldest announcements
+        vQueue.pop_front();
+        nStart++;
+    }
+}
+
+void CTxRelayQueue::AddPeer(NodeId nodeid)
+{
+    Cursor& cursor = mapCursors[nodeid];
+    cursor.nPos = nStart + vQueue.size();
+    cursor.vOffered.clear();
+}
+
+void CTxRelayQueue::RemovePeer(NodeId nodeid)
+{
+    mapCursors.erase(nodeid);
+    Trim();
+}
+
+void CTxRelayQueue::SkipAll(NodeId nodeid)
+{
+    std::map<NodeId, Cursor>::iterator it = mapCursors.find(nodeid);
+    if (it == mapCursors.end())
+        return;
+    bool fOldest = it->second.nPos <= nStart;
+    it->second.nPos = nStart + vQueue.size();
+    it->second.vOffered.clear();
+    if (fOldest)
+        Trim();
+}
+
+void CTxRelayQueue::Announce(NodeId nodeid, const std::vector<Entry>& vExtra, unsigned int nMax, const std::function<bool(const uint256&)>& fAnnounce)
+{
+    std::map<NodeId, Cursor>::iterator it = mapCursors.find(nodeid);
+    if (it == mapCursors.end())
+        return;
+    Cursor& cursor = it->second;
+    if (cursor.nPos < nStart) {
+        // Entries dropped from a full queue are skipped
+        uint64_t nDropped = std::min<uint64_t>(nStart - cursor.nPos, cursor.vOffered.size());
+        cursor.vOffered.erase(cursor.vOffered.begin(), cursor.vOffered.begin() + nDropped);
+        cursor.nPos = nStart;
+    }
+    bool fOldest = cursor.nPos == nStart;
+
+    // A heap is used so that not all entries need sorting if only a few are being offered.
+    std::vector<TxRelayCandidate> vHeap;
+    vHeap.reserve(nStart + vQueue.size() - cursor.nPos + vExtra.size());
+    for (uint64_t nPos = cursor.nPos; nPos < nStart + vQueue.size(); nPos++) {
+        uint64_t nOffset = nPos - cursor.nPos;
+        if (nOffset >= cursor.vOffered.size() || !cursor.vOffered[nOffset])
+            vHeap.push_back(std::make_pair(&vQueue[nPos - nStart], nPos));
+    }
+    for (const Entry& entry : vExtra)
+        vHeap.push_back(std::make_pair(&entry, NO_QUEUE_POS));
+    CompareTxRelayCandidate compare;
+    std::make_heap(vHeap.begin(), vHeap.end(), compare);
+
+    unsigned int nAnnounced = 0;
+    while (!vHeap.empty() && nAnnounced < nMax) {
+        std::pop_heap(vHeap.begin(), vHeap.end(), compare);
+        const TxRelayCandidate candidate = vHeap.back();
+        vHeap.pop_back();
+        if (candidate.second != NO_QUEUE_POS) {
+            uint64_t nOffset = candidate.second - cursor.nPos;
+            if (nOffset >= cursor.vOffered.size())
+                cursor.vOffered.resize(nOffset + 1, false);
+            cursor.vOffered[nOffset] = true;
+        }
+        if (fAnnounce(candidate.first->txid))
+            nAnnounced++;
+    }
+
+    // Move the cursor past the entries offered so far
+    size_t nSkip = 0;
+    while (nSkip < cursor.vOffered.size() && cursor.vOffered[nSkip])
+        nSkip++;
+    cursor.vOffered.erase(cursor.vOffered.begin(), cursor.vOffered.begin() + nSkip);
+    cursor.nPos += nSkip;
+    if (fOldest && nSkip > 0)
+        Trim();
+}
+
+size_t CTxRelayQueue::GetPeerMemoryUsage(NodeId nodeid) const
+{
+    std::map<NodeId, Cursor>::const_iterator it = mapCursors.find(nodeid);
+    if (it == mapCursors.end() || it->second.vOffered.capacity() == 0)
+        return 0;
+    return memusage::MallocUsage((it->second.vOffered.capacity() + 7) / 8);
+}
+
+void CTxRelayQueue::Trim()
+{
+    uint64_t nNewStart = nStart + vQueue.size();
+    for (const auto& entry : mapCursors) {
+        nNewStart = std::min(nNewStart, entry.second.nPos);
+    }
+    while (nStart < nNewStart) {
+        vQueue.pop_front();
+        nStart++;
+    }
+}
+
+static void RelayTransaction(const CTransaction& tx) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    CTxRelayQueue::Entry entry;
+    entry.txid = tx.GetHash();
+    if (!mempool.GetDepthAndScore(entry.txid, entry.nCountWithAncestors, entry.feeRate))
+        return;
+    txRelayQueue.Push(entry);
 }
 
 static void RelayAddress(const CAddress& addr, bool fReachable, CConnman& connman)
@@ -969,7 +1394,6 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
     std::vector<CInv> vNotFound;
     const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
-    LOCK(cs_main);
 
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
@@ -985,76 +1409,141 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
 
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK || inv.type == MSG_WITNESS_BLOCK)
             {
+                // Decide whether and how to serve the block under cs_main, but
+                // read it from disk and serialize it without, so that serving
+                // blocks doesn't hold up validation or other peers.
                 bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                CDiskBlockPos blockPos;
+                bool fPeerWantsWitness = false;
+                bool fSendCmpctBlock = false;
+                int nSendPriority = -1;
+                uint256 hashContinueTip;
+                bool fActivateChain = false;
                 {
-                    if (mi->second->nChainTx && !mi->second->IsValid(BLOCK_VALID_SCRIPTS) &&
-                            mi->second->IsValid(BLOCK_VALID_TREE)) {
-                        // If we have the block and all of its parents, but have not yet validated it,
-                        // we might be in the middle of connecting it (ie in the unlock of cs_main
-                        // before ActivateBestChain but after AcceptBlock).
-                        // In this case, we need to run ActivateBestChain prior to checking the relay
-                        // conditions below.
-                        std::shared_ptr<const CBlock> a_recent_block;
-                        {
-                            LOCK(cs_most_recent_block);
-                            a_recent_block = most_recent_block;
-                        }
-                        CValidationState dummy;
-                        ActivateBestChain(dummy, Params(), a_recent_block);
-                    }
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        static const int nOneMonth = 30 * 24 * 60 * 60;
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a month older (both in time, and in
-                        // best equivalent proof of work) than the best header chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                            (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
-                            (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, consensusParams) < nOneMonth);
-                        if (!send) {
-                            LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
-                        }
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    // If we have the block and all of its parents, but have not yet validated it,
+                    // we might be in the middle of connecting it (ie in the unlock of cs_main
+                    // before ActivateBestChain but after AcceptBlock).
+                    fActivateChain = mi != mapBlockIndex.end() && mi->second->nChainTx &&
+                            !mi->second->IsValid(BLOCK_VALID_SCRIPTS) && mi->second->IsValid(BLOCK_VALID_TREE);
+                }
+                if (fActivateChain) {
+                    // In this case, we need to run ActivateBestChain prior to checking the relay
+                    // conditions below. It serializes its callers with a lock taken before cs_main,
+                    // so it must be called without cs_main held.
+                    std::shared_ptr<const CBlock> a_recent_block;
+                    {
+                        LOCK(cs_most_recent_block);
+                        a_recent_block = most_recent_block;
                     }
+                    CValidationState dummy;
+                    ActivateBestChain(dummy, Params(), a_recent_block);
                 }
-                // disconnect node in case we have reached the outbound limit for serving historical blocks
-                // never disconnect whitelisted nodes
-                static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
-                if (send && connman.OutboundTargetReached(true) && ( ((pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
                 {
-                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            static const int nOneMonth = 30 * 24 * 60 * 60;
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a month older (both in time, and in
+                            // best equivalent proof of work) than the best header chain we know about.
+                            send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
+                                (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, consensusParams) < nOneMonth);
+                            if (!send) {
+                                LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                            }
+                        }
+                    }
+                    // Historical blocks are sent at the lowest upload priority, paced to
+                    // fit the outbound limit; whitelisted nodes are never held back
+                    static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
+                    bool fHistorical = send && (pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek) && !pfrom->fWhitelisted;
+                    if (fHistorical)
+                        nSendPriority = SEND_PRIORITY_HISTORICAL;
+                    // disconnect node in case we have reached the outbound limit for serving historical blocks
+                    // never disconnect whitelisted nodes
+                    if (send && connman.OutboundTargetReached(true) && (fHistorical || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
+                    {
+                        LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
 
-                    //disconnect node
-                    pfrom->fDisconnect = true;
-                    send = false;
+                        //disconnect node
+                        pfrom->fDisconnect = true;
+                        send = false;
+                    }
+                    // Pruned nodes may have deleted the block, so check whether
+                    // it's available before trying to send.
+                    send = send && (mi->second->nStatus & BLOCK_HAVE_DATA);
+                    if (send)
+                    {
+                        blockPos = mi->second->GetBlockPos();
+                        fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
+                        fSendCmpctBlock = CanDirectFetch(consensusParams) && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                        if (inv.hash == pfrom->hashContinue)
+                            hashContinueTip = chainActive.Tip()->GetBlockHash();
+                    }
                 }
-                // Pruned nodes may have deleted the block, so check whether
-                // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+
+                if (send)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        connman.PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block));
-                    else if (inv.type == MSG_WITNESS_BLOCK)
-                        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, block));
+                    const bool fFullBlock = inv.type == MSG_BLOCK || inv.type == MSG_WITNESS_BLOCK;
+                    const bool fWitness = inv.type == MSG_WITNESS_BLOCK;
+                    std::shared_ptr<const CSharedNetMsgPayload> blockPayload;
+                    if (fFullBlock)
+                        blockPayload = GetServedBlockPayload(inv.hash, fWitness);
+
+                    // Send block from memory if it's the one we just got, else from disk
+                    std::shared_ptr<const CBlock> pblock;
+                    if (!blockPayload) {
+                        {
+                            LOCK(cs_most_recent_block);
+                            if (most_recent_block_hash == inv.hash)
+                                pblock = most_recent_block;
+                        }
+                        if (!pblock) {
+                            std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
+                            if (!ReadBlockFromDisk(*pblockRead, blockPos, consensusParams) || pblockRead->GetHash() != inv.hash) {
+                                // It may have been pruned since we looked
+                                LogPrintf("%s: cannot load block %s from disk, disconnect peer=%d\n", __func__, inv.hash.ToString(), pfrom->GetId());
+                                pfrom->fDisconnect = true;
+                                break;
+                            }
+                            pblock = pblockRead;
+                        }
+                    }
+                    if (fFullBlock)
+                    {
+                        if (!blockPayload) {
+                            blockPayload = msgMaker.MakeShared(fWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, *pblock);
+                            SetServedBlockPayload(inv.hash, fWitness, blockPayload);
+                        }
+                        connman.PushMessage(pfrom, msgMaker.MakeFromShared(NetMsgType::BLOCK, blockPayload), nSendPriority);
+                    }
                     else if (inv.type == MSG_FILTERED_BLOCK)
                     {
+                        const CBlock& block = *pblock;
                         bool sendMerkleBlock = false;
                         CMerkleBlock merkleBlock;
+                        bool fHaveFilter;
                         {
+                            LOCK(pfrom->cs_filter);
+                            fHaveFilter = pfrom->pfilter != nullptr;
+                        }
+                        if (fHaveFilter) {
+                            std::shared_ptr<const std::vector<CBloomFilterElements>> elements = GetServedBlockFilterElements(block);
                             LOCK(pfrom->cs_filter);
                             if (pfrom->pfilter) {
                                 sendMerkleBlock = true;
-                                merkleBlock = CMerkleBlock(block, *pfrom->pfilter);
+                                merkleBlock = CMerkleBlock(block, *pfrom->pfilter, *elements);
                             }
                         }
                         if (sendMerkleBlock) {
-                            connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::MERKLEBLOCK, merkleBlock));
+                            connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::MERKLEBLOCK, merkleBlock), nSendPriority);
                             // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
                             // This avoids hurting performance by pointlessly requiring a round-trip
                             // Note that there is currently no way for a node to request any single transactions we didn't send here -
@@ -1063,7 +1552,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                connman.PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *block.vtx[pair.first]));
+                                connman.PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *block.vtx[pair.first]), nSendPriority);
                         }
                         // else
                             // no response
@@ -1074,23 +1563,22 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                         // they won't have a useful mempool to match against a compact block,
                         // and we don't feel like constructing the object for them, so
                         // instead we respond with the full, non-compact block.
-                        bool fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
                         int nSendFlags = fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
-                        if (CanDirectFetch(consensusParams) && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
-                            CBlockHeaderAndShortTxIDs cmpctblock(block, fPeerWantsWitness);
+                        if (fSendCmpctBlock) {
+                            CBlockHeaderAndShortTxIDs cmpctblock(*pblock, fPeerWantsWitness);
                             connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
                         } else
-                            connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCK, block));
+                            connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCK, *pblock), nSendPriority);
                     }
 
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
+                    if (!hashContinueTip.IsNull())
                     {
                         // Bypass PushInventory, this must send even if redundant,
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         std::vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        vInv.push_back(CInv(MSG_BLOCK, hashContinueTip));
                         connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::INV, vInv));
                         pfrom->hashContinue.SetNull();
                     }
@@ -1098,6 +1586,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             }
             else if (inv.type == MSG_TX || inv.type == MSG_WITNESS_TX)
             {
+                LOCK(cs_main);
                 // Send stream from relay memory
                 bool push = false;
                 auto mi = mapRelay.find(inv.hash);
@@ -1166,6 +1655,77 @@ inline void static SendBlockTransactions(const CBlock& block, const BlockTransac
     connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCKTXN, resp));
 }
 
+/** Queue the orphans spending any of tx's outputs for another attempt. */
+void static AddOrphanChildrenToWorkSet(const CTransaction& tx, std::set<uint256>& setOrphanWorkSet) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        auto itByPrev = mapOrphanTransactionsByPrev.find(COutPoint(tx.GetHash(), i));
+        if (itByPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi) {
+            setOrphanWorkSet.insert((*mi)->first);
+        }
+    }
+}
+
+/**
+ * Retry orphans from a peer's work set until one of them is accepted to or
+ * rejected from the mempool. Only one real validation is done per call, so a
+ * burst of orphans is worked through between the messages of all peers
+ * instead of holding up the message handler thread.
+ */
+void static ProcessOrphanTx(CConnman& connman, std::set<uint256>& setOrphanWorkSet, std::list<CTransactionRef>& lRemovedTxn) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    bool fDone = false;
+    while (!fDone && !setOrphanWorkSet.empty()) {
+        const uint256 orphanHash = *setOrphanWorkSet.begin();
+        setOrphanWorkSet.erase(setOrphanWorkSet.begin());
+
+        auto itOrphan = mapOrphanTransactions.find(orphanHash);
+        if (itOrphan == mapOrphanTransactions.end())
+            continue;
+        const CTransactionRef porphanTx = itOrphan->second.tx;
+        const CTransaction& orphanTx = *porphanTx;
+        NodeId fromPeer = itOrphan->second.fromPeer;
+        bool fMissingInputs2 = false;
+        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+        // anyone relaying LegitTxX banned)
+        CValidationState stateDummy;
+
+        if (AcceptToMemoryPool(mempool, stateDummy, porphanTx, true, &fMissingInputs2, &lRemovedTxn)) {
+            LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+            RelayTransaction(orphanTx);
+            AddOrphanChildrenToWorkSet(orphanTx, setOrphanWorkSet);
+            EraseOrphanTx(orphanHash);
+            fDone = true;
+        }
+        else if (!fMissingInputs2)
+        {
+            int nDos = 0;
+            if (stateDummy.IsInvalid(nDos) && nDos > 0)
+            {
+                // Punish peer that gave us an invalid orphan tx
+                Misbehaving(fromPeer, nDos);
+                LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+            }
+            // Has inputs but not accepted to mempool
+            // Probably non-standard or insufficient fee/priority
+            LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+            EraseOrphanTx(orphanHash);
+            if (!orphanTx.HasWitness() && !stateDummy.CorruptionPossible()) {
+                // Do not use rejection cache for witness transactions or
+                // witness-stripped transactions, as they can have been malleated.
+                // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
+                assert(recentRejects);
+                recentRejects->insert(orphanHash);
+            }
+            fDone = true;
+        }
+        mempool.check(pcoinsTip);
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman& connman, const std::atomic<bool>& interruptMsgProc)
 {
     LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
@@ -1698,7 +2258,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             inv.type = State(pfrom->GetId())->fWantsCmpctWitness ? MSG_WITNESS_BLOCK : MSG_BLOCK;
             inv.hash = req.blockhash;
             pfrom->vRecvGetData.push_back(inv);
-            ProcessGetData(pfrom, chainparams.GetConsensus(), connman, interruptMsgProc);
+            // The message processing loop will go around again (without pausing) and we'll respond then (without cs_main)
             return true;
         }
 
@@ -1716,54 +2276,91 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
-        LOCK(cs_main);
-        if (IsInitialBlockDownload() && !pfrom->fWhitelisted) {
-            LogPrint("net", "Ignoring getheaders from peer=%d because node is in initial block download\n", pfrom->id);
-            return true;
-        }
-
-        CNodeState *nodestate = State(pfrom->GetId());
-        const CBlockIndex* pindex = NULL;
-        if (locator.IsNull())
-        {
-            // If locator is null, return the hashStop block
-            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
-            if (mi == mapBlockIndex.end())
-                return true;
-            pindex = (*mi).second;
-        }
-        else
-        {
-            // Find the last block the caller has in the main chain
-            pindex = FindForkInGlobalIndex(chainActive, locator);
-            if (pindex)
-                pindex = chainActive.Next(pindex);
-        }
-
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
         std::vector<CBlock> vHeaders;
-        int nLimit = MAX_HEADERS_RESULTS;
-        LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.IsNull() ? "end" : hashStop.ToString(), pfrom->id);
-        for (; pindex; pindex = chainActive.Next(pindex))
+        std::shared_ptr<const CSharedNetMsgPayload> headersPayload;
+        int nCacheHeight = -1;
+        uint256 hashCacheLast;
         {
-            vHeaders.push_back(pindex->GetBlockHeader());
-            if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
-                break;
-        }
-        // pindex can be NULL either if we sent chainActive.Tip() OR
-        // if our peer has chainActive.Tip() (and thus we are sending an empty
-        // headers message). In both cases it's safe to update
-        // pindexBestHeaderSent to be our tip.
-        //
-        // It is important that we simply reset the BestHeaderSent value here,
-        // and not max(BestHeaderSent, newHeaderSent). We might have announced
-        // the currently-being-connected tip using a compact block, which
-        // resulted in the peer sending a headers request, which we respond to
-        // without the new block. By resetting the BestHeaderSent, we ensure we
-        // will re-announce the new block via headers (or compact blocks again)
-        // in the SendMessages logic.
-        nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
-        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::HEADERS, vHeaders));
+            LOCK(cs_main);
+            if (IsInitialBlockDownload() && !pfrom->fWhitelisted) {
+                LogPrint("net", "Ignoring getheaders from peer=%d because node is in initial block download\n", pfrom->id);
+                return true;
+            }
+
+            CNodeState *nodestate = State(pfrom->GetId());
+            const CBlockIndex* pindex = NULL;
+            if (locator.IsNull())
+            {
+                // If locator is null, return the hashStop block
+                BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+                if (mi == mapBlockIndex.end())
+                    return true;
+                pindex = (*mi).second;
+            }
+            else
+            {
+                // Find the last block the caller has in the main chain
+                pindex = FindForkInGlobalIndex(chainActive, locator);
+                if (pindex)
+                    pindex = chainActive.Next(pindex);
+            }
+
+            LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.IsNull() ? "end" : hashStop.ToString(), pfrom->id);
+
+            // A full chunk starting on a chunk boundary of the active chain, that
+            // hashStop doesn't cut short, can be served from the cache.
+            if (!locator.IsNull() && pindex && (pindex->nHeight - 1) % MAX_HEADERS_RESULTS == 0 &&
+                    chainActive.Height() >= pindex->nHeight + (int)MAX_HEADERS_RESULTS - 1) {
+                const CBlockIndex* pindexLast = chainActive[pindex->nHeight + MAX_HEADERS_RESULTS - 1];
+                bool fStopInChunk = false;
+                if (!hashStop.IsNull()) {
+                    BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+                    fStopInChunk = mi != mapBlockIndex.end() && mi->second->nHeight >= pindex->nHeight &&
+                        mi->second->nHeight < pindexLast->nHeight && chainActive.Contains(mi->second);
+                }
+                if (!fStopInChunk) {
+                    nCacheHeight = pindex->nHeight;
+                    hashCacheLast = pindexLast->GetBlockHash();
+                    headersPayload = GetCachedHeaders(nCacheHeight, hashCacheLast);
+                    if (headersPayload)
+                        pindex = pindexLast;
+                }
+            }
+
+            if (!headersPayload) {
+                int nLimit = MAX_HEADERS_RESULTS;
+                for (; pindex; pindex = chainActive.Next(pindex))
+                {
+                    vHeaders.push_back(pindex->GetBlockHeader());
+                    if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
+                        break;
+                }
+            }
+            // pindex can be NULL either if we sent chainActive.Tip() OR
+            // if our peer has chainActive.Tip() (and thus we are sending an empty
+            // headers message). In both cases it's safe to update
+            // pindexBestHeaderSent to be our tip.
+            //
+            // It is important that we simply reset the BestHeaderSent value here,
+            // and not max(BestHeaderSent, newHeaderSent). We might have announced
+            // the currently-being-connected tip using a compact block, which
+            // resulted in the peer sending a headers request, which we respond to
+            // without the new block. By resetting the BestHeaderSent, we ensure we
+            // will re-announce the new block via headers (or compact blocks again)
+            // in the SendMessages logic.
+            nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
+        }
+
+        // Serialize and send without cs_main
+        if (!headersPayload && nCacheHeight >= 0) {
+            headersPayload = msgMaker.MakeShared(0, vHeaders);
+            SetCachedHeaders(nCacheHeight, hashCacheLast, headersPayload);
+        }
+        if (headersPayload)
+            connman.PushMessage(pfrom, msgMaker.MakeFromShared(NetMsgType::HEADERS, headersPayload));
+        else
+            connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::HEADERS, vHeaders));
     }
 
 
@@ -1777,8 +2374,6 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             return true;
         }
 
-        std::deque<COutPoint> vWorkQueue;
-        std::vector<uint256> vEraseQueue;
         CTransactionRef ptx;
         vRecv >> ptx;
         const CTransaction& tx = *ptx;
@@ -1796,11 +2391,24 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
 
         std::list<CTransactionRef> lRemovedTxn;
 
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, ptx, true, &fMissingInputs, &lRemovedTxn)) {
+        bool fAccepted = !AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, ptx, true, &fMissingInputs, &lRemovedTxn);
+        CTransactionRef pchildTx;
+        if (!fAccepted && !fMissingInputs && state.GetRejectCode() == REJECT_INSUFFICIENTFEE) {
+            // An orphan we are holding may pay enough for both of them
+            pchildTx = AcceptOrphanPackage(ptx);
+            if (pchildTx) {
+                fAccepted = true;
+                state = CValidationState();
+            }
+        }
+
+        if (fAccepted) {
             mempool.check(pcoinsTip);
-            RelayTransaction(tx, connman);
-            for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                vWorkQueue.emplace_back(inv.hash, i);
+            RelayTransaction(tx);
+            AddOrphanChildrenToWorkSet(tx, pfrom->setOrphanWorkSet);
+            if (pchildTx) {
+                RelayTransaction(*pchildTx);
+                AddOrphanChildrenToWorkSet(*pchildTx, pfrom->setOrphanWorkSet);
             }
 
             pfrom->nLastTXTime = GetTime();
@@ -1810,66 +2418,9 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 tx.GetHash().ToString(),
                 mempool.size(), mempool.DynamicMemoryUsage() / 1000);
 
-            // Recursively process any orphan transactions that depended on this one
-            std::set<NodeId> setMisbehaving;
-            while (!vWorkQueue.empty()) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
-                vWorkQueue.pop_front();
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (auto mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const CTransactionRef& porphanTx = (*mi)->second.tx;
-                    const CTransaction& orphanTx = *porphanTx;
-                    const uint256& orphanHash = orphanTx.GetHash();
-                    NodeId fromPeer = (*mi)->second.fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, porphanTx, true, &fMissingInputs2, &lRemovedTxn)) {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx, connman);
-                        for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
-                            vWorkQueue.emplace_back(orphanHash, i);
-                        }
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        if (!orphanTx.HasWitness() && !stateDummy.CorruptionPossible()) {
-                            // Do not use rejection cache for witness transactions or
-                            // witness-stripped transactions, as they can have been malleated.
-                            // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
-                            assert(recentRejects);
-                            recentRejects->insert(orphanHash);
-                        }
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            // Start on the orphan transactions that depended on this one;
+            // ProcessMessages works through the rest of them between messages
+            ProcessOrphanTx(connman, pfrom->setOrphanWorkSet, lRemovedTxn);
         }
         else if (fMissingInputs)
         {
@@ -1926,7 +2477,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 int nDoS = 0;
                 if (!state.IsInvalid(nDoS) || nDoS == 0) {
                     LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
-                    RelayTransaction(tx, connman);
+                    RelayTransaction(tx);
                 } else {
                     LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s)\n", tx.GetHash().ToString(), pfrom->id, FormatStateMessage(state));
                 }
@@ -2382,13 +2933,20 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             LOCK(cs_main);
             // Also always process if we requested the block explicitly, as we may
             // need it even though it is not a candidate for a new best tip.
-            forceProcessing |= MarkBlockAsReceived(hash);
+            forceProcessing |= MarkBlockAsReceived(hash, pfrom->GetId());
             // mapBlockSource is only used for sending reject messages and DoS scores,
             // so the race between here and cs_main in ProcessNewBlock is fine.
             mapBlockSource.emplace(hash, std::make_pair(pfrom->GetId(), true));
         }
         bool fNewBlock = false;
-        ProcessNewBlock(chainparams, pblock, forceProcessing, &fNewBlock);
+        if (IsInitialBlockDownload() && IsBlockValidationThreadRunning()) {
+            // Only store the block here, and leave connecting it to the
+            // validation thread, so that downloading goes on meanwhile
+            if (AcceptNewBlock(chainparams, pblock, forceProcessing, &fNewBlock))
+                QueueBlockValidation(pblock);
+        } else {
+            ProcessNewBlock(chainparams, pblock, forceProcessing, &fNewBlock);
+        }
         if (fNewBlock)
             pfrom->nLastBlockTime = GetTime();
     }
@@ -2414,7 +2972,10 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrSend);
+            pfrom->vAddrToSend.clear();
+        }
         std::vector<CAddress> vAddr = connman.GetAddresses();
         FastRandomContext insecure_rand;
         BOOST_FOREACH(const CAddress &addr, vAddr)
@@ -2652,12 +3213,24 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman, const std::atomic<bool>& i
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom, chainparams.GetConsensus(), connman, interruptMsgProc);
 
+    if (!pfrom->setOrphanWorkSet.empty()) {
+        std::list<CTransactionRef> lRemovedTxn;
+        LOCK(cs_main);
+        ProcessOrphanTx(connman, pfrom->setOrphanWorkSet, lRemovedTxn);
+        for (const CTransactionRef& removedTx : lRemovedTxn)
+            AddToCompactExtraTransactions(removedTx);
+    }
+
     if (pfrom->fDisconnect)
         return false;
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return true;
 
+    // and finishes this peer's orphans before its next transaction, while
+    // letting other peers' messages in between
+    if (!pfrom->setOrphanWorkSet.empty()) return true;
+
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->fPauseSend)
             return false;
@@ -2709,6 +3282,7 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman, const std::atomic<bool>& i
 
         // Process message
         bool fRet = false;
+        int64_t nProcessStart = GetTimeMicros();
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime, chainparams, connman, interruptMsgProc);
@@ -2746,6 +3320,15 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman, const std::atomic<bool>& i
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        int64_t nProcessTime = GetTimeMicros() - nProcessStart;
+        pfrom->RecordProcessedMessage(strCommand, nProcessStart - msg.nTime, nProcessTime);
+        if (nProcessTime >= SLOW_MESSAGE_PROCESS_TIME)
+            LogPrint("netstats", "%s: %s (%u bytes) from peer=%d took %.2fms after waiting %.2fms\n", __func__,
+                SanitizeString(strCommand), nMessageSize, pfrom->id, nProcessTime * 0.001, (nProcessStart - msg.nTime) * 0.001);
+
+        // Done with the payload; let the next message from this peer reuse its buffer
+        pfrom->recvBufferPool.Put(vRecv);
+
         if (!fRet) {
             LogPrintf("%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->id);
         }
@@ -2756,23 +3339,6 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman, const std::atomic<bool>& i
     return fMoreWork;
 }
 
-class CompareInvMempoolOrder
-{
-    CTxMemPool *mp;
-public:
-    CompareInvMempoolOrder(CTxMemPool *_mempool)
-    {
-        mp = _mempool;
-    }
-
-    bool operator()(std::set<uint256>::iterator a, std::set<uint256>::iterator b)
-    {
-        /* As std::make_heap produces a max-heap, we want the entries with the
-         * fewest ancestors/highest fee to sort later. */
-        return mp->CompareDepthAndScore(*b, *a);
-    }
-};
-
 bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interruptMsgProc)
 {
     const Consensus::Params& consensusParams = Params().GetConsensus();
@@ -2821,6 +3387,11 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
             return true;
         CNodeState &state = *State(pto->GetId());
 
+        // Let the connection manager see this peer's orphans and relay queue position in its memory tally
+        auto itOrphanPeer = mapOrphanPeers.find(pto->GetId());
+        pto->nOrphanMemoryUsage = itOrphanPeer == mapOrphanPeers.end() ? 0 : itOrphanPeer->second.nMemoryUsage;
+        pto->nRelayMemoryUsage = txRelayQueue.GetPeerMemoryUsage(pto->GetId());
+
         // Address refresh broadcast
         int64_t nNow = GetTimeMicros();
         if (!IsInitialBlockDownload() && pto->nNextLocalAddrSend < nNow) {
@@ -2833,6 +3404,7 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
         //
         if (pto->nNextAddrSend < nNow) {
             pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
+            LOCK(pto->cs_addrSend);
             std::vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
@@ -3059,7 +3631,10 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
             // Time to send but the peer has requested we not relay transactions.
             if (fSendTrickle) {
                 LOCK(pto->cs_filter);
-                if (!pto->fRelayTxes) pto->setInventoryTxToSend.clear();
+                if (!pto->fRelayTxes) {
+                    pto->setInventoryTxToSend.clear();
+                    txRelayQueue.SkipAll(pto->GetId());
+                }
             }
 
             // Respond to BIP35 mempool requests
@@ -3097,11 +3672,19 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
 
             // Determine transactions to relay
             if (fSendTrickle) {
-                // Produce a vector with all candidates for sending
-                std::vector<std::set<uint256>::iterator> vInvTx;
-                vInvTx.reserve(pto->setInventoryTxToSend.size());
-                for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); it++) {
-                    vInvTx.push_back(it);
+                // Transactions pushed to this peer alone (wallet and RPC rebroadcasts) are ranked
+                // here and stay in setInventoryTxToSend until they have been offered
+                std::vector<CTxRelayQueue::Entry> vExtraTx;
+                vExtraTx.reserve(pto->setInventoryTxToSend.size());
+                for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); ) {
+                    CTxRelayQueue::Entry entry;
+                    entry.txid = *it;
+                    if (!mempool.GetDepthAndScore(entry.txid, entry.nCountWithAncestors, entry.feeRate)) {
+                        it = pto->setInventoryTxToSend.erase(it);
+                        continue;
+                    }
+                    vExtraTx.push_back(entry);
+                    ++it;
                 }
                 CAmount filterrate = 0;
                 {
@@ -3109,37 +3692,27 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
                     filterrate = pto->minFeeFilter;
                 }
                 // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
-                // A heap is used so that not all items need sorting if only a few are being sent.
-                CompareInvMempoolOrder compareInvMempoolOrder(&mempool);
-                std::make_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
+                // Entries were ranked once in RelayTransaction, so ordering them needs no mempool lookups.
                 // No reason to drain out at many times the network's capacity,
                 // especially since we have many peers and some will draw much shorter delays.
-                unsigned int nRelayedTransactions = 0;
                 LOCK(pto->cs_filter);
-                while (!vInvTx.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
-                    // Fetch the top element from the heap
-                    std::pop_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
-                    std::set<uint256>::iterator it = vInvTx.back();
-                    vInvTx.pop_back();
-                    uint256 hash = *it;
-                    // Remove it from the to-be-sent set
-                    pto->setInventoryTxToSend.erase(it);
+                txRelayQueue.Announce(pto->GetId(), vExtraTx, INVENTORY_BROADCAST_MAX, [&](const uint256& hash) {
+                    pto->setInventoryTxToSend.erase(hash);
                     // Check if not in the filter already
                     if (pto->filterInventoryKnown.contains(hash)) {
-                        continue;
+                        return false;
                     }
                     // Not in the mempool anymore? don't bother sending it.
                     auto txinfo = mempool.info(hash);
                     if (!txinfo.tx) {
-                        continue;
+                        return false;
                     }
                     if (filterrate && txinfo.feeRate.GetFeePerK() < filterrate) {
-                        continue;
+                        return false;
                     }
-                    if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*txinfo.tx)) continue;
+                    if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*txinfo.tx)) return false;
                     // Send
                     vInv.push_back(CInv(MSG_TX, hash));
-                    nRelayedTransactions++;
                     {
                         // Expire old relay messages
                         while (!vRelayExpiration.empty() && vRelayExpiration.front().first < nNow)
@@ -3158,7 +3731,8 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
                         vInv.clear();
                     }
                     pto->filterInventoryKnown.insert(hash);
-                }
+                    return true;
+                });
             }
         }
         if (!vInv.empty())
@@ -3193,10 +3767,21 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
         // Message: getdata (blocks)
         //
         std::vector<CInv> vGetData;
-        if (!pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        int nMaxBlocksInFlight = GetMaxBlocksInFlight(&state);
+        if (!pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < nMaxBlocksInFlight) {
             std::vector<const CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller, consensusParams);
+            const CBlockIndex* pindexStalled = NULL;
+            FindNextBlocksToDownload(pto->GetId(), nMaxBlocksInFlight - state.nBlocksInFlight, vToDownload, staller, pindexStalled, consensusParams);
+            if (vToDownload.empty() && staller != -1 && pindexStalled && ShouldRefetchStalledBlock(&state, pindexStalled->GetBlockHash(), nNow)) {
+                // The window is held up by a block a much slower peer is still
+                // working on. Ask this peer for it instead, which also moves it
+                // out of the staller's queue.
+                LogPrint("net", "Refetching block %s (%d) stalled at peer=%d from peer=%d\n", pindexStalled->GetBlockHash().ToString(),
+                    pindexStalled->nHeight, staller, pto->id);
+                vToDownload.push_back(pindexStalled);
+                staller = -1;
+            }
             BOOST_FOREACH(const CBlockIndex *pindex, vToDownload) {
                 uint32_t nFetchFlags = GetFetchFlags(pto, pindex->pprev, consensusParams);
                 vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindex->GetBlockHash()));
@@ -3277,5 +3862,6 @@ public:
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        mapOrphanPeers.clear();
     }
 } instance_of_cnetprocessingcleanup;
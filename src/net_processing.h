@@ -6,9 +6,16 @@
 #ifndef BITCOIN_NET_PROCESSING_H
 #define BITCOIN_NET_PROCESSING_H
 
+#include "amount.h"
 #include "net.h"
+#include "uint256.h"
 #include "validationinterface.h"
 
+#include <deque>
+#include <functional>
+#include <map>
+#include <vector>
+
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
 /** Expiration time for orphan transactions in seconds */
@@ -17,6 +24,68 @@ static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
 static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
 /** Default number of orphan+recently-replaced txn to keep around for block reconstruction */
 static const unsigned int DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN = 100;
+/** Maximum number of relayed transactions queued for announcement to peers that have not caught up yet */
+static const unsigned int MAX_TX_RELAY_QUEUE_SIZE = 100000;
+/** Maximum number of serialized full headers messages kept for serving getheaders */
+static const unsigned int MAX_HEADERS_CACHE_CHUNKS = 64;
+/** Messages taking at least this long to process (in microseconds) are logged under -debug=netstats */
+static const int64_t SLOW_MESSAGE_PROCESS_TIME = 100 * 1000;
+
+/** Maximum number of blocks held in memory for the block validation thread */
+static const unsigned int MAX_BLOCK_VALIDATION_QUEUE = 16;
+
+/**
+ * Transactions relayed to all peers, ranked once when they are queued.
+ *
+ * Peers share the queue instead of keeping their own copy of every entry:
+ * each peer has a cursor to the oldest entry it has not been offered yet and
+ * one bit per later entry recording whether that one has been offered. Entries
+ * are dropped once every peer has moved past them, or when the queue grows
+ * beyond its limit, in which case peers that far behind skip them.
+ */
+class CTxRelayQueue
+{
+public:
+    struct Entry {
+        uint256 txid;
+        uint64_t nCountWithAncestors;
+        CFeeRate feeRate;
+    };
+
+    explicit CTxRelayQueue(size_t nMaxSizeIn = MAX_TX_RELAY_QUEUE_SIZE) : nMaxSize(nMaxSizeIn), nStart(0) {}
+
+    void Push(const Entry& entry);
+    /** Start tracking a peer. It is offered the entries pushed from now on. */
+    void AddPeer(NodeId nodeid);
+    void RemovePeer(NodeId nodeid);
+    /** Treat every entry queued so far as offered to the peer. */
+    void SkipAll(NodeId nodeid);
+    /**
+     * Offer the peer's pending entries, along with vExtra, to fAnnounce: fewest
+     * ancestors first, then highest feerate. Stops after fAnnounce has returned
+     * true nMax times. Queue entries are offered to each peer only once.
+     */
+    void Announce(NodeId nodeid, const std::vector<Entry>& vExtra, unsigned int nMax, const std::function<bool(const uint256&)>& fAnnounce);
+    /** Memory this peer's position in the queue takes, excluding the shared entries. */
+    size_t GetPeerMemoryUsage(NodeId nodeid) const;
+    size_t size() const { return vQueue.size(); }
+
+private:
+    struct Cursor {
+        //! Oldest queue position not offered to the peer yet
+        uint64_t nPos;
+        //! Whether the entry at position nPos + i has been offered
+        std::vector<bool> vOffered;
+    };
+
+    void Trim();
+
+    const size_t nMaxSize;
+    std::deque<Entry> vQueue;
+    //! Absolute position of vQueue.front()
+    uint64_t nStart;
+    std::map<NodeId, Cursor> mapCursors;
+};
 
 /** Register with a network node to receive its signals */
 void RegisterNodeSignals(CNodeSignals& nodeSignals);
@@ -60,4 +129,7 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman, const std::atomic<bool>& i
  */
 bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interrupt);
 
+/** Connect the blocks stored during initial block download, so that downloading and validating overlap */
+void ThreadBlockValidation();
+
 #endif // BITCOIN_NET_PROCESSING_H
@@ -115,6 +115,11 @@ class CSubNet
         std::string ToString() const;
         bool IsValid() const;
 
+        /** The network address, with the bits outside the netmask cleared */
+        const CNetAddr& GetNetwork() const { return network; }
+        /** Number of leading one bits of the netmask over the whole 128 bit address, or -1 if it is not a prefix */
+        int GetPrefixLength() const;
+
         friend bool operator==(const CSubNet& a, const CSubNet& b);
         friend bool operator!=(const CSubNet& a, const CSubNet& b);
         friend bool operator<(const CSubNet& a, const CSubNet& b);
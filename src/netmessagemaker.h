@@ -29,6 +29,23 @@ public:
         return Make(0, std::move(sCommand), std::forward<Args>(args)...);
     }
 
+    /** Serialize a payload once, to be sent to several peers with MakeFromShared */
+    template <typename... Args>
+    std::shared_ptr<const CSharedNetMsgPayload> MakeShared(int nFlags, Args&&... args) const
+    {
+        std::vector<unsigned char> data;
+        CVectorWriter{ SER_NETWORK, nFlags | nVersion, data, 0, std::forward<Args>(args)... };
+        return std::make_shared<const CSharedNetMsgPayload>(std::move(data));
+    }
+
+    CSerializedNetMsg MakeFromShared(std::string sCommand, std::shared_ptr<const CSharedNetMsgPayload> payload) const
+    {
+        CSerializedNetMsg msg;
+        msg.command = std::move(sCommand);
+        msg.payload = std::move(payload);
+        return msg;
+    }
+
 private:
     const int nVersion;
 };
@@ -57,9 +57,8 @@ void TxConfirmStats::Record(int blocksToConfirm, double val)
     if (blocksToConfirm < 1)
         return;
     unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    for (size_t i = blocksToConfirm; i <= curBlockConf.size(); i++) {
-        curBlockConf[i - 1][bucketindex]++;
-    }
+    if ((size_t)blocksToConfirm <= curBlockConf.size())
+        curBlockConf[blocksToConfirm - 1][bucketindex]++;
     curBlockTxCt[bucketindex]++;
     curBlockVal[bucketindex] += val;
 }
@@ -67,8 +66,13 @@ void TxConfirmStats::Record(int blocksToConfirm, double val)
 void TxConfirmStats::UpdateMovingAverages()
 {
     for (unsigned int j = 0; j < buckets.size(); j++) {
-        for (unsigned int i = 0; i < confAvg.size(); i++)
-            confAvg[i][j] = confAvg[i][j] * decay + curBlockConf[i][j];
+        // curBlockConf holds exact confirmation counts, a tx confirmed in
+        // Y blocks counts towards every target >= Y
+        int confirmedWithin = 0;
+        for (unsigned int i = 0; i < confAvg.size(); i++) {
+            confirmedWithin += curBlockConf[i][j];
+            confAvg[i][j] = confAvg[i][j] * decay + confirmedWithin;
+        }
         avg[j] = avg[j] * decay + curBlockVal[j];
         txCtAvg[j] = txCtAvg[j] * decay + curBlockTxCt[j];
     }
@@ -299,7 +303,7 @@ bool CBlockPolicyEstimator::removeTx(uint256 hash)
 }
 
 CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
-    : nBestSeenHeight(0), trackedTxs(0), untrackedTxs(0)
+    : nBestSeenHeight(0), trackedTxs(0), untrackedTxs(0), fEstimateCacheStale(false)
 {
     static_assert(MIN_FEERATE > 0, "Min feerate must be nonzero");
     minTrackedFee = _minRelayFee < CFeeRate(MIN_FEERATE) ? CFeeRate(MIN_FEERATE) : _minRelayFee;
@@ -309,6 +313,7 @@ CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
     }
     vfeelist.push_back(INF_FEERATE);
     feeStats.Initialize(vfeelist, MAX_BLOCK_CONFIRMS, DEFAULT_DECAY);
+    UpdateEstimateCache();
 }
 
 void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, bool validFeeEstimate)
@@ -378,6 +383,10 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
         // And if an attacker can re-org the chain at will, then
         // you've got much bigger problems than "attacker can influence
         // transaction fees."
+        // The block may still take tracked transactions out of the
+        // mempool once we return, so refresh the cached estimates on
+        // their next use.
+        fEstimateCacheStale = true;
         return;
     }
 
@@ -398,6 +407,7 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
 
     // Update all exponential averages with the current block state
     feeStats.UpdateMovingAverages();
+    UpdateEstimateCache();
 
     LogPrint("estimatefee", "Blockpolicy after updating estimates for %u of %u txs in block, since last block %u of %u tracked, new mempool map size %u\n",
              countedTxs, entries.size(), trackedTxs, trackedTxs + untrackedTxs, mapMemPoolTxs.size());
@@ -406,14 +416,40 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
     untrackedTxs = 0;
 }
 
+void CBlockPolicyEstimator::UpdateEstimateCache()
+{
+    unsigned int maxConfirms = feeStats.GetMaxConfirms();
+    estimateCache.assign(maxConfirms + 1, EstimateCacheEntry());
+    fEstimateCacheStale = false;
+
+    // Walk down from the longest target so each entry can pick up the
+    // nearest answer at or above it for estimateSmartFee.
+    double smartMedian = -1;
+    unsigned int smartTarget = maxConfirms;
+    // It's not possible to get reasonable estimates for confTarget of 1
+    for (unsigned int confTarget = maxConfirms; confTarget >= 2; confTarget--) {
+        EstimateCacheEntry& cacheEntry = estimateCache[confTarget];
+        cacheEntry.median = feeStats.EstimateMedianVal(confTarget, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+        if (cacheEntry.median >= 0) {
+            smartMedian = cacheEntry.median;
+            smartTarget = confTarget;
+        }
+        cacheEntry.smartMedian = smartMedian;
+        cacheEntry.smartTarget = smartTarget;
+    }
+}
+
 CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
 {
+    if (fEstimateCacheStale)
+        UpdateEstimateCache();
+
     // Return failure if trying to analyze a target we're not tracking
     // It's not possible to get reasonable estimates for confTarget of 1
-    if (confTarget <= 1 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
+    if (confTarget <= 1 || (unsigned int)confTarget >= estimateCache.size())
         return CFeeRate(0);
 
-    double median = feeStats.EstimateMedianVal(confTarget, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    double median = estimateCache[confTarget].median;
 
     if (median < 0)
         return CFeeRate(0);
@@ -423,33 +459,50 @@ CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
 
 CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool)
 {
+    std::vector<int> answerFoundAtTargets;
+    CFeeRate feeRate = estimateSmartFees(std::vector<int>(1, confTarget), answerFoundAtTargets, pool)[0];
     if (answerFoundAtTarget)
-        *answerFoundAtTarget = confTarget;
-    // Return failure if trying to analyze a target we're not tracking
-    if (confTarget <= 0 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
-        return CFeeRate(0);
-
-    // It's not possible to get reasonable estimates for confTarget of 1
-    if (confTarget == 1)
-        confTarget = 2;
+        *answerFoundAtTarget = answerFoundAtTargets[0];
+    return feeRate;
+}
 
-    double median = -1;
-    while (median < 0 && (unsigned int)confTarget <= feeStats.GetMaxConfirms()) {
-        median = feeStats.EstimateMedianVal(confTarget++, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
-    }
+std::vector<CFeeRate> CBlockPolicyEstimator::estimateSmartFees(const std::vector<int>& confTargets, std::vector<int>& answerFoundAtTargets, const CTxMemPool& pool)
+{
+    if (fEstimateCacheStale)
+        UpdateEstimateCache();
 
-    if (answerFoundAtTarget)
-        *answerFoundAtTarget = confTarget - 1;
+    std::vector<CFeeRate> feeRates;
+    feeRates.reserve(confTargets.size());
+    answerFoundAtTargets.clear();
+    answerFoundAtTargets.reserve(confTargets.size());
 
     // If mempool is limiting txs , return at least the min feerate from the mempool
     CAmount minPoolFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFeePerK();
-    if (minPoolFee > 0 && minPoolFee > median)
-        return CFeeRate(minPoolFee);
 
-    if (median < 0)
-        return CFeeRate(0);
+    for (int confTarget : confTargets) {
+        answerFoundAtTargets.push_back(confTarget);
+        // Return failure if trying to analyze a target we're not tracking
+        if (confTarget <= 0 || (unsigned int)confTarget >= estimateCache.size()) {
+            feeRates.push_back(CFeeRate(0));
+            continue;
+        }
 
-    return CFeeRate(median);
+        // It's not possible to get reasonable estimates for confTarget of 1
+        if (confTarget == 1)
+            confTarget = 2;
+
+        const EstimateCacheEntry& cacheEntry = estimateCache[confTarget];
+        double median = cacheEntry.smartMedian;
+        answerFoundAtTargets.back() = cacheEntry.smartTarget;
+
+        if (minPoolFee > 0 && minPoolFee > median)
+            feeRates.push_back(CFeeRate(minPoolFee));
+        else if (median < 0)
+            feeRates.push_back(CFeeRate(0));
+        else
+            feeRates.push_back(CFeeRate(median));
+    }
+    return feeRates;
 }
 
 double CBlockPolicyEstimator::estimatePriority(int confTarget)
@@ -486,6 +539,7 @@ void CBlockPolicyEstimator::Read(CAutoFile& filein, int nFileVersion)
         TxConfirmStats priStats;
         priStats.Read(filein);
     }
+    UpdateEstimateCache();
 }
 
 FeeFilterRounder::FeeFilterRounder(const CFeeRate& minIncrementalFee)
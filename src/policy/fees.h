@@ -84,7 +84,8 @@ private:
     // Count the total # of txs confirmed within Y blocks in each bucket
     // Track the historical moving average of theses totals over blocks
     std::vector<std::vector<double> > confAvg; // confAvg[Y][X]
-    // and calculate the totals for the current block to update the moving averages
+    // and count the txs confirmed in exactly Y blocks for the current block,
+    // which are accumulated into the moving averages once per block
     std::vector<std::vector<int> > curBlockConf; // curBlockConf[Y][X]
 
     // Sum the total feerate of all tx's in each bucket
@@ -120,6 +121,8 @@ public:
 
     /**
      * Record a new transaction data point in the current block stats
+     * Only the exact confirmation count is recorded here; the cumulative
+     * "confirmed within Y blocks" totals are formed in UpdateMovingAverages.
      * @param blocksToConfirm the number of blocks it took this transaction to confirm
      * @param val the feerate of the transaction
      * @warning blocksToConfirm is 1-based and has to be >= 1
@@ -223,6 +226,11 @@ public:
      */
     CFeeRate estimateSmartFee(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool);
 
+    /** Same as estimateSmartFee, for several confirmation targets at once.
+     *  The mempool minimum fee is only looked up once for the whole batch.
+     */
+    std::vector<CFeeRate> estimateSmartFees(const std::vector<int>& confTargets, std::vector<int>& answerFoundAtTargets, const CTxMemPool& pool);
+
     /** Return a priority estimate.
      *  DEPRECATED
      *  Returns -1
@@ -261,6 +269,29 @@ private:
 
     unsigned int trackedTxs;
     unsigned int untrackedTxs;
+
+    /** Precomputed answers for one confirmation target */
+    struct EstimateCacheEntry
+    {
+        double median;              //!< EstimateMedianVal at this target, -1 if none
+        double smartMedian;         //!< median at the lowest target >= this one that has an answer
+        unsigned int smartTarget;   //!< the target smartMedian was found at
+        EstimateCacheEntry() : median(-1), smartMedian(-1), smartTarget(0) {}
+    };
+    /** Estimates for every confirmation target, indexed by confTarget.
+     *  Rebuilt once per connected block (and after reading estimates from
+     *  disk) so that estimateFee/estimateSmartFee are constant-time lookups.
+     *  Unconfirmed transactions removed from the mempool between blocks are
+     *  only reflected at the next refresh, which can only make the cached
+     *  estimates slightly conservative.
+     */
+    std::vector<EstimateCacheEntry> estimateCache;
+
+    /** Set when estimateCache must be rebuilt before its next use */
+    bool fEstimateCacheStale;
+
+    /** Recompute estimateCache from the current stats */
+    void UpdateEstimateCache();
 };
 
 class FeeFilterRounder
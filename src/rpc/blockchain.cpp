@@ -15,6 +15,7 @@
 #include "rpc/server.h"
 #include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -349,10 +350,8 @@ std::string EntryDescriptionString()
            "       ... ]\n";
 }
 
-void entryToJSON(UniValue &info, const CTxMemPoolEntry &e)
+static void entryStateToJSON(UniValue &info, const CTxMemPoolEntry &e)
 {
-    AssertLockHeld(mempool.cs);
-
     info.push_back(Pair("size", (int)e.GetTxSize()));
     info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
     info.push_back(Pair("modifiedfee", ValueFromAmount(e.GetModifiedFee())));
@@ -366,14 +365,10 @@ void entryToJSON(UniValue &info, const CTxMemPoolEntry &e)
     info.push_back(Pair("ancestorcount", e.GetCountWithAncestors()));
     info.push_back(Pair("ancestorsize", e.GetSizeWithAncestors()));
     info.push_back(Pair("ancestorfees", e.GetModFeesWithAncestors()));
-    const CTransaction& tx = e.GetTx();
-    set<string> setDepends;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-    {
-        if (mempool.exists(txin.prevout.hash))
-            setDepends.insert(txin.prevout.hash.ToString());
-    }
+}
 
+static void dependsToJSON(UniValue &info, const set<string> &setDepends)
+{
     UniValue depends(UniValue::VARR);
     BOOST_FOREACH(const string& dep, setDepends)
     {
@@ -383,15 +378,42 @@ void entryToJSON(UniValue &info, const CTxMemPoolEntry &e)
     info.push_back(Pair("depends", depends));
 }
 
+void entryToJSON(UniValue &info, const CTxMemPoolEntry &e)
+{
+    AssertLockHeld(mempool.cs);
+
+    entryStateToJSON(info, e);
+    const CTransaction& tx = e.GetTx();
+    set<string> setDepends;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        if (mempool.exists(txin.prevout.hash))
+            setDepends.insert(txin.prevout.hash.ToString());
+    }
+    dependsToJSON(info, setDepends);
+}
+
+/** Like entryToJSON, from a snapshot entry; doesn't need mempool.cs */
+void entryToJSON(UniValue &info, const CTxMemPoolSnapshot::Entry &e)
+{
+    entryStateToJSON(info, e.entry);
+    set<string> setDepends;
+    BOOST_FOREACH(const uint256& parentHash, e.vParents)
+        setDepends.insert(parentHash.ToString());
+    dependsToJSON(info, setDepends);
+}
+
 UniValue mempoolToJSON(bool fVerbose = false)
 {
+    // Work from a snapshot so that the (potentially large) dump is built
+    // without holding mempool.cs.
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot = mempool.GetSnapshot();
     if (fVerbose)
     {
-        LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
-        BOOST_FOREACH(const CTxMemPoolEntry& e, mempool.mapTx)
+        BOOST_FOREACH(const CTxMemPoolSnapshot::Entry& e, snapshot->vEntries)
         {
-            const uint256& hash = e.GetTx().GetHash();
+            const uint256& hash = e.entry.GetTx().GetHash();
             UniValue info(UniValue::VOBJ);
             entryToJSON(info, e);
             o.push_back(Pair(hash.ToString(), info));
@@ -400,12 +422,9 @@ UniValue mempoolToJSON(bool fVerbose = false)
     }
     else
     {
-        vector<uint256> vtxid;
-        mempool.queryHashes(vtxid);
-
         UniValue a(UniValue::VARR);
-        BOOST_FOREACH(const uint256& hash, vtxid)
-            a.push_back(hash.ToString());
+        BOOST_FOREACH(const CTxMemPoolSnapshot::Entry& e, snapshot->vEntries)
+            a.push_back(e.entry.GetTx().GetHash().ToString());
 
         return a;
     }
@@ -590,16 +609,14 @@ UniValue getmempoolentry(const JSONRPCRequest& request)
 
     uint256 hash = ParseHashV(request.params[0], "parameter 1");
 
-    LOCK(mempool.cs);
-
-    CTxMemPool::txiter it = mempool.mapTx.find(hash);
-    if (it == mempool.mapTx.end()) {
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot = mempool.GetSnapshot(hash);
+    const CTxMemPoolSnapshot::Entry* e = snapshot->find(hash);
+    if (!e) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
     }
 
-    const CTxMemPoolEntry &e = *it;
     UniValue info(UniValue::VOBJ);
-    entryToJSON(info, e);
+    entryToJSON(info, *e);
     return info;
 }
 
@@ -1415,6 +1432,117 @@ UniValue reconsiderblock(const JSONRPCRequest& request)
     return NullUniValue;
 }
 
+static UniValue DBOpStatsToJSON(const CDBOpStats& op)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("count", (uint64_t)op.nCount));
+    obj.push_back(Pair("bytes", (uint64_t)op.nBytes));
+    obj.push_back(Pair("totalmicros", (uint64_t)op.nTotalMicros));
+    obj.push_back(Pair("maxmicros", (uint64_t)op.nMaxMicros));
+    UniValue buckets(UniValue::VARR);
+    for (int i = 0; i < CDBOpStats::NUM_BUCKETS; i++) {
+        uint64_t nCount = op.vBuckets[i];
+        if (!nCount)
+            continue;
+        UniValue bucket(UniValue::VARR);
+        bucket.push_back(CDBOpStats::BucketLimit(i));
+        bucket.push_back(nCount);
+        buckets.push_back(bucket);
+    }
+    obj.push_back(Pair("buckets", buckets));
+    return obj;
+}
+
+static UniValue DBStatsToJSON(const CDBWrapper& db, bool fVerbose)
+{
+    UniValue obj(UniValue::VOBJ);
+
+    UniValue levels(UniValue::VARR);
+    for (int nFiles : db.GetFilesPerLevel())
+        levels.push_back(nFiles);
+    obj.push_back(Pair("filesperlevel", levels));
+
+    std::string strValue;
+    size_t nBlockCacheUsage = db.GetBlockCacheUsage();
+    if (db.GetProperty("leveldb.approximate-memory-usage", strValue)) {
+        // Everything that isn't block cache is in the memtables
+        int64_t nMemoryUsage = atoi64(strValue);
+        obj.push_back(Pair("memoryusage", nMemoryUsage));
+        obj.push_back(Pair("memtableusage", std::max<int64_t>(nMemoryUsage - (int64_t)nBlockCacheUsage, 0)));
+    }
+
+    const CDBWrapperStats& stats = db.GetStats();
+    UniValue cache(UniValue::VOBJ);
+    cache.push_back(Pair("usage", (uint64_t)nBlockCacheUsage));
+    cache.push_back(Pair("hits", (uint64_t)stats.nBlockCacheHits));
+    cache.push_back(Pair("misses", (uint64_t)stats.nBlockCacheMisses));
+    obj.push_back(Pair("blockcache", cache));
+
+    obj.push_back(Pair("read", DBOpStatsToJSON(stats.read)));
+    obj.push_back(Pair("readmisses", (uint64_t)stats.nReadMisses));
+    obj.push_back(Pair("write", DBOpStatsToJSON(stats.write)));
+    obj.push_back(Pair("seek", DBOpStatsToJSON(stats.seek)));
+    obj.push_back(Pair("iteratorsteps", (uint64_t)stats.nIteratorSteps));
+
+    if (db.GetProperty("leveldb.stats", strValue))
+        obj.push_back(Pair("compactions", strValue));
+    if (fVerbose && db.GetProperty("leveldb.sstables", strValue))
+        obj.push_back(Pair("sstables", strValue));
+    return obj;
+}
+
+UniValue getdbstats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 1)
+        throw runtime_error(
+            "getdbstats ( verbose )\n"
+            "\nReturns LevelDB internals and operation latencies of the chainstate and block index databases.\n"
+            "Latency histograms have power-of-two buckets, each given as [upper bound in microseconds (exclusive), count].\n"
+            "\nArguments:\n"
+            "1. verbose    (boolean, optional, default=false) Also list the table files of each level\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"chainstate\": {              (json object) the coins database\n"
+            "    \"filesperlevel\": [n,...],    (array) number of table files on each level, a large level 0 means compactions are behind\n"
+            "    \"memoryusage\": n,            (numeric) bytes held by the block cache and memtables\n"
+            "    \"memtableusage\": n,          (numeric) bytes held by the memtables\n"
+            "    \"blockcache\": {              (json object) table block cache\n"
+            "      \"usage\": n,                (numeric) bytes cached\n"
+            "      \"hits\": n,                 (numeric) lookups served from the cache\n"
+            "      \"misses\": n                (numeric) lookups that went to disk\n"
+            "    },\n"
+            "    \"read\": {                    (json object) point lookups\n"
+            "      \"count\": n,                (numeric) number of operations\n"
+            "      \"bytes\": n,                (numeric) bytes read\n"
+            "      \"totalmicros\": n,          (numeric) time spent in microseconds\n"
+            "      \"maxmicros\": n,            (numeric) slowest operation in microseconds\n"
+            "      \"buckets\": [[n,n],...]     (array) latency histogram\n"
+            "    },\n"
+            "    \"readmisses\": n,             (numeric) lookups of keys that don't exist\n"
+            "    \"write\": {...},              (json object) batch writes, same fields as read\n"
+            "    \"seek\": {...},               (json object) iterator seeks, same fields as read\n"
+            "    \"iteratorsteps\": n,          (numeric) iterator steps\n"
+            "    \"compactions\": \"str\",       (string) files, size and compaction work per level (leveldb.stats)\n"
+            "    \"sstables\": \"str\"           (string, verbose only) table files per level (leveldb.sstables)\n"
+            "  },\n"
+            "  \"blockindex\": {...}          (json object) the block index database, same fields as chainstate\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getdbstats", "")
+            + HelpExampleRpc("getdbstats", "true")
+        );
+
+    bool fVerbose = request.params.size() > 0 && request.params[0].get_bool();
+
+    LOCK(cs_main);
+    UniValue ret(UniValue::VOBJ);
+    if (pcoinsdbview)
+        ret.push_back(Pair("chainstate", DBStatsToJSON(pcoinsdbview->GetDB(), fVerbose)));
+    if (pblocktree)
+        ret.push_back(Pair("blockindex", DBStatsToJSON(*pblocktree, fVerbose)));
+    return ret;
+}
+
 static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         okSafe argNames
   //  --------------------- ------------------------  -----------------------  ------ ----------
@@ -1433,6 +1561,7 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getrawmempool",          &getrawmempool,          true,  {"verbose"} },
     { "blockchain",         "gettxout",               &gettxout,               true,  {"txid","n","include_mempool"} },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true,  {} },
+    { "blockchain",         "getdbstats",             &getdbstats,             true,  {"verbose"} },
     { "blockchain",         "pruneblockchain",        &pruneblockchain,        true,  {"height"} },
     { "blockchain",         "verifychain",            &verifychain,            true,  {"checklevel","nblocks"} },
 
@@ -863,20 +863,46 @@ UniValue estimatesmartfee(const JSONRPCRequest& request)
             "for which the estimate is valid. Uses virtual transaction size as defined\n"
             "in BIP 141 (witness data is discounted).\n"
             "\nArguments:\n"
-            "1. nblocks     (numeric)\n"
+            "1. nblocks     (numeric or array) a confirmation target, or an array of targets\n"
+            "               to estimate in a single call\n"
             "\nResult:\n"
             "{\n"
             "  \"feerate\" : x.x,     (numeric) estimate fee-per-kilobyte (in VEGI)\n"
             "  \"blocks\" : n         (numeric) block number where estimate was found\n"
             "}\n"
             "\n"
+            "If nblocks is an array, an array of such objects is returned, one per target\n"
+            "and in the same order.\n"
             "A negative value is returned if not enough transactions and blocks\n"
             "have been observed to make an estimate for any number of blocks.\n"
             "However it will not return a value below the mempool reject fee.\n"
             "\nExample:\n"
             + HelpExampleCli("estimatesmartfee", "6")
+            + HelpExampleCli("estimatesmartfee", "\"[2, 6, 12]\"")
             );
 
+    if (request.params[0].isArray()) {
+        const UniValue& targets = request.params[0].get_array();
+        std::vector<int> vBlocks;
+        vBlocks.reserve(targets.size());
+        for (unsigned int idx = 0; idx < targets.size(); idx++) {
+            if (!targets[idx].isNum())
+                throw JSONRPCError(RPC_TYPE_ERROR, "Confirmation targets must be numeric");
+            vBlocks.push_back(targets[idx].get_int());
+        }
+
+        std::vector<int> answersFound;
+        std::vector<CFeeRate> feeRates = mempool.estimateSmartFees(vBlocks, answersFound);
+        UniValue results(UniValue::VARR);
+        for (unsigned int idx = 0; idx < feeRates.size(); idx++) {
+            UniValue result(UniValue::VOBJ);
+            result.push_back(Pair("feerate", feeRates[idx] == CFeeRate(0) ? -1.0 : ValueFromAmount(feeRates[idx].GetFeePerK())));
+            result.push_back(Pair("blocks", answersFound[idx]));
+            results.push_back(result);
+        }
+        return results;
+    }
+
     RPCTypeCheck(request.params, boost::assign::list_of(UniValue::VNUM));
 
     int nBlocks = request.params[0].get_int();
@@ -103,6 +103,7 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
             "       ...\n"
             "    ],\n"
             "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"					
+            "    \"memusage\": n,             (numeric) Bytes of memory held in this peer's buffers, relay state, filters and orphans\n"
             "    \"bytessent_per_msg\": {\n"
             "       \"addr\": n,              (numeric) The total bytes sent aggregated by message type\n"
             "       ...\n"
@@ -168,6 +169,7 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
             obj.push_back(Pair("inflight", heights));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
+        obj.push_back(Pair("memusage", stats.nMemoryUsage));
 
         UniValue sendPerMsgCmd(UniValue::VOBJ);
         BOOST_FOREACH(const mapMsgCmdSize::value_type &i, stats.mapSendBytesPerMsgCmd) {
@@ -370,6 +372,119 @@ UniValue getnettotals(const JSONRPCRequest& request)
     return obj;
 }
 
+static UniValue NetHistogramToJSON(const CNetHistogram& hist)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("count", hist.nCount));
+    obj.push_back(Pair("sum", hist.nSum));
+    obj.push_back(Pair("max", hist.nMax));
+    UniValue buckets(UniValue::VARR);
+    for (int i = 0; i < CNetHistogram::NUM_BUCKETS; i++) {
+        if (!hist.vBuckets[i])
+            continue;
+        UniValue bucket(UniValue::VARR);
+        bucket.push_back(hist.BucketLimit(i));
+        bucket.push_back(hist.vBuckets[i]);
+        buckets.push_back(bucket);
+    }
+    obj.push_back(Pair("buckets", buckets));
+    return obj;
+}
+
+static UniValue NetMsgStatsToJSON(const CNetMsgStats& stats)
+{
+    UniValue obj(UniValue::VOBJ);
+    UniValue commands(UniValue::VOBJ);
+    BOOST_FOREACH(const mapMsgCmdStats::value_type& item, stats.mapCmdStats) {
+        const CNetMsgCmdStats& cmdStats = item.second;
+        UniValue cmd(UniValue::VOBJ);
+        cmd.push_back(Pair("msgssent", cmdStats.nMsgsSent));
+        cmd.push_back(Pair("bytessent", cmdStats.nBytesSent));
+        cmd.push_back(Pair("msgsrecv", cmdStats.nMsgsRecv));
+        cmd.push_back(Pair("bytesrecv", cmdStats.nBytesRecv));
+        cmd.push_back(Pair("msgsprocessed", cmdStats.nMsgsProcessed));
+        cmd.push_back(Pair("processtime", cmdStats.nProcessTime));
+        commands.push_back(Pair(item.first, cmd));
+    }
+    obj.push_back(Pair("commands", commands));
+    obj.push_back(Pair("queuewait", NetHistogramToJSON(stats.histQueueWait)));
+    obj.push_back(Pair("processtime", NetHistogramToJSON(stats.histProcessTime)));
+    obj.push_back(Pair("sendmessagestime", NetHistogramToJSON(stats.histSendMessagesTime)));
+    obj.push_back(Pair("sendqueuebytes", NetHistogramToJSON(stats.histSendQueueBytes)));
+    return obj;
+}
+
+UniValue getnetmsgstats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 1)
+        throw runtime_error(
+            "getnetmsgstats ( peers )\n"
+            "\nReturns message counts and timings per message type, with histograms of how long\n"
+            "received messages wait to be processed, how long processing takes and how full\n"
+            "send queues are. Totals cover all peers since startup. Times are in microseconds.\n"
+            "\nArguments:\n"
+            "1. peers   (boolean, optional, default=false) Also return the statistics of each connected peer\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"commands\": {             (json object) Per message type\n"
+            "    \"msg\": {\n"
+            "      \"msgssent\": n,         (numeric) Messages sent\n"
+            "      \"bytessent\": n,        (numeric) Bytes sent, including headers\n"
+            "      \"msgsrecv\": n,         (numeric) Messages received\n"
+            "      \"bytesrecv\": n,        (numeric) Bytes received, including headers\n"
+            "      \"msgsprocessed\": n,    (numeric) Messages that went through ProcessMessage\n"
+            "      \"processtime\": n       (numeric) Total time spent in ProcessMessage\n"
+            "    }, ...\n"
+            "  },\n"
+            "  \"queuewait\": {            (json object) Time from receipt until processing started\n"
+            "    \"count\": n,              (numeric) Number of samples\n"
+            "    \"sum\": n,                (numeric) Sum of all samples\n"
+            "    \"max\": n,                (numeric) Largest sample\n"
+            "    \"buckets\": [             (json array) Non-empty buckets as [limit, count], counting samples below\n"
+            "      [n, n], ...            limit and at least the previous power of two\n"
+            "    ]\n"
+            "  },\n"
+            "  \"processtime\": {...},     (json object) Time spent in ProcessMessage per message\n"
+            "  \"sendmessagestime\": {...},(json object) Time spent in SendMessages per call\n"
+            "  \"sendqueuebytes\": {...},  (json object) Bytes already queued when a message was pushed\n"
+            "  \"peers\": [                (json array) Only if peers is true\n"
+            "    {\n"
+            "      \"id\": n,               (numeric) Peer index\n"
+            "      ...                    The same fields as above, for this peer\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getnetmsgstats", "")
+            + HelpExampleCli("getnetmsgstats", "true")
+            + HelpExampleRpc("getnetmsgstats", "true")
+        );
+    if(!g_connman)
+        throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
+
+    bool fPeers = false;
+    if (request.params.size() > 0)
+        fPeers = request.params[0].get_bool();
+
+    CNetMsgStats totals;
+    g_connman->GetMsgStatsTotals(totals);
+    UniValue obj = NetMsgStatsToJSON(totals);
+
+    if (fPeers) {
+        std::vector<CNodeStats> vstats;
+        g_connman->GetNodeStats(vstats);
+        UniValue peers(UniValue::VARR);
+        BOOST_FOREACH(const CNodeStats& stats, vstats) {
+            UniValue peer(UniValue::VOBJ);
+            peer.push_back(Pair("id", stats.nodeid));
+            peer.pushKVs(NetMsgStatsToJSON(stats.msgStats));
+            peers.push_back(peer);
+        }
+        obj.push_back(Pair("peers", peers));
+    }
+    return obj;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -612,6 +727,7 @@ static const CRPCCommand commands[] =
     { "network",            "disconnectnode",         &disconnectnode,         true,  {"address"} },
     { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true,  {"node"} },
     { "network",            "getnettotals",           &getnettotals,           true,  {} },
+    { "network",            "getnetmsgstats",         &getnetmsgstats,         true,  {"peers"} },
     { "network",            "getnetworkinfo",         &getnetworkinfo,         true,  {} },
     { "network",            "setban",                 &setban,                 true,  {"subnet", "command", "bantime", "absolute"} },
     { "network",            "listbanned",             &listbanned,             true,  {} },
@@ -928,6 +928,83 @@ UniValue sendrawtransaction(const JSONRPCRequest& request)
     return hashTx.GetHex();
 }
 
+UniValue sendrawpackage(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+        throw runtime_error(
+            "sendrawpackage [\"hexstring\",...] ( allowhighfees )\n"
+            "\nSubmits a package of related raw transactions (serialized, hex-encoded) to local node and network.\n"
+            "A child transaction can pay for parents whose own fee is too low to be accepted: the mempool minimum\n"
+            "fee and relay fee are met if the child's feerate together with its parents in the package meets them.\n"
+            "A parent can't pay for a child, and the package may not conflict with transactions in the mempool.\n"
+            "Either all transactions in the package are accepted, or none are.\n"
+            "\nArguments:\n"
+            "1. \"hexstrings\"   (array, required) The hex strings of the raw transactions, parents before children\n"
+            "     [\n"
+            "       \"hexstring\"  (string) A raw transaction\n"
+            "       ,...\n"
+            "     ]\n"
+            "2. allowhighfees    (boolean, optional, default=false) Allow high fees\n"
+            "\nResult:\n"
+            "[                   (array of strings)\n"
+            "  \"hex\"           (string) The transaction hash in hex\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("sendrawpackage", "\"[\\\"parenthex\\\",\\\"childhex\\\"]\"") +
+            "\nAs a json rpc call\n"
+            + HelpExampleRpc("sendrawpackage", "[\"parenthex\",\"childhex\"]")
+        );
+
+    LOCK(cs_main);
+    RPCTypeCheck(request.params, boost::assign::list_of(UniValue::VARR)(UniValue::VBOOL));
+
+    const UniValue& hexstrings = request.params[0].get_array();
+    if (hexstrings.size() == 0 || hexstrings.size() > MAX_PACKAGE_COUNT)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Package must contain between 1 and %u transactions", MAX_PACKAGE_COUNT));
+
+    std::vector<CTransactionRef> package;
+    package.reserve(hexstrings.size());
+    for (unsigned int idx = 0; idx < hexstrings.size(); idx++) {
+        CMutableTransaction mtx;
+        if (!hexstrings[idx].isStr() || !DecodeHexTx(mtx, hexstrings[idx].get_str()))
+            throw JSONRPCError(RPC_DESERIALIZATION_ERROR, strprintf("TX decode failed for package member %u", idx));
+        package.push_back(MakeTransactionRef(std::move(mtx)));
+    }
+
+    CAmount nMaxRawTxFee = maxTxFee;
+    if (request.params.size() > 1 && request.params[1].get_bool())
+        nMaxRawTxFee = 0;
+
+    CCoinsViewCache &view = *pcoinsTip;
+    BOOST_FOREACH(const CTransactionRef& tx, package) {
+        const CCoins* existingCoins = view.AccessCoins(tx->GetHash());
+        if (existingCoins && existingCoins->nHeight < 1000000000)
+            throw JSONRPCError(RPC_TRANSACTION_ALREADY_IN_CHAIN, strprintf("transaction %s already in block chain", tx->GetHash().GetHex()));
+    }
+
+    // push to local node and sync with wallets
+    CValidationState state;
+    if (!AcceptPackageToMemoryPool(mempool, state, package, nMaxRawTxFee)) {
+        if (state.IsInvalid())
+            throw JSONRPCError(RPC_TRANSACTION_REJECTED, strprintf("%i: %s", state.GetRejectCode(), state.GetRejectReason()));
+        throw JSONRPCError(RPC_TRANSACTION_ERROR, state.GetRejectReason());
+    }
+    if(!g_connman)
+        throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
+
+    UniValue result(UniValue::VARR);
+    BOOST_FOREACH(const CTransactionRef& tx, package) {
+        CInv inv(MSG_TX, tx->GetHash());
+        g_connman->ForEachNode([&inv](CNode* pnode)
+        {
+            pnode->PushInventory(inv);
+        });
+        result.push_back(tx->GetHash().GetHex());
+    }
+    return result;
+}
+
 static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         okSafeMode
   //  --------------------- ------------------------  -----------------------  ----------
@@ -936,6 +1013,7 @@ static const CRPCCommand commands[] =
     { "rawtransactions",    "decoderawtransaction",   &decoderawtransaction,   true,  {"hexstring"} },
     { "rawtransactions",    "decodescript",           &decodescript,           true,  {"hexstring"} },
     { "rawtransactions",    "sendrawtransaction",     &sendrawtransaction,     false, {"hexstring","allowhighfees"} },
+    { "rawtransactions",    "sendrawpackage",         &sendrawpackage,         false, {"hexstrings","allowhighfees"} },
     { "rawtransactions",    "signrawtransaction",     &signrawtransaction,     false, {"hexstring","prevtxs","privkeys","sighashtype"} }, /* uses wallet if enabled */
 
     { "blockchain",         "gettxoutproof",          &gettxoutproof,          true,  {"txids", "blockhash"} },
@@ -409,6 +409,12 @@ public:
         clear();
     }
 
+    /** Exchange the underlying buffer (including its capacity) and restart reading */
+    void swap(CSerializeData &data) {
+        vch.swap(data);
+        nReadPos = 0;
+    }
+
     /**
      * XOR the contents of this stream with a certain key.
      *
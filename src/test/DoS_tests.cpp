@@ -31,6 +31,7 @@ struct COrphanTx {
     CTransactionRef tx;
     NodeId fromPeer;
     int64_t nTimeExpire;
+    size_t nPeerPos;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
 
@@ -215,4 +216,37 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     BOOST_CHECK(mapOrphanTransactions.empty());
 }
 
+BOOST_AUTO_TEST_CASE(DoS_mapOrphansPerPeer)
+{
+    // Peer 0 floods us with orphans, peer 1 sends two:
+    std::vector<uint256> vPeer1Orphans;
+    for (int i = 0; i < 22; i++)
+    {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.n = 0;
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].scriptSig << OP_1;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1*CENT;
+        tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+
+        NodeId peer = i < 20 ? 0 : 1;
+        BOOST_CHECK(AddOrphanTx(MakeTransactionRef(tx), peer));
+        if (peer == 1)
+            vPeer1Orphans.push_back(tx.GetHash());
+    }
+
+    // Eviction takes from the peer with the most orphans first
+    LimitOrphanTxSize(10);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 10);
+    BOOST_FOREACH(const uint256& hash, vPeer1Orphans)
+        BOOST_CHECK(mapOrphanTransactions.count(hash));
+
+    EraseOrphansFor(0);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 2);
+    EraseOrphansFor(1);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -203,10 +203,48 @@ BOOST_AUTO_TEST_CASE(addrman_select)
     BOOST_CHECK(addrman.size() == 7);
 
     // Test 12: Select pulls from new and tried regardless of port number.
-    BOOST_CHECK(addrman.Select().ToString() == "250.4.6.6:8333");
-    BOOST_CHECK(addrman.Select().ToString() == "250.3.2.2:9999");
-    BOOST_CHECK(addrman.Select().ToString() == "250.3.3.3:9999");
     BOOST_CHECK(addrman.Select().ToString() == "250.4.4.4:8333");
+    BOOST_CHECK(addrman.Select().ToString() == "250.4.5.5:7777");
+    BOOST_CHECK(addrman.Select().ToString() == "250.3.1.1:8333");
+    BOOST_CHECK(addrman.Select().ToString() == "250.4.4.4:8333");
+}
+
+BOOST_AUTO_TEST_CASE(addrman_select_after_removal)
+{
+    CAddrManTest addrman;
+
+    // Set addrman addr placement to be deterministic.
+    addrman.MakeDeterministic();
+
+    CNetAddr source = ResolveIP("252.2.2.2");
+
+    // Fill the new table, then move every other address to tried, so both
+    // slot lists see insertions as well as removals.
+    for (unsigned int i = 1; i < 64; i++) {
+        CService addr = ResolveService("250.1." + boost::to_string(i / 8) + "." + boost::to_string(i), 8333);
+        addrman.Add(CAddress(addr, NODE_NONE), source);
+        if (i % 2 == 0)
+            addrman.Good(CAddress(addr, NODE_NONE));
+    }
+    size_t nSize = addrman.size();
+    BOOST_CHECK(nSize > 0);
+
+    // Test 12.1: every selection returns a known address.
+    for (int i = 0; i < 100; i++) {
+        CAddrInfo addr_ret = addrman.Select();
+        BOOST_CHECK(addrman.Find(addr_ret) != NULL);
+        CAddrInfo addr_new = addrman.Select(true);
+        BOOST_CHECK(addrman.Find(addr_new) != NULL);
+    }
+
+    // Test 12.2: only modifications advance the change counter.
+    uint64_t nChangeCount = addrman.GetChangeCount();
+    addrman.Select();
+    addrman.GetAddr();
+    BOOST_CHECK_EQUAL(addrman.GetChangeCount(), nChangeCount);
+    addrman.Attempt(ResolveService("250.1.0.1", 8333), true);
+    BOOST_CHECK(addrman.GetChangeCount() != nChangeCount);
+    BOOST_CHECK_EQUAL(addrman.size(), nSize);
 }
 
 BOOST_AUTO_TEST_CASE(addrman_new_collisions)
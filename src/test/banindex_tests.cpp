@@ -0,0 +1,127 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "banindex.h"
+#include "netbase.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(banindex_tests, BasicTestingSetup)
+
+static CNetAddr ResolveIP(const char* ip)
+{
+    CNetAddr addr;
+    LookupHost(ip, addr, false);
+    return addr;
+}
+
+static CSubNet ResolveSubNet(const char* subnet)
+{
+    CSubNet ret;
+    LookupSubNet(subnet, ret);
+    return ret;
+}
+
+BOOST_AUTO_TEST_CASE(subnet_prefix_length)
+{
+    BOOST_CHECK_EQUAL(ResolveSubNet("1.2.3.4").GetPrefixLength(), 128);
+    BOOST_CHECK_EQUAL(ResolveSubNet("1.2.3.0/24").GetPrefixLength(), 96 + 24);
+    BOOST_CHECK_EQUAL(ResolveSubNet("1.2.0.0/255.255.0.0").GetPrefixLength(), 96 + 16);
+    BOOST_CHECK_EQUAL(ResolveSubNet("1.0.3.0/255.0.255.0").GetPrefixLength(), -1);
+    BOOST_CHECK_EQUAL(ResolveSubNet("1:2:3:4::/64").GetPrefixLength(), 64);
+    BOOST_CHECK_EQUAL(ResolveSubNet("::/0").GetPrefixLength(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(banindex_lookup)
+{
+    const int64_t nNow = 1000;
+    CBanIndex index;
+    BOOST_CHECK(!index.IsBanned(ResolveIP("1.2.3.4"), nNow));
+
+    index.Insert(ResolveSubNet("1.2.3.4"), nNow + 10);
+    index.Insert(ResolveSubNet("10.0.0.0/8"), nNow + 10);
+    index.Insert(ResolveSubNet("1:2:3:4::/64"), nNow + 10);
+    index.Insert(ResolveSubNet("192.0.5.0/255.255.0.255"), nNow + 10);
+    index.Insert(ResolveSubNet("5.6.7.8"), nNow - 10); // expired
+
+    BOOST_CHECK(index.IsBanned(ResolveIP("1.2.3.4"), nNow));
+    BOOST_CHECK(!index.IsBanned(ResolveIP("1.2.3.5"), nNow));
+    BOOST_CHECK(index.IsBanned(ResolveIP("10.255.1.2"), nNow));
+    BOOST_CHECK(!index.IsBanned(ResolveIP("11.0.0.1"), nNow));
+    BOOST_CHECK(index.IsBanned(ResolveIP("1:2:3:4:5:6:7:8"), nNow));
+    BOOST_CHECK(!index.IsBanned(ResolveIP("1:2:3:5::1"), nNow));
+    BOOST_CHECK(index.IsBanned(ResolveIP("192.0.77.0"), nNow));
+    BOOST_CHECK(!index.IsBanned(ResolveIP("192.0.77.6"), nNow));
+    BOOST_CHECK(!index.IsBanned(ResolveIP("5.6.7.8"), nNow));
+    // The IPv4 bans don't spill over into the IPv6 space they are mapped in
+    BOOST_CHECK(!index.IsBanned(ResolveIP("::1.2.3.4"), nNow));
+    // Bans run out
+    BOOST_CHECK(!index.IsBanned(ResolveIP("1.2.3.4"), nNow + 10));
+
+    index.Erase(ResolveSubNet("10.0.0.0/8"));
+    index.Erase(ResolveSubNet("192.0.5.0/255.255.0.255"));
+    BOOST_CHECK(!index.IsBanned(ResolveIP("10.255.1.2"), nNow));
+    BOOST_CHECK(!index.IsBanned(ResolveIP("192.0.77.0"), nNow));
+    BOOST_CHECK(index.IsBanned(ResolveIP("1.2.3.4"), nNow));
+
+    // Rebuilding from the ban list matches it exactly and drops stale paths
+    size_t nNodes = index.GetNodeCount();
+    banmap_t banmap;
+    CBanEntry entry(nNow);
+    entry.nBanUntil = nNow + 10;
+    banmap[ResolveSubNet("1.2.3.4")] = entry;
+    index.Rebuild(banmap);
+    BOOST_CHECK(index.GetNodeCount() < nNodes);
+    BOOST_CHECK(index.IsBanned(ResolveIP("1.2.3.4"), nNow));
+    BOOST_CHECK(!index.IsBanned(ResolveIP("1:2:3:4:5:6:7:8"), nNow));
+
+    // Ban everything
+    index.Insert(ResolveSubNet("::/0"), nNow + 10);
+    BOOST_CHECK(index.IsBanned(ResolveIP("8.8.8.8"), nNow));
+    BOOST_CHECK(!index.IsBanned(CNetAddr(), nNow));
+    index.Erase(ResolveSubNet("::/0"));
+    BOOST_CHECK(!index.IsBanned(ResolveIP("8.8.8.8"), nNow));
+}
+
+BOOST_AUTO_TEST_CASE(banindex_nested)
+{
+    const int64_t nNow = 1000;
+    CBanIndex index;
+
+    // A subnet inserted below an existing path, and one that splits it
+    index.Insert(ResolveSubNet("10.1.2.0/24"), nNow + 10);
+    index.Insert(ResolveSubNet("10.1.0.0/16"), nNow + 10);
+    index.Insert(ResolveSubNet("10.1.128.0/17"), nNow + 10);
+    index.Insert(ResolveSubNet("10.0.0.0/8"), nNow + 10);
+    BOOST_CHECK(index.IsBanned(ResolveIP("10.1.2.3"), nNow));
+    BOOST_CHECK(index.IsBanned(ResolveIP("10.200.0.1"), nNow));
+
+    index.Erase(ResolveSubNet("10.0.0.0/8"));
+    BOOST_CHECK(!index.IsBanned(ResolveIP("10.200.0.1"), nNow));
+    BOOST_CHECK(index.IsBanned(ResolveIP("10.1.200.1"), nNow));
+    index.Erase(ResolveSubNet("10.1.0.0/16"));
+    BOOST_CHECK(index.IsBanned(ResolveIP("10.1.2.3"), nNow));
+    BOOST_CHECK(index.IsBanned(ResolveIP("10.1.200.1"), nNow));
+    BOOST_CHECK(!index.IsBanned(ResolveIP("10.1.3.1"), nNow));
+    index.Erase(ResolveSubNet("10.1.128.0/17"));
+    BOOST_CHECK(!index.IsBanned(ResolveIP("10.1.200.1"), nNow));
+    BOOST_CHECK(index.IsBanned(ResolveIP("10.1.2.255"), nNow));
+    // Erasing something that was never banned leaves the rest alone
+    index.Erase(ResolveSubNet("10.1.0.0/20"));
+    index.Erase(ResolveSubNet("10.1.2.3"));
+    BOOST_CHECK(index.IsBanned(ResolveIP("10.1.2.3"), nNow));
+
+    // Paths are compressed: at most two nodes per banned subnet
+    index.Clear();
+    for (int i = 0; i < 1000; i++) {
+        CSubNet subnet = ResolveSubNet(strprintf("%d.%d.%d.%d", 1 + i % 200, (i * 7) & 255, (i * 13) & 255, i & 255).c_str());
+        index.Insert(subnet, nNow + 10);
+        BOOST_CHECK(index.IsBanned(subnet.GetNetwork(), nNow));
+    }
+    BOOST_CHECK(index.GetNodeCount() <= 1 + 2 * 1000);
+    BOOST_CHECK(!index.IsBanned(ResolveIP("201.0.0.1"), nNow));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
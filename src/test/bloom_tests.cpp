@@ -178,6 +178,37 @@ BOOST_AUTO_TEST_CASE(bloom_match)
     BOOST_CHECK_MESSAGE(!filter.IsRelevantAndUpdate(tx), "Simple Bloom filter matched COutPoint for an output we didn't care about");
 }
 
+BOOST_AUTO_TEST_CASE(bloom_match_shared_elements)
+{
+    // Same transaction as in bloom_match (b4749f017444b051c44dfd2720e88f314ff94f3dd6d56d40ef65854fcd7fff6b)
+    CDataStream stream(ParseHex("01000000010b26e9b7735eb6aabdf358bab62f9816a21ba9ebdb719d5299e88607d722c190000000008b4830450220070aca44506c5cef3a16ed519d7c3c39f8aab192c4e1c90d065f37b8a4af6141022100a8e160b856c2d43d27d8fba71e5aef6405b8643ac4cb7cb3c462aced7f14711a0141046d11fee51b0e60666d5049a9101a72741df480b96ee26488a4d3466b95c9a40ac5eeef87e10a5cd336c19a84565f80fa6c547957b7700ff4dfbdefe76036c339ffffffff021bff3d11000000001976a91404943fdd508053c75000106d3bc6e2754dbcff1988ac2f15de00000000001976a914a266436d2965547608b9e15d9032a7b9d64fa43188ac00000000"), SER_DISK, CLIENT_VERSION);
+    CTransaction tx(deserialize, stream);
+    CBloomFilterElements elements(tx);
+
+    // One pubkey hash per output, then the prevout, signature and pubkey of the input
+    BOOST_CHECK_EQUAL(elements.OutputCount(), 2U);
+    BOOST_CHECK_EQUAL(elements.InputCount(), 1U);
+    BOOST_CHECK_EQUAL(elements.OutputEnd(0) - elements.OutputBegin(0), 1U);
+    BOOST_CHECK_EQUAL(elements.ElementSize(elements.OutputBegin(1)), 20U);
+    BOOST_CHECK_EQUAL(elements.InputEnd(0) - elements.InputBegin(0), 3U);
+    BOOST_CHECK_EQUAL(elements.ElementSize(elements.InputBegin(0)), 36U);
+
+    // The same elements serve several filters
+    CBloomFilter filterOutput(10, 0.000001, 0, BLOOM_UPDATE_ALL);
+    filterOutput.insert(ParseHex("a266436d2965547608b9e15d9032a7b9d64fa431"));
+    CBloomFilter filterPubKey(10, 0.000001, 1, BLOOM_UPDATE_ALL);
+    filterPubKey.insert(ParseHex("046d11fee51b0e60666d5049a9101a72741df480b96ee26488a4d3466b95c9a40ac5eeef87e10a5cd336c19a84565f80fa6c547957b7700ff4dfbdefe76036c339"));
+    CBloomFilter filterOther(10, 0.000001, 2, BLOOM_UPDATE_ALL);
+    filterOther.insert(ParseHex("0000006d2965547608b9e15d9032a7b9d64fa431"));
+    BOOST_CHECK(filterOutput.IsRelevantAndUpdate(tx, elements));
+    BOOST_CHECK(filterPubKey.IsRelevantAndUpdate(tx, elements));
+    BOOST_CHECK(!filterOther.IsRelevantAndUpdate(tx, elements));
+
+    // The matched output was added to the filter
+    BOOST_CHECK(filterOutput.contains(COutPoint(tx.GetHash(), 1)));
+    BOOST_CHECK(!filterOutput.contains(COutPoint(tx.GetHash(), 0)));
+}
+
 BOOST_AUTO_TEST_CASE(merkle_block_1)
 {
     // Random real block (0000000000013b8ab2cd513b0261a14096412195a72a0c4827d229dcc7e0f7af)
@@ -541,4 +572,49 @@ BOOST_AUTO_TEST_CASE(rolling_bloom)
     }
 }
 
+BOOST_AUTO_TEST_CASE(blocked_rolling_bloom)
+{
+    // last-100-entry, 1% false positive:
+    CBlockedRollingBloomFilter rb1(100, 0.01);
+
+    // Overfill:
+    static const int DATASIZE=399;
+    std::vector<unsigned char> data[DATASIZE];
+    for (int i = 0; i < DATASIZE; i++) {
+        data[i] = RandomData();
+        rb1.insert(data[i]);
+    }
+    // Last 100 guaranteed to be remembered:
+    for (int i = 299; i < DATASIZE; i++) {
+        BOOST_CHECK(rb1.contains(data[i]));
+    }
+
+    // The filter is sized for at most 1% false positives when as full as possible
+    unsigned int nHits = 0;
+    for (int i = 0; i < 10000; i++) {
+        if (rb1.contains(RandomData()))
+            ++nHits;
+    }
+    BOOST_TEST_MESSAGE("BlockedRollingBloomFilter got " << nHits << " false positives (<100 expected)");
+    BOOST_CHECK(nHits < 175);
+
+    BOOST_CHECK(rb1.contains(data[DATASIZE-1]));
+    rb1.reset();
+    BOOST_CHECK(!rb1.contains(data[DATASIZE-1]));
+
+    // Now roll through data, make sure last 100 entries
+    // are always remembered:
+    for (int i = 0; i < DATASIZE; i++) {
+        if (i >= 100)
+            BOOST_CHECK(rb1.contains(data[i-100]));
+        rb1.insert(data[i]);
+        BOOST_CHECK(rb1.contains(data[i]));
+    }
+
+    // Hashes and their serialization are the same element
+    uint256 hash = GetRandHash();
+    rb1.insert(hash);
+    BOOST_CHECK(rb1.contains(std::vector<unsigned char>(hash.begin(), hash.end())));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,9 +2,13 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "chainparams.h"
 #include "coins.h"
+#include "key.h"
 #include "script/standard.h"
+#include "txdb.h"
 #include "uint256.h"
+#include "util.h"
 #include "undo.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
@@ -873,4 +877,147 @@ BOOST_AUTO_TEST_CASE(ccoins_write)
                     CheckWriteCoins(parent_value, child_value, parent_value, parent_flags, child_flags, parent_flags);
 }
 
+static CMutableTransaction SpendCoinbase(const CTransaction& txPrev, const CKey& key, CAmount nValue = 11*CENT)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction tx;
+    tx.nVersion = 1;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(txPrev.GetHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig << vchSig;
+    return tx;
+}
+
+//! Record the transactions of a block and the ones it spends from
+static void AddTouchedCoins(const CBlock& block, std::set<uint256>& setTouched)
+{
+    for (const CTransactionRef& tx : block.vtx) {
+        setTouched.insert(tx->GetHash());
+        if (!tx->IsCoinBase()) {
+            for (const CTxIn& txin : tx->vin)
+                setTouched.insert(txin.prevout.hash);
+        }
+    }
+}
+
+//! The unspent outputs a view has for the given transactions
+static std::map<uint256, CCoins> GetUnspentCoins(const CCoinsView& view, const std::set<uint256>& setTxid)
+{
+    std::map<uint256, CCoins> mapCoins;
+    for (const uint256& txid : setTxid) {
+        CCoins coins;
+        if (view.GetCoins(txid, coins) && !coins.IsPruned())
+            mapCoins[txid] = coins;
+    }
+    return mapCoins;
+}
+
+//! Flush pcoinsTip one entry per batch and give up after two of them, as if the node had crashed
+static void FlushPartially()
+{
+    ForceSetArg("-dbbatchsize", "1");
+    ForceSetArg("-dbcrashbatches", "2");
+    BOOST_CHECK(!pcoinsTip->Flush());
+    ForceSetArg("-dbcrashbatches", "0");
+    ForceSetArg("-dbbatchsize", std::to_string(nDefaultDbBatchSize));
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_replay_partial_flush, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    BOOST_CHECK(pcoinsTip->Flush());
+    uint256 hashOldTip = pcoinsdbview->GetBestBlock();
+    BOOST_CHECK(hashOldTip == chainActive.Tip()->GetBlockHash());
+
+    std::set<uint256> setTouched;
+    for (int i = 0; i < 3; i++) {
+        CBlock block = CreateAndProcessBlock(std::vector<CMutableTransaction>(1, SpendCoinbase(coinbaseTxns[i], coinbaseKey)), scriptPubKey);
+        BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+        AddTouchedCoins(block, setTouched);
+    }
+    uint256 hashNewTip = chainActive.Tip()->GetBlockHash();
+    std::map<uint256, CCoins> mapExpected = GetUnspentCoins(*pcoinsTip, setTouched);
+
+    FlushPartially();
+    BOOST_CHECK(pcoinsdbview->GetBestBlock().IsNull());
+    BOOST_CHECK(pcoinsdbview->GetHeadBlocks() == std::vector<uint256>({hashNewTip, hashOldTip}));
+    BOOST_CHECK(GetUnspentCoins(*pcoinsdbview, setTouched) != mapExpected);
+
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(ReplayBlocks(Params(), pcoinsTip));
+    }
+    BOOST_CHECK(pcoinsdbview->GetHeadBlocks().empty());
+    BOOST_CHECK(pcoinsdbview->GetBestBlock() == hashNewTip);
+    BOOST_CHECK(GetUnspentCoins(*pcoinsdbview, setTouched) == mapExpected);
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_replay_partial_reorg_flush, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    std::set<uint256> setTouched;
+
+    // The database is flushed at the tip of a two block branch...
+    std::vector<CBlock> vOldBranch;
+    for (int i = 0; i < 2; i++) {
+        vOldBranch.push_back(CreateAndProcessBlock(std::vector<CMutableTransaction>(1, SpendCoinbase(coinbaseTxns[i], coinbaseKey)), scriptPubKey));
+        BOOST_CHECK(chainActive.Tip()->GetBlockHash() == vOldBranch.back().GetHash());
+        AddTouchedCoins(vOldBranch.back(), setTouched);
+    }
+    BOOST_CHECK(pcoinsTip->Flush());
+    uint256 hashOldTip = pcoinsdbview->GetBestBlock();
+    BOOST_CHECK(hashOldTip == vOldBranch.back().GetHash());
+
+    // ...which is then replaced by a longer one, with different spends of
+    // the same coins and its coinbases paid elsewhere
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(state, Params(), mapBlockIndex[vOldBranch[0].GetHash()]));
+    }
+    // Keep the old branch's spends, now back in the mempool, out of the new
+    // blocks' coinbase values
+    mempool.clear();
+    CScript scriptPubKeyNew = CScript() << OP_TRUE;
+    std::vector<CBlock> vNewBranch;
+    for (int i = 0; i < 3; i++) {
+        CBlock block = CreateAndProcessBlock(std::vector<CMutableTransaction>(1, SpendCoinbase(coinbaseTxns[i], coinbaseKey, 12*CENT)), scriptPubKeyNew);
+        vNewBranch.push_back(block);
+        BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+        AddTouchedCoins(block, setTouched);
+    }
+    uint256 hashNewTip = chainActive.Tip()->GetBlockHash();
+    std::map<uint256, CCoins> mapExpected = GetUnspentCoins(*pcoinsTip, setTouched);
+
+    // The flush to the new branch is interrupted, so replaying it has to
+    // roll back the old branch before rolling forward along the new one
+    FlushPartially();
+    BOOST_CHECK(pcoinsdbview->GetBestBlock().IsNull());
+    BOOST_CHECK(pcoinsdbview->GetHeadBlocks() == std::vector<uint256>({hashNewTip, hashOldTip}));
+
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(ReplayBlocks(Params(), pcoinsTip));
+    }
+    BOOST_CHECK(pcoinsdbview->GetHeadBlocks().empty());
+    BOOST_CHECK(pcoinsdbview->GetBestBlock() == hashNewTip);
+    BOOST_CHECK(GetUnspentCoins(*pcoinsdbview, setTouched) == mapExpected);
+    // Only the new branch's transactions are left
+    for (const CBlock& block : vOldBranch) {
+        for (const CTransactionRef& tx : block.vtx)
+            BOOST_CHECK(!mapExpected.count(tx->GetHash()));
+    }
+    for (const CBlock& block : vNewBranch) {
+        for (const CTransactionRef& tx : block.vtx)
+            BOOST_CHECK(mapExpected.count(tx->GetHash()));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
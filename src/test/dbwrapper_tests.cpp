@@ -320,4 +320,93 @@ BOOST_AUTO_TEST_CASE(iterator_string_ordering)
 
 
 
+BOOST_AUTO_TEST_CASE(dbwrapper_xor)
+{
+    // The word-at-a-time XOR must match a plain byte-wise one at any offset
+    std::vector<unsigned char> key = {0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef};
+    std::vector<unsigned char> key3 = {0x5a, 0xa5, 0xff};
+    for (const std::vector<unsigned char>& k : {key, key3}) {
+        for (size_t nOffset = 0; nOffset < 10; nOffset++) {
+            std::vector<char> data(37);
+            for (size_t i = 0; i < data.size(); i++)
+                data[i] = (char)(i * 7);
+            std::vector<char> expected(data);
+            for (size_t i = 0; i < expected.size(); i++)
+                expected[i] ^= k[(nOffset + i) % k.size()];
+            dbwrapper_private::Xor(data.data(), data.size(), k, nOffset);
+            BOOST_CHECK(data == expected);
+        }
+    }
+}
+
+// Keys and values larger than the preallocated sizes still round-trip
+BOOST_AUTO_TEST_CASE(dbwrapper_large_records)
+{
+    for (int i = 0; i < 2; i++) {
+        bool obfuscate = (bool)i;
+        boost::filesystem::path ph = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+        CDBWrapper dbw(ph, (1 << 20), true, false, obfuscate);
+
+        std::string key(DBWRAPPER_PREALLOC_KEY_SIZE * 2 + 3, 'k');
+        std::vector<unsigned char> in(DBWRAPPER_PREALLOC_VALUE_SIZE * 3 + 5);
+        for (size_t j = 0; j < in.size(); j++)
+            in[j] = (unsigned char)j;
+        std::vector<unsigned char> res;
+
+        BOOST_CHECK(dbw.Write(key, in));
+        BOOST_CHECK(dbw.Exists(key));
+        BOOST_CHECK(dbw.Read(key, res));
+        BOOST_CHECK(res == in);
+
+        std::unique_ptr<CDBIterator> it(dbw.NewIterator());
+        it->Seek(key);
+        BOOST_CHECK(it->Valid());
+        std::string keyRes;
+        BOOST_CHECK(it->GetKey(keyRes));
+        BOOST_CHECK_EQUAL(keyRes, key);
+        res.clear();
+        BOOST_CHECK(it->GetValue(res));
+        BOOST_CHECK(res == in);
+
+        // A truncated read fails instead of running off the end
+        uint256 small;
+        BOOST_CHECK(dbw.Write('s', std::vector<unsigned char>(4)));
+        BOOST_CHECK(!dbw.Read('s', small));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(dbwrapper_stats)
+{
+    boost::filesystem::path ph = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    CDBWrapper dbw(ph, (1 << 20), true, false, false);
+    const CDBWrapperStats& stats = dbw.GetStats();
+    // Opening the database already looked up the obfuscation key
+    uint64_t nReads = stats.read.nCount, nWrites = stats.write.nCount, nMisses = stats.nReadMisses;
+
+    uint256 in = GetRandHash(), res;
+    BOOST_CHECK(dbw.Write('k', in));
+    BOOST_CHECK(dbw.Read('k', res));
+    BOOST_CHECK(!dbw.Read('m', res));
+    BOOST_CHECK_EQUAL(stats.write.nCount, nWrites + 1);
+    BOOST_CHECK_EQUAL(stats.read.nCount, nReads + 2);
+    BOOST_CHECK_EQUAL(stats.nReadMisses, nMisses + 1);
+
+    uint64_t nBuckets = 0;
+    for (int i = 0; i < CDBOpStats::NUM_BUCKETS; i++)
+        nBuckets += stats.read.vBuckets[i];
+    BOOST_CHECK_EQUAL(nBuckets, stats.read.nCount);
+
+    std::unique_ptr<CDBIterator> it(dbw.NewIterator());
+    it->Seek('k');
+    it->Next();
+    BOOST_CHECK_EQUAL(stats.seek.nCount, 1U);
+    BOOST_CHECK_EQUAL(stats.nIteratorSteps, 1U);
+
+    // LevelDB answers the per-level file count for each of its levels
+    BOOST_CHECK(!dbw.GetFilesPerLevel().empty());
+    std::string strStats;
+    BOOST_CHECK(dbw.GetProperty("leveldb.stats", strStats));
+    BOOST_CHECK(!dbw.GetProperty("leveldb.nonexistent", strStats));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
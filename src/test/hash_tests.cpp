@@ -104,6 +104,17 @@ BOOST_AUTO_TEST_CASE(siphash)
     BOOST_CHECK_EQUAL(hasher.Finalize(),  0xe612a3cb9ecba951ull);
 
     BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, uint256S("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100")), 0x7127512f72f27cceull);
+    BOOST_CHECK_EQUAL(SipHashUint256Extra(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, uint256S("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100"), 0x23222120), siphash_4_2_testvec[36]);
+
+    // Check the four-way variant against the single one
+    uint256 vals[4] = {uint256S("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100"), uint256(), uint256S("ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"), uint256S("0123456789abcdef")};
+    const uint256* valptrs[4] = {&vals[0], &vals[1], &vals[2], &vals[3]};
+    uint64_t out[4];
+    SipHashUint256x4(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, valptrs, out);
+    BOOST_CHECK_EQUAL(out[0], 0x7127512f72f27cceull);
+    for (int i = 0; i < 4; i++) {
+        BOOST_CHECK_EQUAL(out[i], SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, vals[i]));
+    }
 
     // Check test vectors from spec, one byte at a time
     CSipHasher hasher2(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
@@ -105,6 +105,139 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     BOOST_CHECK_EQUAL(testPool.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolRemoveForBlockTest)
+{
+    // Test that removeForBlock removes in-block chains and conflicts in one
+    // pass while keeping the ancestor state of remaining descendants right.
+
+    TestMemPoolEntryHelper entry;
+    CTxMemPool testPool(CFeeRate(0));
+
+    // Chain txA -> txB -> txC, with txA and txB mined:
+    CMutableTransaction txA;
+    txA.vin.resize(1);
+    txA.vin[0].scriptSig = CScript() << OP_11;
+    txA.vout.resize(1);
+    txA.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txA.vout[0].nValue = 33000LL;
+    CMutableTransaction txB;
+    txB.vin.resize(1);
+    txB.vin[0].scriptSig = CScript() << OP_11;
+    txB.vin[0].prevout = COutPoint(txA.GetHash(), 0);
+    txB.vout.resize(1);
+    txB.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txB.vout[0].nValue = 22000LL;
+    CMutableTransaction txC;
+    txC.vin.resize(1);
+    txC.vin[0].scriptSig = CScript() << OP_11;
+    txC.vin[0].prevout = COutPoint(txB.GetHash(), 0);
+    txC.vout.resize(1);
+    txC.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txC.vout[0].nValue = 11000LL;
+
+    // txD spends an outpoint that the block spends differently, and has a
+    // child txE which must go with it:
+    CMutableTransaction txD;
+    txD.vin.resize(1);
+    txD.vin[0].scriptSig = CScript() << OP_11;
+    txD.vin[0].prevout = COutPoint(uint256S("0x1"), 0);
+    txD.vout.resize(1);
+    txD.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txD.vout[0].nValue = 33000LL;
+    CMutableTransaction txE;
+    txE.vin.resize(1);
+    txE.vin[0].scriptSig = CScript() << OP_11;
+    txE.vin[0].prevout = COutPoint(txD.GetHash(), 0);
+    txE.vout.resize(1);
+    txE.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txE.vout[0].nValue = 22000LL;
+    CMutableTransaction txDConflict = txD;
+    txDConflict.vout[0].nValue = 32000LL;
+
+    testPool.addUnchecked(txA.GetHash(), entry.Fee(1000LL).FromTx(txA));
+    testPool.addUnchecked(txB.GetHash(), entry.Fee(2000LL).FromTx(txB));
+    testPool.addUnchecked(txC.GetHash(), entry.Fee(3000LL).FromTx(txC));
+    testPool.addUnchecked(txD.GetHash(), entry.Fee(1000LL).FromTx(txD));
+    testPool.addUnchecked(txE.GetHash(), entry.Fee(1000LL).FromTx(txE));
+    BOOST_CHECK_EQUAL(testPool.size(), 5);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(txC.GetHash())->GetCountWithAncestors(), 3);
+
+    std::vector<CTransactionRef> vtx;
+    vtx.push_back(MakeTransactionRef(txA));
+    vtx.push_back(MakeTransactionRef(txB));
+    vtx.push_back(MakeTransactionRef(txDConflict));
+    testPool.removeForBlock(vtx, 1);
+
+    BOOST_CHECK_EQUAL(testPool.size(), 1);
+    CTxMemPool::txiter it = testPool.mapTx.find(txC.GetHash());
+    BOOST_CHECK(it != testPool.mapTx.end());
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it->GetSizeWithAncestors(), it->GetTxSize());
+    BOOST_CHECK_EQUAL(it->GetModFeesWithAncestors(), 3000LL);
+    BOOST_CHECK_EQUAL(it->GetSigOpCostWithAncestors(), it->GetSigOpCost());
+    BOOST_CHECK(testPool.GetMemPoolParents(it).empty());
+    BOOST_CHECK(testPool.mapNextTx.find(txD.vin[0].prevout) == testPool.mapNextTx.end());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSnapshotTest)
+{
+    TestMemPoolEntryHelper entry;
+    CTxMemPool testPool(CFeeRate(0));
+
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 33000LL;
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 11000LL;
+
+    testPool.addUnchecked(txParent.GetHash(), entry.Fee(1000LL).FromTx(txParent));
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot = testPool.GetSnapshot();
+    BOOST_CHECK_EQUAL(snapshot->vEntries.size(), 1);
+    // An unchanged pool hands out the same snapshot
+    BOOST_CHECK(testPool.GetSnapshot() == snapshot);
+    BOOST_CHECK(testPool.GetSnapshot(txParent.GetHash()) == snapshot);
+
+    testPool.addUnchecked(txChild.GetHash(), entry.Fee(2000LL).FromTx(txChild));
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot2 = testPool.GetSnapshot();
+    BOOST_CHECK(snapshot2 != snapshot);
+    BOOST_CHECK_EQUAL(snapshot->vEntries.size(), 1);
+    BOOST_CHECK_EQUAL(snapshot2->vEntries.size(), 2);
+    // Sorted by depth and score
+    BOOST_CHECK(snapshot2->vEntries[0].entry.GetTx().GetHash() == txParent.GetHash());
+    const CTxMemPoolSnapshot::Entry* childEntry = snapshot2->find(txChild.GetHash());
+    BOOST_CHECK(childEntry != NULL);
+    BOOST_CHECK_EQUAL(childEntry->entry.GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(childEntry->vParents.size(), 1);
+    BOOST_CHECK(childEntry->vParents[0] == txParent.GetHash());
+
+    // Prioritisation changes are picked up, too
+    testPool.PrioritiseTransaction(txChild.GetHash(), txChild.GetHash().ToString(), 0, 500);
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot3 = testPool.GetSnapshot(txChild.GetHash());
+    BOOST_CHECK(snapshot3 != snapshot2);
+    BOOST_CHECK_EQUAL(snapshot3->find(txChild.GetHash())->entry.GetModifiedFee(), 2500LL);
+    BOOST_CHECK(snapshot3->find(txParent.GetHash()) == NULL);
+
+    // Older snapshots stay valid after the transactions leave the pool
+    testPool.removeRecursive(txParent);
+    BOOST_CHECK_EQUAL(testPool.GetSnapshot()->vEntries.size(), 0);
+    BOOST_CHECK(snapshot2->find(txChild.GetHash())->entry.GetTx().GetHash() == txChild.GetHash());
+
+    // The pool itself doesn't keep a snapshot (or its transactions) alive
+    std::weak_ptr<const CTxMemPoolSnapshot> weakSnapshot = snapshot2;
+    snapshot2.reset();
+    BOOST_CHECK(weakSnapshot.expired());
+    std::weak_ptr<const CTxMemPoolSnapshot> weakEmpty = testPool.GetSnapshot();
+    BOOST_CHECK(weakEmpty.expired());
+}
+
 template<typename name>
 void CheckSort(CTxMemPool &pool, std::vector<std::string> &sortedOrder)
 {
@@ -2,6 +2,8 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include "addrman.h"
+#include "arith_uint256.h"
+#include "bloom.h"
 #include "test/test_bitcoin.h"
 #include <string>
 #include <boost/test/unit_test.hpp>
@@ -9,6 +11,7 @@
 #include "serialize.h"
 #include "streams.h"
 #include "net.h"
+#include "net_processing.h"
 #include "netbase.h"
 #include "chainparams.h"
 
@@ -172,4 +175,307 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+BOOST_AUTO_TEST_CASE(cnode_memory_usage)
+{
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    std::unique_ptr<CNode> pnode(new CNode(0, NODE_NETWORK, 0, INVALID_SOCKET, addr, 0, 0, "", true));
+
+    // The rolling filters are allocated up front
+    size_t nUsage = pnode->GetMemoryUsage();
+    BOOST_CHECK(nUsage > 0);
+
+    // Queued announcements are counted
+    for (int i = 0; i < 100; i++)
+        pnode->PushInventory(CInv(MSG_TX, ArithToUint256(arith_uint256(i))));
+    size_t nUsageInv = pnode->GetMemoryUsage();
+    BOOST_CHECK(nUsageInv >= nUsage + 100 * sizeof(uint256));
+
+    // So are a loaded bloom filter and orphans
+    {
+        LOCK(pnode->cs_filter);
+        pnode->pfilter = new CBloomFilter(1000, 0.0001, 0, BLOOM_UPDATE_ALL);
+    }
+    size_t nUsageFilter = pnode->GetMemoryUsage();
+    BOOST_CHECK(nUsageFilter > nUsageInv);
+    pnode->nOrphanMemoryUsage = 1000;
+    BOOST_CHECK_EQUAL(pnode->GetMemoryUsage(), nUsageFilter + 1000);
+
+    // A payload shared with other peers is reported, not counted
+    std::shared_ptr<const CSharedNetMsgPayload> shared = std::make_shared<CSharedNetMsgPayload>(std::vector<unsigned char>(100000));
+    {
+        LOCK(pnode->cs_vSend);
+        pnode->vSendMsg.emplace_back(shared, 0);
+        pnode->nSendSize += shared->data.size();
+    }
+    std::set<const CSharedNetMsgPayload*> setShared;
+    BOOST_CHECK_EQUAL(pnode->GetMemoryUsage(&setShared), nUsageFilter + 1000 + memusage::MallocUsage(sizeof(CNetSendBuffer)));
+    BOOST_CHECK_EQUAL(setShared.size(), 1);
+    BOOST_CHECK(setShared.count(shared.get()));
+}
+
+BOOST_AUTO_TEST_CASE(cnetmessage_pooled_buffers)
+{
+    // A ping message, header and payload as they would come off the wire
+    uint64_t nonce = 0x0102030405060708ULL;
+    CDataStream payload(SER_NETWORK, PROTOCOL_VERSION);
+    payload << nonce;
+    CMessageHeader hdr(Params().MessageStart(), NetMsgType::PING, payload.size());
+    uint256 hash = Hash(payload.begin(), payload.end());
+    memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+    CDataStream wire(SER_NETWORK, PROTOCOL_VERSION);
+    wire << hdr << nonce;
+    BOOST_CHECK_EQUAL(wire.size(), (size_t)CMessageHeader::HEADER_SIZE + 8);
+
+    CNetRecvBufferPool pool;
+    for (int i = 0; i < 2; i++) {
+        // Feed it in pieces that split both the header and the payload
+        CNetMessage msg(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION);
+        BOOST_CHECK_EQUAL(msg.readHeader(&wire[0], 10), 10);
+        BOOST_CHECK(!msg.in_data);
+        BOOST_CHECK_EQUAL(msg.readHeader(&wire[10], wire.size() - 10), (int)CMessageHeader::HEADER_SIZE - 10);
+        BOOST_CHECK(msg.in_data);
+        BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), NetMsgType::PING);
+        BOOST_CHECK_EQUAL(msg.hdr.nMessageSize, 8U);
+
+        // The buffer of the first message is reused for the second
+        pool.Get(msg.vRecv, msg.hdr.nMessageSize);
+        BOOST_CHECK_EQUAL(pool.GetFreeCount(), 0U);
+
+        BOOST_CHECK_EQUAL(msg.readData(&wire[CMessageHeader::HEADER_SIZE], 3), 3);
+        BOOST_CHECK(!msg.complete());
+        BOOST_CHECK_EQUAL(msg.readData(&wire[CMessageHeader::HEADER_SIZE + 3], 5), 5);
+        BOOST_CHECK(msg.complete());
+        BOOST_CHECK(memcmp(msg.GetMessageHash().begin(), hdr.pchChecksum, CMessageHeader::CHECKSUM_SIZE) == 0);
+        uint64_t nonceRecv = 0;
+        msg.vRecv >> nonceRecv;
+        BOOST_CHECK_EQUAL(nonceRecv, nonce);
+
+        pool.Put(msg.vRecv);
+        BOOST_CHECK_EQUAL(pool.GetFreeCount(), 1U);
+        BOOST_CHECK(msg.vRecv.empty());
+    }
+
+    // Payloads too large for any size class are not pooled
+    CNetMessage msg(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION);
+    pool.Get(msg.vRecv, 1000 * 1000);
+    BOOST_CHECK_EQUAL(pool.GetFreeCount(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(cnethistogram_buckets)
+{
+    CNetHistogram hist;
+    hist.Add(0);
+    hist.Add(1);
+    hist.Add(3);
+    hist.Add(4);
+    hist.Add(1000);
+    BOOST_CHECK_EQUAL(hist.nCount, 5U);
+    BOOST_CHECK_EQUAL(hist.nSum, 1008U);
+    BOOST_CHECK_EQUAL(hist.nMax, 1000U);
+    BOOST_CHECK_EQUAL(hist.vBuckets[0], 1U); // 0
+    BOOST_CHECK_EQUAL(hist.vBuckets[1], 1U); // 1
+    BOOST_CHECK_EQUAL(hist.vBuckets[2], 1U); // 2..3
+    BOOST_CHECK_EQUAL(hist.vBuckets[3], 1U); // 4..7
+    BOOST_CHECK_EQUAL(hist.vBuckets[10], 1U); // 512..1023
+
+    // Values beyond the last bucket end up in it
+    hist.Add(std::numeric_limits<uint64_t>::max() / 2);
+    BOOST_CHECK_EQUAL(hist.vBuckets[CNetHistogram::NUM_BUCKETS - 1], 1U);
+
+    CNetMsgStats stats, total;
+    stats.mapCmdStats["ping"].nMsgsRecv = 2;
+    stats.histProcessTime = hist;
+    total.Merge(stats);
+    total.Merge(stats);
+    BOOST_CHECK_EQUAL(total.mapCmdStats["ping"].nMsgsRecv, 4U);
+    BOOST_CHECK_EQUAL(total.histProcessTime.nCount, 12U);
+    BOOST_CHECK_EQUAL(total.histProcessTime.vBuckets[10], 2U);
+    BOOST_CHECK_EQUAL(total.histProcessTime.nMax, hist.nMax);
+}
+
+BOOST_AUTO_TEST_CASE(cuploadscheduler_priority_and_fairness)
+{
+    const size_t UNLIMITED = std::numeric_limits<size_t>::max();
+
+    // Without rates, nothing is held back
+    CUploadScheduler unlimited;
+    BOOST_CHECK(!unlimited.IsLimited());
+    BOOST_CHECK(unlimited.AllowsImmediateSend(SEND_PRIORITY_HISTORICAL));
+    std::vector<std::pair<int, size_t> > vDemand;
+    vDemand.push_back(std::make_pair((int)SEND_PRIORITY_HISTORICAL, 5000));
+    vDemand.push_back(std::make_pair((int)SEND_PRIORITY_TX, 0));
+    std::vector<size_t> vAllowance = unlimited.Allocate(vDemand);
+    BOOST_CHECK(vAllowance[0] == UNLIMITED && vAllowance[1] == UNLIMITED);
+
+    // The most urgent class is served first, and shared fairly
+    CUploadScheduler scheduler;
+    scheduler.SetRate(10000);
+    BOOST_CHECK(scheduler.IsLimited());
+    BOOST_CHECK(scheduler.AllowsImmediateSend(SEND_PRIORITY_BLOCK));
+    BOOST_CHECK(scheduler.AllowsImmediateSend(SEND_PRIORITY_HEADERS));
+    BOOST_CHECK(!scheduler.AllowsImmediateSend(SEND_PRIORITY_TX));
+    scheduler.Refill(1000000);
+    vDemand.clear();
+    vDemand.push_back(std::make_pair((int)SEND_PRIORITY_HISTORICAL, 5000));
+    vDemand.push_back(std::make_pair((int)SEND_PRIORITY_TX, 3000));
+    vDemand.push_back(std::make_pair((int)SEND_PRIORITY_BLOCK, 8000));
+    vDemand.push_back(std::make_pair((int)SEND_PRIORITY_BLOCK, 4000));
+    vAllowance = scheduler.Allocate(vDemand);
+    BOOST_CHECK_EQUAL(vAllowance[0], 0U);
+    BOOST_CHECK_EQUAL(vAllowance[1], 0U);
+    BOOST_CHECK_EQUAL(vAllowance[2], 6000U);
+    BOOST_CHECK_EQUAL(vAllowance[3], 4000U);
+
+    size_t vSent[SEND_PRIORITY_COUNT] = {};
+    vSent[SEND_PRIORITY_BLOCK] = 10000;
+    scheduler.Consume(vSent);
+    BOOST_CHECK_EQUAL(scheduler.Allocate(vDemand)[3], 0U);
+
+    // Half a second earns half the rate, which flows to the lower classes
+    scheduler.Refill(1500000);
+    vDemand[2].second = vDemand[3].second = 0;
+    vAllowance = scheduler.Allocate(vDemand);
+    BOOST_CHECK_EQUAL(vAllowance[1], 3000U);
+    BOOST_CHECK_EQUAL(vAllowance[0], 2000U);
+
+    // A class rate caps its class on top of the node-wide rate
+    scheduler.SetClassRate(SEND_PRIORITY_HISTORICAL, true, 1000);
+    BOOST_CHECK(!scheduler.AllowsImmediateSend(SEND_PRIORITY_HISTORICAL));
+    vAllowance = scheduler.Allocate(vDemand);
+    BOOST_CHECK_EQUAL(vAllowance[1], 3000U);
+    BOOST_CHECK_EQUAL(vAllowance[0], 1000U);
+
+    // Urgent sends may run the buckets into debt, holding back everything until repaid
+    vSent[SEND_PRIORITY_BLOCK] = 20000;
+    scheduler.Consume(vSent);
+    scheduler.Refill(2500000);
+    vAllowance = scheduler.Allocate(vDemand);
+    BOOST_CHECK_EQUAL(vAllowance[0], 0U);
+    BOOST_CHECK_EQUAL(vAllowance[1], 0U);
+
+    BOOST_CHECK_EQUAL(GetSendPriority(NetMsgType::CMPCTBLOCK), SEND_PRIORITY_BLOCK);
+    BOOST_CHECK_EQUAL(GetSendPriority(NetMsgType::HEADERS), SEND_PRIORITY_HEADERS);
+    BOOST_CHECK_EQUAL(GetSendPriority(NetMsgType::TX), SEND_PRIORITY_TX);
+}
+
+static CTxRelayQueue::Entry TxRelayEntry(unsigned int n, uint64_t nCountWithAncestors, CAmount nFeePerK)
+{
+    CTxRelayQueue::Entry entry;
+    entry.txid = ArithToUint256(arith_uint256(n));
+    entry.nCountWithAncestors = nCountWithAncestors;
+    entry.feeRate = CFeeRate(nFeePerK);
+    return entry;
+}
+
+static std::vector<uint256> AnnounceTxRelay(CTxRelayQueue& queue, NodeId nodeid, unsigned int nMax, const std::vector<CTxRelayQueue::Entry>& vExtra = std::vector<CTxRelayQueue::Entry>())
+{
+    std::vector<uint256> vOffered;
+    queue.Announce(nodeid, vExtra, nMax, [&vOffered](const uint256& hash) {
+        vOffered.push_back(hash);
+        return true;
+    });
+    return vOffered;
+}
+
+BOOST_AUTO_TEST_CASE(txrelayqueue_ordering)
+{
+    CTxRelayQueue queue;
+    queue.Push(TxRelayEntry(1, 1, 1000)); // queued before the peer connected
+    queue.AddPeer(0);
+    queue.Push(TxRelayEntry(2, 2, 5000));
+    queue.Push(TxRelayEntry(3, 1, 1000));
+    queue.Push(TxRelayEntry(4, 1, 3000));
+    queue.Push(TxRelayEntry(5, 3, 9000));
+    std::vector<CTxRelayQueue::Entry> vExtra(1, TxRelayEntry(6, 1, 2000));
+
+    // Fewest ancestors first, then highest feerate
+    std::vector<uint256> vOffered = AnnounceTxRelay(queue, 0, 3, vExtra);
+    BOOST_CHECK(vOffered == std::vector<uint256>({TxRelayEntry(4, 0, 0).txid, TxRelayEntry(6, 0, 0).txid, TxRelayEntry(3, 0, 0).txid}));
+    // Entries are offered once; the rest follow on the next call
+    vOffered = AnnounceTxRelay(queue, 0, 10);
+    BOOST_CHECK(vOffered == std::vector<uint256>({TxRelayEntry(2, 0, 0).txid, TxRelayEntry(5, 0, 0).txid}));
+    BOOST_CHECK(AnnounceTxRelay(queue, 0, 10).empty());
+
+    // Only entries fAnnounce accepts count towards the limit
+    queue.Push(TxRelayEntry(7, 1, 1000));
+    queue.Push(TxRelayEntry(8, 1, 2000));
+    queue.Push(TxRelayEntry(9, 1, 3000));
+    unsigned int nCalls = 0;
+    queue.Announce(0, std::vector<CTxRelayQueue::Entry>(), 1, [&nCalls](const uint256& hash) {
+        nCalls++;
+        return hash == TxRelayEntry(8, 0, 0).txid;
+    });
+    BOOST_CHECK_EQUAL(nCalls, 2);
+    vOffered = AnnounceTxRelay(queue, 0, 10);
+    BOOST_CHECK(vOffered == std::vector<uint256>(1, TxRelayEntry(7, 0, 0).txid));
+}
+
+BOOST_AUTO_TEST_CASE(txrelayqueue_cursor_trimming)
+{
+    CTxRelayQueue queue;
+    queue.AddPeer(0);
+    queue.AddPeer(1);
+    for (unsigned int i = 0; i < 10; i++)
+        queue.Push(TxRelayEntry(i, 1, 1000 + i));
+    BOOST_CHECK_EQUAL(queue.size(), 10);
+
+    // Peer 0 takes the five best entries, which are the newest ones, so no
+    // entry can be dropped yet, and the peer pays one bit per entry it has
+    // been offered out of order
+    BOOST_CHECK_EQUAL(AnnounceTxRelay(queue, 0, 5).size(), 5);
+    BOOST_CHECK_EQUAL(queue.size(), 10);
+    BOOST_CHECK(queue.GetPeerMemoryUsage(0) > 0);
+    BOOST_CHECK_EQUAL(queue.GetPeerMemoryUsage(1), 0);
+    BOOST_CHECK_EQUAL(AnnounceTxRelay(queue, 0, 5).size(), 5);
+    BOOST_CHECK_EQUAL(queue.size(), 10);
+
+    // Entries go once every peer has moved past them
+    BOOST_CHECK_EQUAL(AnnounceTxRelay(queue, 1, 10).size(), 10);
+    BOOST_CHECK_EQUAL(queue.size(), 0);
+
+    queue.Push(TxRelayEntry(10, 1, 1000));
+    queue.SkipAll(1);
+    BOOST_CHECK_EQUAL(queue.size(), 1);
+    queue.RemovePeer(0);
+    BOOST_CHECK_EQUAL(queue.size(), 0);
+
+    // New peers are not offered what was queued before they connected
+    queue.Push(TxRelayEntry(11, 1, 1000));
+    queue.AddPeer(2);
+    BOOST_CHECK(AnnounceTxRelay(queue, 2, 10).empty());
+    BOOST_CHECK_EQUAL(AnnounceTxRelay(queue, 1, 10).size(), 1);
+    BOOST_CHECK_EQUAL(queue.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(txrelayqueue_overflow)
+{
+    CTxRelayQueue queue(10);
+    queue.AddPeer(0);
+    queue.AddPeer(1);
+    for (unsigned int i = 0; i < 4; i++)
+        queue.Push(TxRelayEntry(i, 1, 1000 + i));
+    // Peer 0 is offered the best entry, 3, before the queue overflows
+    BOOST_CHECK(AnnounceTxRelay(queue, 0, 1) == std::vector<uint256>(1, TxRelayEntry(3, 0, 0).txid));
+    for (unsigned int i = 4; i < 15; i++)
+        queue.Push(TxRelayEntry(i, 1, 1000 - i));
+    BOOST_CHECK_EQUAL(queue.size(), 10);
+
+    // Both peers skip the five entries dropped from the front
+    std::vector<uint256> vOffered = AnnounceTxRelay(queue, 1, 100);
+    BOOST_CHECK_EQUAL(vOffered.size(), 10);
+    for (unsigned int i = 0; i < 10; i++)
+        BOOST_CHECK(vOffered[i] == TxRelayEntry(5 + i, 0, 0).txid);
+    BOOST_CHECK_EQUAL(AnnounceTxRelay(queue, 0, 100).size(), 10);
+    BOOST_CHECK_EQUAL(queue.size(), 0);
+
+    // The default limit matches MAX_TX_RELAY_QUEUE_SIZE
+    CTxRelayQueue queueDefault;
+    queueDefault.AddPeer(0);
+    for (unsigned int i = 0; i <= MAX_TX_RELAY_QUEUE_SIZE; i++)
+        queueDefault.Push(TxRelayEntry(i, 1, 1000));
+    BOOST_CHECK_EQUAL(queueDefault.size(), (size_t)MAX_TX_RELAY_QUEUE_SIZE);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -195,6 +195,20 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
         BOOST_CHECK(mpool.estimateSmartFee(i).GetFeePerK() >= mpool.GetMinFee(1).GetFeePerK());
         BOOST_CHECK(mpool.estimateSmartPriority(i) == INF_PRIORITY);
     }
+
+    // Batched estimates should match the individual ones, including for
+    // targets outside the tracked range
+    std::vector<int> targets;
+    for (int i = -1; i <= (int)MAX_BLOCK_CONFIRMS + 1; i++)
+        targets.push_back(i);
+    std::vector<int> answersFound;
+    std::vector<CFeeRate> feeRates = mpool.estimateSmartFees(targets, answersFound);
+    BOOST_CHECK_EQUAL(feeRates.size(), targets.size());
+    BOOST_CHECK_EQUAL(answersFound.size(), targets.size());
+    for (unsigned int i = 0; i < targets.size(); i++) {
+        BOOST_CHECK(feeRates[i] == mpool.estimateSmartFee(targets[i], &answerFound));
+        BOOST_CHECK_EQUAL(answersFound[i], answerFound);
+    }
 }
 
 BOOST_AUTO_TEST_SUITE_END()
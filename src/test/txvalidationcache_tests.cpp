@@ -5,6 +5,7 @@
 #include "consensus/validation.h"
 #include "key.h"
 #include "validation.h"
+#include "validationinterface.h"
 #include "miner.h"
 #include "pubkey.h"
 #include "txmempool.h"
@@ -84,4 +85,112 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+static CMutableTransaction
+SignedSpend(const CTransaction& prev, const CKey& key, const CScript& scriptPubKey, CAmount nValue)
+{
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(1);
+    spend.vin[0].prevout.hash = prev.GetHash();
+    spend.vin[0].prevout.n = 0;
+    spend.vout.resize(1);
+    spend.vout[0].nValue = nValue;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(prev.vout[0].scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+    return spend;
+}
+
+struct SyncTransactionCounter : public CValidationInterface
+{
+    int nCount;
+    SyncTransactionCounter() : nCount(0) {}
+    void SyncTransaction(const CTransaction& tx, const CBlockIndex* pindex, int posInBlock) { nCount++; }
+};
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_package_accept, TestChain100Setup)
+{
+    // A parent paying no fee can only get in if its child pays for both.
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CTransactionRef parent = MakeTransactionRef(SignedSpend(coinbaseTxns[0], coinbaseKey, scriptPubKey, coinbaseTxns[0].vout[0].nValue));
+    CTransactionRef child = MakeTransactionRef(SignedSpend(*parent, coinbaseKey, scriptPubKey, parent->vout[0].nValue - CENT));
+    CTransactionRef unrelated = MakeTransactionRef(SignedSpend(coinbaseTxns[1], coinbaseKey, scriptPubKey, coinbaseTxns[1].vout[0].nValue - CENT));
+
+    LOCK(cs_main);
+    CValidationState state;
+
+    std::vector<CTransactionRef> package;
+    package.push_back(parent);
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, package));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package fee not met");
+
+    state = CValidationState();
+    package.insert(package.begin(), child);
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, package));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package-not-sorted");
+
+    state = CValidationState();
+    package.assign(1, parent);
+    package.push_back(unrelated);
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, package));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package-not-connected");
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+
+    // A parent can't pay for a child that doesn't pay enough itself
+    CTransactionRef richParent = MakeTransactionRef(SignedSpend(coinbaseTxns[0], coinbaseKey, scriptPubKey, coinbaseTxns[0].vout[0].nValue - CENT));
+    CTransactionRef freeChild = MakeTransactionRef(SignedSpend(*richParent, coinbaseKey, scriptPubKey, richParent->vout[0].nValue));
+    state = CValidationState();
+    package.assign(1, richParent);
+    package.push_back(freeChild);
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, package));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package fee not met");
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+
+    SyncTransactionCounter counter;
+    RegisterValidationInterface(&counter);
+
+    // The child's signature is only checked once the parent is already in
+    // the mempool; the parent must be taken out again, unannounced.
+    CKey otherKey;
+    otherKey.MakeNewKey(true);
+    CTransactionRef badChild = MakeTransactionRef(SignedSpend(*parent, otherKey, scriptPubKey, parent->vout[0].nValue - CENT));
+    state = CValidationState();
+    package.assign(1, parent);
+    package.push_back(badChild);
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, package));
+    BOOST_CHECK(state.IsInvalid());
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+    BOOST_CHECK_EQUAL(counter.nCount, 0);
+
+    state = CValidationState();
+    package.assign(1, parent);
+    package.push_back(child);
+    BOOST_CHECK(AcceptPackageToMemoryPool(mempool, state, package));
+    BOOST_CHECK(mempool.exists(parent->GetHash()));
+    BOOST_CHECK(mempool.exists(child->GetHash()));
+    BOOST_CHECK_EQUAL(counter.nCount, 2);
+
+    // Resubmitting is fine; members already in the mempool are skipped
+    BOOST_CHECK(AcceptPackageToMemoryPool(mempool, state, package));
+    BOOST_CHECK_EQUAL(mempool.size(), 2);
+    BOOST_CHECK_EQUAL(counter.nCount, 2);
+    UnregisterValidationInterface(&counter);
+
+    // Packages can't replace mempool transactions
+    CTransactionRef conflictChild = MakeTransactionRef(SignedSpend(*richParent, coinbaseKey, scriptPubKey, richParent->vout[0].nValue - 10 * CENT));
+    state = CValidationState();
+    package.assign(1, richParent);
+    package.push_back(conflictChild);
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, package));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package-mempool-conflict");
+    BOOST_CHECK(mempool.exists(parent->GetHash()));
+    BOOST_CHECK(!mempool.exists(richParent->GetHash()));
+    BOOST_CHECK_EQUAL(mempool.size(), 2);
+    mempool.clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -20,6 +20,7 @@ static const char DB_TXINDEX = 't';
 static const char DB_BLOCK_INDEX = 'b';
 
 static const char DB_BEST_BLOCK = 'B';
+static const char DB_HEAD_BLOCKS = 'H';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
@@ -44,10 +45,44 @@ uint256 CCoinsViewDB::GetBestBlock() const {
     return hashBestChain;
 }
 
+std::vector<uint256> CCoinsViewDB::GetHeadBlocks() const {
+    std::vector<uint256> vhashHeadBlocks;
+    if (!db.Read(DB_HEAD_BLOCKS, vhashHeadBlocks))
+        return std::vector<uint256>();
+    return vhashHeadBlocks;
+}
+
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
+    size_t nBatchSize = (size_t)std::max<int64_t>(1, GetArg("-dbbatchsize", nDefaultDbBatchSize));
+    // Testing only: give up after this many partial batches, as a crash would
+    int64_t nCrashBatches = GetArg("-dbcrashbatches", 0);
+    int64_t nPartialBatches = 0;
+
+    // Large flushes are written in several batches. While they are, the
+    // database is marked as being between the old and the new best block,
+    // so that after a crash the blocks in between can be replayed on top of
+    // whatever had made it to disk (see ReplayBlocks). A flush without a
+    // best block has nothing to replay to, and is written in one go.
+    const bool fChunked = !hashBlock.IsNull();
+    if (fChunked) {
+        uint256 hashOldTip = GetBestBlock();
+        if (hashOldTip.IsNull()) {
+            // We may be finishing an interrupted flush
+            std::vector<uint256> vhashOldHeads = GetHeadBlocks();
+            if (vhashOldHeads.size() == 2) {
+                if (vhashOldHeads[0] != hashBlock)
+                    return error("%s: the coin database is between blocks %s and %s, not ending at %s; rebuild it using -reindex-chainstate",
+                                 __func__, vhashOldHeads[1].ToString(), vhashOldHeads[0].ToString(), hashBlock.ToString());
+                hashOldTip = vhashOldHeads[1];
+            }
+        }
+        batch.Erase(DB_BEST_BLOCK);
+        batch.Write(DB_HEAD_BLOCKS, std::vector<uint256>{hashBlock, hashOldTip});
+    }
+
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
             if (it->second.coins.IsPruned())
@@ -59,9 +94,19 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
         count++;
         CCoinsMap::iterator itOld = it++;
         mapCoins.erase(itOld);
+        if (fChunked && batch.SizeEstimate() > nBatchSize) {
+            LogPrint("coindb", "Writing partial batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
+            if (!db.WriteBatch(batch))
+                return false;
+            batch.Clear();
+            if (nCrashBatches > 0 && ++nPartialBatches >= nCrashBatches)
+                return error("%s: simulating a crash after %d partial batches", __func__, nPartialBatches);
+        }
     }
-    if (!hashBlock.IsNull())
+    if (fChunked) {
+        batch.Erase(DB_HEAD_BLOCKS);
         batch.Write(DB_BEST_BLOCK, hashBlock);
+    }
 
     LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
@@ -129,6 +129,7 @@ void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendan
 void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashesToUpdate)
 {
     LOCK(cs);
+    cachedSnapshot.reset();
     // For each entry in vHashesToUpdate, store the set of in-mempool, but not
     // in-vHashesToUpdate transactions, so that we don't have to recalculate
     // descendants when we come across a previously seen entry.
@@ -282,15 +283,34 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
         // Here we only update statistics and not data in mapLinks (which
         // we need to preserve until we're finished with all operations that
         // need to traverse the mempool).
+        // Walk the descendants of the whole staged set once, then give each
+        // descendant that stays in the mempool a single ancestor state update
+        // covering all of its ancestors being removed. Entries that are
+        // themselves being removed don't need their state updated.
+        setEntries setDescendants;
         BOOST_FOREACH(txiter removeIt, entriesToRemove) {
-            setEntries setDescendants;
             CalculateDescendants(removeIt, setDescendants);
-            setDescendants.erase(removeIt); // don't update state for self
-            int64_t modifySize = -((int64_t)removeIt->GetTxSize());
-            CAmount modifyFee = -removeIt->GetModifiedFee();
-            int modifySigOps = -removeIt->GetSigOpCost();
-            BOOST_FOREACH(txiter dit, setDescendants) {
-                mapTx.modify(dit, update_ancestor_state(modifySize, modifyFee, -1, modifySigOps));
+        }
+        BOOST_FOREACH(txiter dit, setDescendants) {
+            if (entriesToRemove.count(dit))
+                continue;
+            setEntries setAncestors;
+            std::string dummy;
+            CalculateMemPoolAncestors(*dit, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            int64_t modifySize = 0;
+            CAmount modifyFee = 0;
+            int64_t modifyCount = 0;
+            int modifySigOps = 0;
+            BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+                if (entriesToRemove.count(ancestorIt)) {
+                    modifySize -= ancestorIt->GetTxSize();
+                    modifyFee -= ancestorIt->GetModifiedFee();
+                    modifySigOps -= ancestorIt->GetSigOpCost();
+                    modifyCount--;
+                }
+            }
+            if (modifyCount != 0) {
+                mapTx.modify(dit, update_ancestor_state(modifySize, modifyFee, modifyCount, modifySigOps));
             }
         }
     }
@@ -592,32 +612,53 @@ void CTxMemPool::removeConflicts(const CTransaction &tx)
 
 /**
  * Called when a block is connected. Removes from mempool and updates the miner fee estimator.
+ *
+ * All in-block entries are staged and removed together, so descendant and
+ * ancestor state is updated once per affected cluster rather than once per
+ * confirmed transaction. Conflicts are then gathered for the whole block and
+ * removed in a single pass as well.
  */
 void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigned int nBlockHeight)
 {
     LOCK(cs);
     std::vector<const CTxMemPoolEntry*> entries;
+    setEntries stage;
     for (const auto& tx : vtx)
     {
         uint256 hash = tx->GetHash();
 
         indexed_transaction_set::iterator i = mapTx.find(hash);
-        if (i != mapTx.end())
+        if (i != mapTx.end()) {
             entries.push_back(&*i);
+            stage.insert(i);
+        }
     }
     // Before the txs in the new block have been removed from the mempool, update policy estimates
     minerPolicyEstimator->processBlock(nBlockHeight, entries);
+    RemoveStaged(stage, true, MemPoolRemovalReason::BLOCK);
+
+    // With the block's own transactions gone, anything left in mapNextTx
+    // that spends one of the block's inputs is a conflict.
+    setEntries setConflicts;
     for (const auto& tx : vtx)
     {
-        txiter it = mapTx.find(tx->GetHash());
-        if (it != mapTx.end()) {
-            setEntries stage;
-            stage.insert(it);
-            RemoveStaged(stage, true, MemPoolRemovalReason::BLOCK);
+        BOOST_FOREACH(const CTxIn &txin, tx->vin) {
+            auto it = mapNextTx.find(txin.prevout);
+            if (it != mapNextTx.end()) {
+                const CTransaction &txConflict = *it->second;
+                if (txConflict != *tx)
+                {
+                    ClearPrioritisation(txConflict.GetHash());
+                    txiter conflictIt = mapTx.find(txConflict.GetHash());
+                    assert(conflictIt != mapTx.end());
+                    CalculateDescendants(conflictIt, setConflicts);
+                }
+            }
         }
-        removeConflicts(*tx);
         ClearPrioritisation(tx->GetHash());
     }
+    RemoveStaged(setConflicts, false, MemPoolRemovalReason::CONFLICT);
+
     lastRollingFeeUpdate = GetTime();
     blockSinceLastRollingFeeBump = true;
 }
@@ -632,6 +673,7 @@ void CTxMemPool::_clear()
     lastRollingFeeUpdate = GetTime();
     blockSinceLastRollingFeeBump = false;
     rollingMinimumFeeRate = 0;
+    cachedSnapshot.reset();
     ++nTransactionsUpdated;
 }
 
@@ -786,6 +828,16 @@ bool CTxMemPool::CompareDepthAndScore(const uint256& hasha, const uint256& hashb
     return counta < countb;
 }
 
+bool CTxMemPool::GetDepthAndScore(const uint256& hash, uint64_t& nCountWithAncestors, CFeeRate& feeRate) const
+{
+    LOCK(cs);
+    indexed_transaction_set::const_iterator i = mapTx.find(hash);
+    if (i == mapTx.end()) return false;
+    nCountWithAncestors = i->GetCountWithAncestors();
+    feeRate = CFeeRate(i->GetModifiedFee(), i->GetTxSize());
+    return true;
+}
+
 namespace {
 class DepthAndScoreComparator
 {
@@ -829,8 +881,8 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
     }
 }
 
-static TxMempoolInfo GetInfo(CTxMemPool::indexed_transaction_set::const_iterator it) {
-    return TxMempoolInfo{it->GetSharedTx(), it->GetTime(), CFeeRate(it->GetFee(), it->GetTxSize()), it->GetModifiedFee() - it->GetFee()};
+static TxMempoolInfo GetInfo(const CTxMemPoolEntry& entry) {
+    return TxMempoolInfo{entry.GetSharedTx(), entry.GetTime(), CFeeRate(entry.GetFee(), entry.GetTxSize()), entry.GetModifiedFee() - entry.GetFee()};
 }
 
 std::vector<TxMempoolInfo> CTxMemPool::infoAll() const
@@ -841,12 +893,59 @@ std::vector<TxMempoolInfo> CTxMemPool::infoAll() const
     std::vector<TxMempoolInfo> ret;
     ret.reserve(mapTx.size());
     for (auto it : iters) {
-        ret.push_back(GetInfo(it));
+        ret.push_back(GetInfo(*it));
     }
 
     return ret;
 }
 
+static void AddSnapshotEntry(CTxMemPoolSnapshot& snapshot, const CTxMemPoolEntry& entry, const CTxMemPool::setEntries& setParents)
+{
+    snapshot.mapIndex.emplace(entry.GetTx().GetHash(), snapshot.vEntries.size());
+    snapshot.vEntries.emplace_back(entry);
+    std::vector<uint256>& vParents = snapshot.vEntries.back().vParents;
+    vParents.reserve(setParents.size());
+    for (CTxMemPool::txiter parentIt : setParents) {
+        vParents.push_back(parentIt->GetTx().GetHash());
+    }
+}
+
+std::shared_ptr<const CTxMemPoolSnapshot> CTxMemPool::GetSnapshot() const
+{
+    LOCK(cs);
+    std::shared_ptr<const CTxMemPoolSnapshot> cached = cachedSnapshot.lock();
+    if (cached && cached->nTransactionsUpdated == nTransactionsUpdated)
+        return cached;
+
+    std::shared_ptr<CTxMemPoolSnapshot> snapshot = std::make_shared<CTxMemPoolSnapshot>();
+    snapshot->nTransactionsUpdated = nTransactionsUpdated;
+    auto iters = GetSortedDepthAndScore();
+    snapshot->vEntries.reserve(iters.size());
+    snapshot->mapIndex.reserve(iters.size());
+    for (auto it : iters) {
+        AddSnapshotEntry(*snapshot, *it, GetMemPoolParents(it));
+    }
+
+    cachedSnapshot = snapshot;
+    return snapshot;
+}
+
+std::shared_ptr<const CTxMemPoolSnapshot> CTxMemPool::GetSnapshot(const uint256& hash) const
+{
+    LOCK(cs);
+    std::shared_ptr<const CTxMemPoolSnapshot> cached = cachedSnapshot.lock();
+    if (cached && cached->nTransactionsUpdated == nTransactionsUpdated)
+        return cached;
+
+    std::shared_ptr<CTxMemPoolSnapshot> snapshot = std::make_shared<CTxMemPoolSnapshot>();
+    snapshot->nTransactionsUpdated = nTransactionsUpdated;
+    indexed_transaction_set::const_iterator it = mapTx.find(hash);
+    if (it != mapTx.end()) {
+        AddSnapshotEntry(*snapshot, *it, GetMemPoolParents(it));
+    }
+    return snapshot;
+}
+
 CTransactionRef CTxMemPool::get(const uint256& hash) const
 {
     LOCK(cs);
@@ -862,7 +961,7 @@ TxMempoolInfo CTxMemPool::info(const uint256& hash) const
     indexed_transaction_set::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end())
         return TxMempoolInfo();
-    return GetInfo(i);
+    return GetInfo(*i);
 }
 
 CFeeRate CTxMemPool::estimateFee(int nBlocks) const
@@ -875,6 +974,11 @@ CFeeRate CTxMemPool::estimateSmartFee(int nBlocks, int *answerFoundAtBlocks) con
     LOCK(cs);
     return minerPolicyEstimator->estimateSmartFee(nBlocks, answerFoundAtBlocks, *this);
 }
+std::vector<CFeeRate> CTxMemPool::estimateSmartFees(const std::vector<int>& vBlocks, std::vector<int>& answersFoundAtBlocks) const
+{
+    LOCK(cs);
+    return minerPolicyEstimator->estimateSmartFees(vBlocks, answersFoundAtBlocks, *this);
+}
 double CTxMemPool::estimatePriority(int nBlocks) const
 {
     LOCK(cs);
@@ -929,6 +1033,9 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const std::string str
         deltas.second += nFeeDelta;
         txiter it = mapTx.find(hash);
         if (it != mapTx.end()) {
+            // Fee deltas don't bump nTransactionsUpdated, so drop any cached
+            // snapshot explicitly.
+            cachedSnapshot.reset();
             mapTx.modify(it, update_fee_delta(deltas.second));
             // Now update all ancestors' modified fees with descendants
             setEntries setAncestors;
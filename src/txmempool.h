@@ -9,6 +9,7 @@
 #include <memory>
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <utility>
 #include <string>
@@ -335,6 +336,46 @@ struct TxMempoolInfo
     int64_t nFeeDelta;
 };
 
+/**
+ * A consistent, read-only copy of the mempool as of one point in time.
+ *
+ * Snapshots are handed out as shared pointers by CTxMemPool::GetSnapshot()
+ * and can be walked without holding CTxMemPool::cs, so slow consumers (such
+ * as verbose RPC dumps) don't block transaction acceptance. The pool
+ * remembers the most recent full snapshot and hands it to every caller until
+ * the pool changes, so concurrent readers share a single copy. It only holds
+ * a weak reference, so a snapshot (and the transactions in it) is freed as
+ * soon as the last reader drops it.
+ */
+class CTxMemPoolSnapshot
+{
+public:
+    struct Entry
+    {
+        CTxMemPoolEntry entry;
+        //! Hashes of the entry's in-mempool parents
+        std::vector<uint256> vParents;
+
+        Entry(const CTxMemPoolEntry& _entry) : entry(_entry) {}
+    };
+
+    //! Entries, sorted by depth and score like CTxMemPool::queryHashes()
+    std::vector<Entry> vEntries;
+    //! Index of every txid in vEntries
+    std::unordered_map<uint256, size_t, SaltedTxidHasher> mapIndex;
+    //! CTxMemPool::GetTransactionsUpdated() at the time the snapshot was taken
+    unsigned int nTransactionsUpdated;
+
+    CTxMemPoolSnapshot() : nTransactionsUpdated(0) {}
+
+    /** Return the entry for hash, or NULL if it wasn't in the snapshot */
+    const Entry* find(const uint256& hash) const
+    {
+        auto it = mapIndex.find(hash);
+        return it == mapIndex.end() ? NULL : &vEntries[it->second];
+    }
+};
+
 /** Reason why a transaction was removed from the mempool,
  * this is passed to the notification signal.
  */
@@ -442,6 +483,8 @@ private:
     mutable bool blockSinceLastRollingFeeBump;
     mutable double rollingMinimumFeeRate; //!< minimum fee to get into the pool, decreases exponentially
 
+    mutable std::weak_ptr<const CTxMemPoolSnapshot> cachedSnapshot; //!< last full snapshot handed out by GetSnapshot(), while a caller still holds it
+
     void trackPackageRemoved(const CFeeRate& rate);
 
 public:
@@ -544,6 +587,8 @@ public:
     void clear();
     void _clear(); //lock free
     bool CompareDepthAndScore(const uint256& hasha, const uint256& hashb);
+    /** Fetch the ancestor count and modified feerate CompareDepthAndScore orders by. Returns false if hash is not in the mempool. */
+    bool GetDepthAndScore(const uint256& hash, uint64_t& nCountWithAncestors, CFeeRate& feeRate) const;
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
@@ -639,12 +684,24 @@ public:
     TxMempoolInfo info(const uint256& hash) const;
     std::vector<TxMempoolInfo> infoAll() const;
 
+    /** Return a consistent snapshot of the whole mempool, which may be used
+     *  without holding cs. The snapshot is only rebuilt when the pool has
+     *  changed since the last call. */
+    std::shared_ptr<const CTxMemPoolSnapshot> GetSnapshot() const;
+    /** Return a snapshot that contains at least hash's entry, if it is in the
+     *  mempool. Uses the full snapshot if that is still current, and otherwise
+     *  copies only the one entry. */
+    std::shared_ptr<const CTxMemPoolSnapshot> GetSnapshot(const uint256& hash) const;
+
     /** Estimate fee rate needed to get into the next nBlocks
      *  If no answer can be given at nBlocks, return an estimate
      *  at the lowest number of blocks where one can be given
      */
     CFeeRate estimateSmartFee(int nBlocks, int *answerFoundAtBlocks = NULL) const;
 
+    /** estimateSmartFee for several targets under a single lock */
+    std::vector<CFeeRate> estimateSmartFees(const std::vector<int>& vBlocks, std::vector<int>& answersFoundAtBlocks) const;
+
     /** Estimate fee rate needed to get into the next nBlocks */
     CFeeRate estimateFee(int nBlocks) const;
 
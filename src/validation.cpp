@@ -148,6 +148,12 @@ namespace {
     int32_t nBlockSequenceId = 1;
     /** Decreasing counter (used by subsequent preciousblock calls). */
     int32_t nBlockReverseSequenceId = -1;
+
+    /**
+     * Serializes ActivateBestChain callers (the block validation thread, the
+     * message handler threads, RPC). Always taken before cs_main.
+     */
+    CCriticalSection cs_activateBestChain;
     /** chainwork for the last block that preciousblock has been applied to. */
     arith_uint256 nLastPreciousChainwork = 0;
 
@@ -163,7 +169,7 @@ namespace {
  * object goes out of scope. This is currently only used to call SyncTransaction
  * on conflicts removed from the mempool during block connection.  Applied in
  * ActivateBestChain around ActivateBestStep which in turn calls:
- * ConnectTip->removeForBlock->removeConflicts
+ * ConnectTip->removeForBlock
  */
 class MemPoolConflictRemovalTracker
 {
@@ -210,6 +216,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 enum FlushStateMode {
@@ -600,7 +607,8 @@ static bool IsCurrentForFeeEstimation()
 
 bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx, bool fLimitFree,
                               bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced,
-                              bool fOverrideMempoolLimit, const CAmount& nAbsurdFee, std::vector<uint256>& vHashTxnToUncache)
+                              bool fOverrideMempoolLimit, const CAmount& nAbsurdFee, std::vector<uint256>& vHashTxnToUncache,
+                              bool fPackageMember = false)
 {
     const CTransaction& tx = *ptx;
     const uint256 hash = tx.GetHash();
@@ -778,12 +786,16 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
             return state.DoS(0, false, REJECT_NONSTANDARD, "bad-txns-too-many-sigops", false,
                 strprintf("%d", nSigOpsCost));
 
-        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
-        if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee) {
-            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool min fee not met", false, strprintf("%d < %d", nFees, mempoolRejectFee));
-        } else if (GetBoolArg("-relaypriority", DEFAULT_RELAYPRIORITY) && nModifiedFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(entry.GetPriority(chainActive.Height() + 1))) {
-            // Require that free transactions have sufficient priority to be mined in the next block.
-            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
+        // Members of a package had their feerates checked against these
+        // limits by AcceptPackageToMemoryPool already.
+        if (!fPackageMember) {
+            CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+            if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee) {
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool min fee not met", false, strprintf("%d < %d", nFees, mempoolRejectFee));
+            } else if (GetBoolArg("-relaypriority", DEFAULT_RELAYPRIORITY) && nModifiedFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(entry.GetPriority(chainActive.Height() + 1))) {
+                // Require that free transactions have sufficient priority to be mined in the next block.
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
+            }
         }
 
         // Continuously rate-limit free (really, very-low-fee) transactions
@@ -1020,9 +1032,9 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
 
         // This transaction should only count for fee estimation if it isn't a
         // BIP 125 replacement transaction (may not be widely supported), the
-        // node is not behind, and the transaction is not dependent on any other
-        // transactions in the mempool.
-        bool validForFeeEstimation = !fReplacementTransaction && IsCurrentForFeeEstimation() && pool.HasNoInputsOf(tx);
+        // node is not behind, the transaction is not dependent on any other
+        // transactions in the mempool, and it wasn't paid for by a package.
+        bool validForFeeEstimation = !fReplacementTransaction && !fPackageMember && IsCurrentForFeeEstimation() && pool.HasNoInputsOf(tx);
 
         // Store transaction in memory
         pool.addUnchecked(hash, entry, setAncestors, validForFeeEstimation);
@@ -1035,7 +1047,10 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         }
     }
 
-    GetMainSignals().SyncTransaction(tx, NULL, CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
+    // Package members are announced by AcceptPackageToMemoryPool once the
+    // whole package is in.
+    if (!fPackageMember)
+        GetMainSignals().SyncTransaction(tx, NULL, CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
 
     return true;
 }
@@ -1063,6 +1078,175 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), plTxnReplaced, fOverrideMempoolLimit, nAbsurdFee);
 }
 
+bool AcceptPackageToMemoryPool(CTxMemPool& pool, CValidationState &state, const std::vector<CTransactionRef>& package,
+                               const CAmount nAbsurdFee)
+{
+    AssertLockHeld(cs_main);
+    if (package.empty() || package.size() > MAX_PACKAGE_COUNT)
+        return state.DoS(0, false, REJECT_NONSTANDARD, "package-bad-size", false,
+                         strprintf("%u transactions [limit: %u]", package.size(), MAX_PACKAGE_COUNT));
+
+    // Parents must come before their children, and every transaction must
+    // spend or be spent by another one in the package. Packages are for
+    // children paying for their parents, not for bundling unrelated low fee
+    // transactions with a high fee one.
+    std::map<uint256, size_t> mapPackagePos;
+    for (size_t i = 0; i < package.size(); i++) {
+        if (!mapPackagePos.emplace(package[i]->GetHash(), i).second)
+            return state.DoS(0, false, REJECT_INVALID, "package-duplicate-tx");
+    }
+    std::vector<bool> vLinked(package.size(), package.size() == 1);
+    for (size_t i = 0; i < package.size(); i++) {
+        BOOST_FOREACH(const CTxIn& txin, package[i]->vin) {
+            auto itParent = mapPackagePos.find(txin.prevout.hash);
+            if (itParent == mapPackagePos.end())
+                continue;
+            if (itParent->second >= i)
+                return state.DoS(0, false, REJECT_INVALID, "package-not-sorted");
+            vLinked[i] = true;
+            vLinked[itParent->second] = true;
+        }
+    }
+    for (size_t i = 0; i < package.size(); i++) {
+        if (!vLinked[i])
+            return state.DoS(0, false, REJECT_NONSTANDARD, "package-not-connected", false,
+                             strprintf("%s is unrelated to the rest of the package", package[i]->GetHash().ToString()));
+    }
+
+    // Work out the fees and size of the package members that aren't in the
+    // mempool yet, using a view that layers each member's outputs on top of
+    // the chain and mempool so children can see their parents. Members that
+    // conflict with the mempool are refused: replacing transactions can't be
+    // undone if a later member fails.
+    std::vector<uint256> vHashTxToUncache;
+    std::vector<CAmount> vFees(package.size(), 0);
+    std::vector<size_t> vSize(package.size(), 0);
+    std::vector<bool> vNew(package.size(), false);
+    {
+        CCoinsView dummy;
+        CCoinsViewCache view(&dummy);
+        LOCK(pool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        view.SetBackend(viewMemPool);
+        for (size_t i = 0; i < package.size(); i++) {
+            const CTransaction& tx = *package[i];
+            if (pool.exists(tx.GetHash()))
+                continue;
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                if (!pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
+                    vHashTxToUncache.push_back(txin.prevout.hash);
+            }
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                if (pool.mapNextTx.count(txin.prevout)) {
+                    BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
+                        pcoinsTip->Uncache(hashTx);
+                    return state.Invalid(false, REJECT_CONFLICT, "package-mempool-conflict", tx.GetHash().ToString());
+                }
+            }
+            if (tx.IsCoinBase() || !view.HaveInputs(tx)) {
+                BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
+                    pcoinsTip->Uncache(hashTx);
+                return state.Invalid(false, REJECT_INVALID, "package-missing-inputs", tx.GetHash().ToString());
+            }
+            CAmount nModifiedFees = view.GetValueIn(tx) - tx.GetValueOut();
+            double nPriorityDummy = 0;
+            pool.ApplyDeltas(tx.GetHash(), nPriorityDummy, nModifiedFees);
+            vFees[i] = nModifiedFees;
+            vSize[i] = GetVirtualTransactionSize(tx);
+            vNew[i] = true;
+            UpdateCoins(tx, view, MEMPOOL_HEIGHT);
+        }
+        view.SetBackend(dummy);
+    }
+
+    // Every new member has to meet the mempool minimum and relay fees, either
+    // on its own or as an ancestor of a member whose feerate together with
+    // its new in-package ancestors meets them. So a child can pay for its
+    // parents, but a parent can't carry a low fee child.
+    CFeeRate mempoolMinFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+    std::vector<std::set<size_t> > vAncestors(package.size());
+    std::vector<bool> vPaidFor(package.size(), false);
+    for (size_t i = 0; i < package.size(); i++) {
+        if (!vNew[i])
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, package[i]->vin) {
+            auto itParent = mapPackagePos.find(txin.prevout.hash);
+            if (itParent == mapPackagePos.end() || !vNew[itParent->second])
+                continue;
+            vAncestors[i].insert(itParent->second);
+            vAncestors[i].insert(vAncestors[itParent->second].begin(), vAncestors[itParent->second].end());
+        }
+        if (vFees[i] < std::max(mempoolMinFee.GetFee(vSize[i]), ::minRelayTxFee.GetFee(vSize[i])))
+            continue;
+        vPaidFor[i] = true;
+        CAmount nAncestorFees = vFees[i];
+        size_t nAncestorSize = vSize[i];
+        BOOST_FOREACH(size_t j, vAncestors[i]) {
+            nAncestorFees += vFees[j];
+            nAncestorSize += vSize[j];
+        }
+        if (nAncestorFees >= std::max(mempoolMinFee.GetFee(nAncestorSize), ::minRelayTxFee.GetFee(nAncestorSize))) {
+            BOOST_FOREACH(size_t j, vAncestors[i])
+                vPaidFor[j] = true;
+        }
+    }
+    for (size_t i = 0; i < package.size(); i++) {
+        if (vNew[i] && !vPaidFor[i]) {
+            BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
+                pcoinsTip->Uncache(hashTx);
+            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "package fee not met", false,
+                             strprintf("%s pays %d for %u bytes", package[i]->GetHash().ToString(), vFees[i], vSize[i]));
+        }
+    }
+
+    // Accept the members one at a time, skipping their individual feerate
+    // checks, and take the whole package back out if any of them fails.
+    // Nothing was replaced, so removing the accepted members restores the
+    // mempool.
+    std::vector<CTransactionRef> vAccepted;
+    bool fAccepted = true;
+    BOOST_FOREACH(const CTransactionRef& ptx, package) {
+        if (pool.exists(ptx->GetHash()))
+            continue;
+        bool fMissingInputs = false;
+        if (!AcceptToMemoryPoolWorker(pool, state, ptx, false, &fMissingInputs, GetTime(), NULL, true, nAbsurdFee, vHashTxToUncache, true)) {
+            if (fMissingInputs)
+                state.Invalid(false, REJECT_INVALID, "package-missing-inputs", ptx->GetHash().ToString());
+            fAccepted = false;
+            break;
+        }
+        vAccepted.push_back(ptx);
+    }
+
+    if (fAccepted) {
+        // Trim once for the whole package. Mempool eviction goes by
+        // descendant feerate, so parents are protected by their children.
+        LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+        BOOST_FOREACH(const CTransactionRef& ptx, vAccepted) {
+            if (!pool.exists(ptx->GetHash())) {
+                fAccepted = false;
+                state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+                break;
+            }
+        }
+    }
+
+    if (fAccepted) {
+        BOOST_FOREACH(const CTransactionRef& ptx, vAccepted)
+            GetMainSignals().SyncTransaction(*ptx, NULL, CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
+    } else {
+        BOOST_REVERSE_FOREACH(const CTransactionRef& ptx, vAccepted)
+            pool.removeRecursive(*ptx);
+        BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
+            pcoinsTip->Uncache(hashTx);
+    }
+
+    // After we've (potentially) uncached entries, ensure our coins cache is still within its size limits
+    CValidationState stateDummy;
+    FlushStateToDisk(stateDummy, FLUSH_STATE_PERIODIC);
+    return fAccepted;
+}
+
 /** Return transaction in txOut, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransactionRef &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -2063,7 +2247,7 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode, int n
         nLastSetChain = nNow;
     }
     int64_t nMempoolSizeMax = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
-    int64_t cacheSize = pcoinsTip->DynamicMemoryUsage() * DB_PEAK_USAGE_FACTOR;
+    int64_t cacheSize = pcoinsTip->DynamicMemoryUsage();
     int64_t nTotalSpace = nCoinCacheUsage + std::max<int64_t>(nMempoolSizeMax - nMempoolUsage, 0);
     // The cache is large and we're within 10% and 200 MiB or 50% and 50MiB of the limit, but we have time now (not in the middle of a block processing).
     bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize > std::min(std::max(nTotalSpace / 2, nTotalSpace - MIN_BLOCK_COINSDB_USAGE * 1024 * 1024),
@@ -2511,6 +2695,10 @@ bool ActivateBestChain(CValidationState &state, const CChainParams& chainparams,
     // us in the middle of ProcessNewBlock - do not assume pblock is set
     // sanely for performance or correctness!
 
+    // cs_main is released between steps, so without this two callers could
+    // both pick a most-work chain and interleave their steps towards it.
+    LOCK(cs_activateBestChain);
+
     CBlockIndex *pindexMostWork = NULL;
     CBlockIndex *pindexNewTip = NULL;
     do {
@@ -3285,7 +3473,7 @@ static bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidation
     return true;
 }
 
-bool ProcessNewBlock(const CChainParams& chainparams, const std::shared_ptr<const CBlock> pblock, bool fForceProcessing, bool *fNewBlock)
+bool AcceptNewBlock(const CChainParams& chainparams, const std::shared_ptr<const CBlock> pblock, bool fForceProcessing, bool *fNewBlock)
 {
     {
         CBlockIndex *pindex = NULL;
@@ -3310,6 +3498,14 @@ bool ProcessNewBlock(const CChainParams& chainparams, const std::shared_ptr<cons
 
     NotifyHeaderTip();
 
+    return true;
+}
+
+bool ProcessNewBlock(const CChainParams& chainparams, const std::shared_ptr<const CBlock> pblock, bool fForceProcessing, bool *fNewBlock)
+{
+    if (!AcceptNewBlock(chainparams, pblock, fForceProcessing, fNewBlock))
+        return false;
+
     CValidationState state; // Only used to report errors, not invalidity - ignore it
     if (!ActivateBestChain(state, chainparams, pblock))
         return error("%s: ActivateBestChain failed", __func__);
@@ -3544,6 +3740,98 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+/** Apply the effects of a block on the coins view, tolerating outputs that were already added or spent */
+static bool RollforwardBlock(const CBlockIndex* pindex, CCoinsViewCache& view, const CChainParams& params)
+{
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex, params.GetConsensus()))
+        return error("%s: ReadBlockFromDisk failed at %d, hash=%s", __func__, pindex->nHeight, pindex->GetBlockHash().ToString());
+
+    for (const CTransactionRef& tx : block.vtx) {
+        if (!tx->IsCoinBase()) {
+            for (const CTxIn& txin : tx->vin) {
+                // Spending an output that is already spent is a no-op
+                CCoinsModifier coins = view.ModifyCoins(txin.prevout.hash);
+                coins->Spend(txin.prevout.n);
+            }
+        }
+        // Overwrite whatever made it to disk. Not ModifyNewCoins: the entry
+        // may exist in the database, so it must not be marked fresh.
+        view.ModifyCoins(tx->GetHash())->FromTx(*tx, pindex->nHeight);
+    }
+    return true;
+}
+
+/**
+ * Finish a coins database flush that was interrupted halfway, leaving some
+ * entries at the old best block and some at the new one: disconnect the
+ * blocks only on the old branch and reconnect those on the new one. Both
+ * writing and erasing an entry are idempotent, so this ends at the new best
+ * block whichever entries made it to disk.
+ */
+bool ReplayBlocks(const CChainParams& params, CCoinsViewCache* view)
+{
+    std::vector<uint256> vhashHeads = view->GetHeadBlocks();
+    if (vhashHeads.empty())
+        return true; // consistent
+    if (vhashHeads.size() != 2)
+        return error("%s: unknown inconsistent state", __func__);
+
+    uiInterface.ShowProgress(_("Replaying blocks..."), 0);
+    LogPrintf("Replaying blocks\n");
+
+    BlockMap::iterator itNew = mapBlockIndex.find(vhashHeads[0]);
+    if (itNew == mapBlockIndex.end())
+        return error("%s: flush to unknown block %s", __func__, vhashHeads[0].ToString());
+    const CBlockIndex* pindexNew = itNew->second;
+    const CBlockIndex* pindexOld = NULL;
+    const CBlockIndex* pindexFork = NULL;
+    if (!vhashHeads[1].IsNull()) { // null when it was the first flush
+        BlockMap::iterator itOld = mapBlockIndex.find(vhashHeads[1]);
+        if (itOld == mapBlockIndex.end())
+            return error("%s: flush from unknown block %s", __func__, vhashHeads[1].ToString());
+        pindexOld = itOld->second;
+        pindexFork = pindexOld->GetAncestor(std::min(pindexOld->nHeight, pindexNew->nHeight));
+        while (pindexFork && pindexNew->GetAncestor(pindexFork->nHeight) != pindexFork)
+            pindexFork = pindexFork->pprev;
+        assert(pindexFork != NULL);
+    }
+
+    CCoinsViewCache cache(view);
+
+    // Roll back along the old branch
+    for (; pindexOld != pindexFork; pindexOld = pindexOld->pprev) {
+        if (pindexOld->nHeight == 0)
+            break; // never disconnect the genesis block
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindexOld, params.GetConsensus()))
+            return error("%s: ReadBlockFromDisk failed at %d, hash=%s", __func__, pindexOld->nHeight, pindexOld->GetBlockHash().ToString());
+        LogPrintf("Rolling back %s (%i)\n", pindexOld->GetBlockHash().ToString(), pindexOld->nHeight);
+        CValidationState state;
+        // The block may not have been applied to every entry, so an unclean
+        // disconnect is expected
+        bool fClean = true;
+        cache.SetBestBlock(pindexOld->GetBlockHash());
+        if (!DisconnectBlock(block, state, pindexOld, cache, &fClean))
+            return error("%s: DisconnectBlock failed at %d, hash=%s", __func__, pindexOld->nHeight, pindexOld->GetBlockHash().ToString());
+    }
+
+    // Roll forward from the fork point to the new tip
+    int nForkHeight = pindexFork ? pindexFork->nHeight : 0;
+    for (int nHeight = nForkHeight + 1; nHeight <= pindexNew->nHeight; nHeight++) {
+        const CBlockIndex* pindex = pindexNew->GetAncestor(nHeight);
+        LogPrintf("Rolling forward %s (%i)\n", pindex->GetBlockHash().ToString(), nHeight);
+        if (!RollforwardBlock(pindex, cache, params))
+            return false;
+    }
+
+    cache.SetBestBlock(pindexNew->GetBlockHash());
+    if (!cache.Flush() || !view->Flush())
+        return error("%s: failed to write the replayed coins", __func__);
+    uiInterface.ShowProgress("", 100);
+    return true;
+}
+
 bool static LoadBlockIndexDB(const CChainParams& chainparams)
 {
     if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
@@ -3638,6 +3926,10 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
 
+    // Finish a coins database flush that was interrupted by a crash
+    if (!ReplayBlocks(chainparams, pcoinsTip))
+        return error("%s: unable to replay blocks, rebuild the database using -reindex-chainstate", __func__);
+
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())